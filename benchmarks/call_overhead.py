@@ -0,0 +1,57 @@
+"""Measure the per-call overhead of the ``Queue`` methods and ``fib``.
+
+The work done by each call is tiny so the time is dominated by argument
+passing. Run this against two builds to compare calling conventions:
+
+.. code-block:: bash
+
+   $ python benchmarks/call_overhead.py --queue queue.queue --fib fib.fib
+"""
+import argparse
+import importlib
+import timeit
+
+
+def measure(stmt, setup, namespace, repeat=7, number=200000):
+    """Return the best time per call of ``stmt`` in nanoseconds.
+    """
+    timer = timeit.Timer(stmt, setup, globals=namespace)
+    return min(timer.repeat(repeat=repeat, number=number)) / number * 1e9
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument(
+        '--queue',
+        default='queue.queue',
+        help='the module providing Queue',
+    )
+    parser.add_argument(
+        '--fib',
+        default='fib.fib',
+        help='the module providing fib',
+    )
+    parser.add_argument('--number', type=int, default=200000)
+    args = parser.parse_args(argv)
+
+    namespace = {
+        'Queue': importlib.import_module(args.queue).Queue,
+        'fib': importlib.import_module(args.fib).fib,
+    }
+    cases = [
+        ('Queue()', 'Queue()', ''),
+        ('Queue(maxsize=...)', 'Queue(maxsize=10)', ''),
+        ('push + pop', 'q.push(None); q.pop()', 'q = Queue()'),
+        ('push(element=...) + pop', 'q.push(element=None); q.pop()',
+         'q = Queue()'),
+        ('rotate(1)', 'q.rotate(1)', 'q = Queue(); q.push(1); q.push(2)'),
+        ('fib(10)', 'fib(10)', ''),
+        ('fib(10, a=..., b=...)', 'fib(10, a=1, b=1)', ''),
+    ]
+    for name, stmt, setup in cases:
+        ns = measure(stmt, setup, namespace, number=args.number)
+        print('{:<28}{:>8.1f} ns'.format(name, ns))
+
+
+if __name__ == '__main__':
+    main()
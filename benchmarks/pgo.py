@@ -0,0 +1,250 @@
+"""Build the extensions with profile-guided and link-time optimization.
+
+This runs the three steps of a profile-guided build for one of the projects:
+
+1. build with instrumentation (``-fprofile-generate``)
+2. run the training workload in ``training.py`` to record a profile
+3. rebuild with the profile and ``-flto`` (``-fprofile-use``)
+
+The extensions are built in place, like ``setup.py build_ext --inplace``, so
+the optimized build replaces the default one.
+
+.. code-block:: bash
+
+   $ python benchmarks/pgo.py fib
+   $ python benchmarks/pgo.py queue
+   $ python benchmarks/pgo.py variants --compare
+
+``--compare`` first builds the extensions with the default flags and keeps
+them in ``build/default``. Afterwards it loads both builds into one process
+and times each workload of the training set with them in turn, so that drift
+in the machine's speed affects both alike, then reports the speedup.
+
+The flags reach ``setup.py`` through ``CFLAGS`` and ``LDFLAGS``, on top of any
+already set. They are GCC's, so this refuses to run with another compiler.
+The profile goes in ``build/pgo`` next to the ``setup.py``.
+"""
+import argparse
+import importlib.machinery
+import importlib.util
+import os
+import shlex
+import shutil
+import subprocess
+import sys
+import sysconfig
+
+import training
+from variants import FIB, QUEUE
+
+
+here = os.path.dirname(os.path.abspath(__file__))
+root = os.path.dirname(here)
+
+# project name -> (the directory with the setup.py, the `(kind, module)` pairs
+# for `training.py`, whether the setup.py must run without its own directory
+# on the path)
+#
+# `exercises/queue` has a `queue` package which would shadow the standard
+# library's for setuptools.
+PROJECTS = {
+    'fib': (
+        os.path.join(root, 'exercises', 'fib'),
+        [('fib', 'fib.fib')],
+        False,
+    ),
+    'queue': (
+        os.path.join(root, 'exercises', 'queue'),
+        [('queue', 'queue.queue')],
+        True,
+    ),
+    'variants': (
+        here,
+        [
+            (kind, 'variants.' + name)
+            for kind, variants in (('fib', FIB), ('queue', QUEUE))
+            for name, _, _ in variants
+        ],
+        False,
+    ),
+}
+
+
+def check_compiler():
+    """Exit unless the compiler which setuptools will use is GCC."""
+    compiler = shlex.split(
+        os.environ.get('CC') or sysconfig.get_config_var('CC') or 'cc',
+    )
+    try:
+        version = subprocess.run(
+            compiler + ['--version'],
+            check=True,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT,
+            universal_newlines=True,
+        ).stdout
+    except (OSError, subprocess.CalledProcessError) as e:
+        raise SystemExit('cannot run the compiler {}: {}'.format(
+            ' '.join(compiler),
+            e,
+        ))
+    # clang, also when installed as `gcc`, doesn't claim this
+    if 'Free Software Foundation' not in version:
+        raise SystemExit(
+            'the profile-guided build needs GCC, but the compiler is {}:\n'
+            '{}set CC to a GCC'.format(' '.join(compiler), version),
+        )
+
+
+def pgo_flags(profile_dir, mode):
+    """The compiler and linker flags for the instrumented (``'generate'``)
+    or optimized (``'use'``) build.
+    """
+    if mode == 'generate':
+        return ['-fprofile-generate=' + profile_dir]
+    return [
+        '-fprofile-use=' + profile_dir,
+        # the training run doesn't reach every path, leave those optimized
+        # for speed instead of size
+        '-fprofile-partial-training',
+        '-flto',
+    ]
+
+
+def build(directory, safe_path, profile_dir, mode=None):
+    env = dict(os.environ)
+    if mode is not None:
+        flags = ' '.join(pgo_flags(profile_dir, mode))
+        for name in ('CFLAGS', 'LDFLAGS'):
+            env[name] = (env.get(name, '') + ' ' + flags).strip()
+    print('building {} ({})'.format(directory, mode or 'default'), flush=True)
+    python = [sys.executable]
+    if safe_path:
+        if sys.version_info < (3, 11):
+            raise SystemExit(
+                'building {} needs -P from Python 3.11'.format(directory),
+            )
+        python.append('-P')
+    subprocess.run(
+        python + ['setup.py', '-q', 'build_ext', '--inplace', '--force'],
+        check=True,
+        cwd=directory,
+        env=env,
+        stdout=subprocess.DEVNULL,
+    )
+
+
+def train(directory, modules):
+    """Run the training workload on the instrumented build. The profile is
+    written when the process exits.
+    """
+    subprocess.run(
+        [
+            sys.executable,
+            os.path.join(here, 'training.py'),
+            '--path', directory,
+        ] + [
+            argument
+            for kind, module in modules
+            for argument in ('--' + kind, module)
+        ],
+        check=True,
+        stdout=subprocess.DEVNULL,
+    )
+
+
+def load(directory, label, module):
+    """Import ``module`` from the build in ``directory`` as
+    ``<label>.<module>``, so that two builds of it can be loaded at once.
+    """
+    base = os.path.join(directory, *module.split('.'))
+    for suffix in importlib.machinery.EXTENSION_SUFFIXES:
+        if os.path.exists(base + suffix):
+            spec = importlib.util.spec_from_file_location(
+                label + '.' + module,
+                base + suffix,
+            )
+            loaded = importlib.util.module_from_spec(spec)
+            spec.loader.exec_module(loaded)
+            return loaded
+    raise SystemExit('no build of {} in {}'.format(module, directory))
+
+
+def compare(default_dir, directory, modules, repeat):
+    print()
+    print('{:<48}{:>10}{:>10}{:>9}'.format(
+        '',
+        'default',
+        'pgo+lto',
+        'speedup',
+    ))
+    for kind, module in modules:
+        attribute, workloads = training.WORKLOADS[kind]
+        default = getattr(load(default_dir, 'default', module), attribute)
+        optimized = getattr(load(directory, 'optimized', module), attribute)
+        for workload in workloads:
+            key = '{}: {}'.format(module, workload.__name__)
+            default_times = []
+            optimized_times = []
+            try:
+                for _ in range(repeat):
+                    default_times.append(training.timed(workload, default))
+                    optimized_times.append(
+                        training.timed(workload, optimized),
+                    )
+            except training.SKIPPED as e:
+                print('{:<48}skipped: {}'.format(key, e))
+                continue
+
+            print('{:<48}{:>9.3f}s{:>9.3f}s{:>8.2f}x'.format(
+                key,
+                min(default_times),
+                min(optimized_times),
+                min(default_times) / min(optimized_times),
+            ), flush=True)
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('project', choices=sorted(PROJECTS))
+    parser.add_argument(
+        '--compare',
+        action='store_true',
+        help='time the training workload with the default build too',
+    )
+    parser.add_argument(
+        '--repeat',
+        type=int,
+        default=5,
+        help='the runs of each workload to take the fastest of',
+    )
+    args = parser.parse_args(argv)
+
+    check_compiler()
+    directory, modules, safe_path = PROJECTS[args.project]
+    profile_dir = os.path.join(directory, 'build', 'pgo')
+    default_dir = os.path.join(directory, 'build', 'default')
+
+    if args.compare:
+        build(directory, safe_path, profile_dir)
+        shutil.rmtree(default_dir, ignore_errors=True)
+        for package in {module.split('.')[0] for _, module in modules}:
+            shutil.copytree(
+                os.path.join(directory, package),
+                os.path.join(default_dir, package),
+                ignore=shutil.ignore_patterns('__pycache__'),
+            )
+
+    # a stale profile from an older source would only produce warnings
+    shutil.rmtree(profile_dir, ignore_errors=True)
+    build(directory, safe_path, profile_dir, 'generate')
+    print('training', flush=True)
+    train(directory, modules)
+    build(directory, safe_path, profile_dir, 'use')
+
+    if args.compare:
+        compare(default_dir, directory, modules, args.repeat)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,259 @@
+"""Measure the throughput of the queue types with producer and consumer
+threads.
+
+The producers push ``--items`` integers between them and the consumers pop
+until they see an end marker. ``Queue`` uses blocking ``push`` and ``pop``;
+the lock-free queues never block, so their threads retry when the queue is
+full or empty. The ``async`` cases pop with ``Queue.async_pop`` from tasks on
+an event loop in the main thread instead, which the producer threads have to
+wake up. The interesting numbers come from a free-threaded build, where the
+threads really run in parallel:
+
+.. code-block:: bash
+
+   $ python3.13t benchmarks/queue_threads.py --queue queue.queue
+
+Every run checks that every pushed item was popped. Before timing, the
+lock-free queues are checked at their smallest capacity, and ``SharedQueue``
+with records of every size. The script exits with an error if a check
+fails.
+"""
+import argparse
+import asyncio
+import importlib
+import sys
+import threading
+import time
+
+
+def push_all(q, items, full):
+    push = q.push
+    for item in items:
+        while True:
+            try:
+                push(item)
+                break
+            except full:
+                time.sleep(0)
+
+
+def pop_until_sentinel(q, empty):
+    """Pop until the end marker and return the number of items popped."""
+    pop = q.pop
+    popped = 0
+    while True:
+        try:
+            item = pop()
+        except empty:
+            time.sleep(0)
+            continue
+        if item is None:
+            return popped
+        popped += 1
+
+
+def check_received(expected, counts):
+    if sum(counts) != expected:
+        raise SystemExit('pushed {} items but popped {}'.format(
+            expected,
+            sum(counts),
+        ))
+
+
+def check_capacity(cls, full, empty):
+    """Fill the smallest ``cls`` to its reported ``maxsize`` and check that
+    one more push is refused and the items come back in order.
+    """
+    q = cls(maxsize=1)
+    items = [object() for _ in range(q.maxsize)]
+    for item in items:
+        q.push(item)
+    try:
+        q.push(None)
+    except full:
+        pass
+    else:
+        raise SystemExit('{}(maxsize=1) took {} items'.format(
+            cls.__name__,
+            q.maxsize + 1,
+        ))
+    for item in items:
+        if q.pop() is not item:
+            raise SystemExit('{}(maxsize=1) lost an item'.format(
+                cls.__name__,
+            ))
+    try:
+        q.pop()
+    except empty:
+        pass
+    else:
+        raise SystemExit('{}(maxsize=1) popped too many items'.format(
+            cls.__name__,
+        ))
+
+
+def check_shared_records(SharedQueue, full):
+    """Push records of every size up to the whole area through an empty
+    ``SharedQueue`` whose cursors have moved away from the start.
+    """
+    q = SharedQueue(64)
+    # records take 8 bytes of header plus the payload rounded up to 8, so
+    # pushing `offset - 8` bytes moves the cursors by `offset`
+    for size in range(0, 64 - 8 + 1):
+        for offset in range(0, 64, 8):
+            payloads = [bytes(size)]
+            if offset:
+                payloads.insert(0, bytes(offset - 8))
+            for payload in payloads:
+                try:
+                    q.push(payload, block=False)
+                except full:
+                    raise SystemExit(
+                        'a record of {} bytes did not fit in an empty '
+                        'SharedQueue'.format(len(payload)),
+                    )
+                q.pop().release()
+
+
+def run(q, producers, consumers, count, full, empty):
+    """Move ``producers * count`` items through ``q`` and return the number of
+    items per second.
+    """
+    barrier = threading.Barrier(producers + consumers + 1)
+    items = list(range(count))
+
+    def producer():
+        barrier.wait()
+        push_all(q, items, full)
+
+    counts = []
+
+    def consumer():
+        barrier.wait()
+        counts.append(pop_until_sentinel(q, empty))
+
+    producer_threads = [
+        threading.Thread(target=producer) for _ in range(producers)
+    ]
+    consumer_threads = [
+        threading.Thread(target=consumer) for _ in range(consumers)
+    ]
+    for thread in producer_threads + consumer_threads:
+        thread.start()
+
+    barrier.wait()
+    start = time.perf_counter()
+    for thread in producer_threads:
+        thread.join()
+    # one ``None`` per consumer marks the end of the stream
+    push_all(q, [None] * consumers, full)
+    for thread in consumer_threads:
+        thread.join()
+    elapsed = time.perf_counter() - start
+    check_received(producers * count, counts)
+
+    return producers * count / elapsed
+
+
+def run_async(q, producers, consumers, count, full, empty):
+    """Like ``run``, but the consumers are tasks on an event loop which await
+    ``q.async_pop()``.
+    """
+    barrier = threading.Barrier(producers + 1)
+    items = list(range(count))
+
+    def producer():
+        barrier.wait()
+        push_all(q, items, full)
+
+    async def consumer():
+        pop = q.async_pop
+        popped = 0
+        while True:
+            # a producer which failed to wake us would stall here
+            item = await asyncio.wait_for(pop(), 10)
+            if item is None:
+                return popped
+            popped += 1
+
+    async def main():
+        tasks = [asyncio.ensure_future(consumer()) for _ in range(consumers)]
+        producer_threads = [
+            threading.Thread(target=producer) for _ in range(producers)
+        ]
+        for thread in producer_threads:
+            thread.start()
+
+        barrier.wait()
+        start = time.perf_counter()
+        await asyncio.get_running_loop().run_in_executor(
+            None,
+            lambda: [thread.join() for thread in producer_threads],
+        )
+        # The consumers run on this loop, so waiting for space here with a
+        # blocking push would stop them from ever making any.
+        for _ in range(consumers):
+            await q.async_push(None)
+        counts = await asyncio.gather(*tasks)
+        elapsed = time.perf_counter() - start
+        check_received(producers * count, counts)
+        return producers * count / elapsed
+
+    return asyncio.run(main())
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument(
+        '--queue',
+        default='queue.queue',
+        help='the module providing the queue types',
+    )
+    parser.add_argument('--items', type=int, default=200000)
+    parser.add_argument('--maxsize', type=int, default=1024)
+    parser.add_argument('--repeat', type=int, default=3)
+    args = parser.parse_args(argv)
+
+    module = importlib.import_module(args.queue)
+    gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+    print('GIL enabled: {}'.format(gil))
+
+    # the smallest rings are where the lock-free protocols are easiest to get
+    # wrong, so check them before timing anything
+    for cls in (module.SPSCQueue, module.MPMCQueue):
+        check_capacity(cls, module.Full, module.Empty)
+    # `SharedQueue` is Linux only
+    if hasattr(module, 'SharedQueue'):
+        check_shared_records(module.SharedQueue, module.Full)
+
+    cases = [
+        ('Queue', module.Queue, 1, 1, run),
+        ('SPSCQueue', module.SPSCQueue, 1, 1, run),
+        ('MPMCQueue', module.MPMCQueue, 1, 1, run),
+        ('Queue', module.Queue, 4, 4, run),
+        ('MPMCQueue', module.MPMCQueue, 4, 4, run),
+        ('Queue async', module.Queue, 1, 1, run_async),
+        ('Queue async', module.Queue, 4, 4, run_async),
+    ]
+    for name, cls, producers, consumers, runner in cases:
+        best = max(
+            runner(
+                cls(maxsize=args.maxsize),
+                producers,
+                consumers,
+                args.items // producers,
+                module.Full,
+                module.Empty,
+            )
+            for _ in range(args.repeat)
+        )
+        print('{:<16}{}p/{}c {:>12,.0f} items/s'.format(
+            name,
+            producers,
+            consumers,
+            best,
+        ))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,46 @@
+"""Build every fib and queue implementation as its own extension for the
+benchmark suite:
+
+.. code-block:: bash
+
+   $ cd benchmarks
+   $ python setup.py build_ext --inplace
+   $ python suite.py run --output results.json
+"""
+import os
+
+from setuptools import setup, Extension
+from setuptools.command.build_ext import build_ext as _build_ext
+
+from variants import VARIANTS
+
+
+# setuptools wants sources relative to the working directory
+root = os.path.relpath(
+    os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir),
+)
+
+
+class build_ext(_build_ext):
+    def build_extensions(self):
+        # The objects for the `../exercises` sources go in `build_temp/..`,
+        # which the compiler can only resolve once `build_temp` exists.
+        os.makedirs(self.build_temp, exist_ok=True)
+        super().build_extensions()
+
+
+setup(
+    name='benchmarks',
+    version='0.1.0',
+    packages=['variants'],
+    license='GPL-2',
+    cmdclass={'build_ext': build_ext},
+    ext_modules=[
+        Extension(
+            'variants.' + name,
+            [os.path.join(root, source)],
+            define_macros=[('PyInit_' + original, 'PyInit_' + name)],
+        )
+        for name, source, original in VARIANTS
+    ],
+)
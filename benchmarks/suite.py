@@ -0,0 +1,455 @@
+"""Benchmark every fib and queue implementation and compare the results
+against a baseline.
+
+Build the variants first with ``benchmarks/setup.py``. Each variant runs in
+fresh worker processes, like pyperf does, so that one variant's allocations
+and hash seeds don't skew the next. A worker calibrates the number of loops
+for each benchmark, runs warmups, then records a number of timed values.
+
+.. code-block:: bash
+
+   $ cd benchmarks
+   $ python setup.py build_ext --inplace
+   $ python suite.py run --output baseline.json
+   $ # ... change something and rebuild ...
+   $ python suite.py run --output results.json --baseline baseline.json
+   $ python suite.py compare baseline.json results.json
+
+``compare``, and ``run`` with ``--baseline``, exit with status 1 when any
+benchmark is significantly slower than the baseline.
+"""
+import argparse
+import datetime
+import importlib
+import json
+import math
+import os
+import platform
+import statistics
+import subprocess
+import sys
+import time
+
+from variants import FIB, QUEUE
+
+
+FORMAT_VERSION = 1
+
+# the fib indices to time; the small ones measure call overhead and the large
+# ones the arithmetic
+FIB_NS = [0, 10, 90, 1000, 10000]
+FIB_NS_FAST = [10, 1000]
+
+# the number of elements in the queue for each queue benchmark
+QUEUE_SIZES = [16, 1024, 65536]
+QUEUE_SIZES_FAST = [16, 1024]
+
+
+def filled(Queue, size):
+    q = Queue()
+    push = q.push
+    for n in range(size):
+        push(n)
+    return q
+
+
+def bench_fib(fib, n):
+    def time_loops(loops):
+        it = range(loops)
+        start = time.perf_counter()
+        for _ in it:
+            fib(n)
+        return time.perf_counter() - start
+
+    fib(n)
+    return time_loops, 1
+
+
+def bench_push_pop(Queue, size):
+    """``push`` then ``pop`` one element on a queue which holds ``size``."""
+    q = filled(Queue, size)
+    push = q.push
+    pop = q.pop
+
+    def time_loops(loops):
+        it = range(loops)
+        start = time.perf_counter()
+        for _ in it:
+            push(None)
+            pop()
+        return time.perf_counter() - start
+
+    return time_loops, 1
+
+
+def bench_fill(Queue, size):
+    """``push`` ``size`` elements onto an empty queue, per element."""
+    elements = list(range(size))
+
+    def time_loops(loops):
+        total = 0.0
+        for _ in range(loops):
+            q = Queue()
+            push = q.push
+            start = time.perf_counter()
+            for element in elements:
+                push(element)
+            total += time.perf_counter() - start
+        return total
+
+    return time_loops, size
+
+
+def bench_drain(Queue, size):
+    """``pop`` every element of a full queue, per element."""
+    it = range(size)
+
+    def time_loops(loops):
+        total = 0.0
+        for _ in range(loops):
+            q = filled(Queue, size)
+            pop = q.pop
+            start = time.perf_counter()
+            for _ in it:
+                pop()
+            total += time.perf_counter() - start
+        return total
+
+    return time_loops, size
+
+
+def bench_rotate(Queue, size, steps):
+    q = filled(Queue, size)
+    rotate = q.rotate
+
+    def time_loops(loops):
+        it = range(loops)
+        start = time.perf_counter()
+        for _ in it:
+            rotate(steps)
+        return time.perf_counter() - start
+
+    return time_loops, 1
+
+
+def bench_contains(Queue, size):
+    """Look for an element which isn't in the queue."""
+    q = filled(Queue, size)
+
+    def time_loops(loops):
+        it = range(loops)
+        start = time.perf_counter()
+        for _ in it:
+            -1 in q
+        return time.perf_counter() - start
+
+    return time_loops, 1
+
+
+def benchmarks(kind, module, fast):
+    """Yield ``(name, setup)`` for every benchmark of a variant, where
+    ``setup()`` returns ``(time_loops, ops)``. ``time_loops(loops)`` returns
+    the seconds taken by ``loops`` iterations of ``ops`` operations each.
+    """
+    if kind == 'fib':
+        for n in FIB_NS_FAST if fast else FIB_NS:
+            yield 'fib({})'.format(n), lambda n=n: bench_fib(module.fib, n)
+        return
+
+    Queue = module.Queue
+    for size in QUEUE_SIZES_FAST if fast else QUEUE_SIZES:
+        yield (
+            'push+pop[{}]'.format(size),
+            lambda size=size: bench_push_pop(Queue, size),
+        )
+        yield 'fill[{}]'.format(size), lambda size=size: bench_fill(Queue, size)
+        yield (
+            'drain[{}]'.format(size),
+            lambda size=size: bench_drain(Queue, size),
+        )
+        yield (
+            'rotate(1)[{}]'.format(size),
+            lambda size=size: bench_rotate(Queue, size, 1),
+        )
+        yield (
+            'rotate(n/3)[{}]'.format(size),
+            lambda size=size: bench_rotate(Queue, size, size // 3),
+        )
+        yield (
+            'contains[{}]'.format(size),
+            lambda size=size: bench_contains(Queue, size),
+        )
+
+
+def calibrate(time_loops, min_time):
+    """Find the number of loops which takes at least ``min_time`` seconds.
+    """
+    loops = 1
+    while True:
+        elapsed = time_loops(loops)
+        if elapsed >= min_time or loops >= 2 ** 32:
+            return loops
+        # aim a bit past `min_time`, but never grow by more than 10x at once
+        if elapsed > 0:
+            loops = int(loops * min(10, max(2, 1.2 * min_time / elapsed)))
+        else:
+            loops *= 10
+
+
+def worker(args):
+    """Run every benchmark of one variant and print the per-operation times
+    as JSON.
+    """
+    kind = 'fib' if any(name == args.variant for name, _, _ in FIB) else 'queue'
+    module = importlib.import_module('variants.' + args.variant)
+
+    results = {}
+    for name, setup in benchmarks(kind, module, args.fast):
+        try:
+            time_loops, ops = setup()
+            time_loops(1)
+        except NotImplementedError as e:
+            # the exercise stubs raise this until they are filled in
+            results[name] = {'skipped': str(e) or 'not implemented'}
+            continue
+
+        loops = calibrate(time_loops, args.min_time)
+        for _ in range(args.warmups):
+            time_loops(loops)
+        results[name] = {
+            'loops': loops,
+            'values': [
+                time_loops(loops) / (loops * ops)
+                for _ in range(args.values)
+            ],
+        }
+
+    json.dump(results, sys.stdout)
+
+
+def summarize(values):
+    return {
+        'values': values,
+        'mean': statistics.mean(values),
+        'median': statistics.median(values),
+        'stdev': statistics.stdev(values) if len(values) > 1 else 0.0,
+        'min': min(values),
+    }
+
+
+def run(args):
+    names = [name for name, _, _ in FIB + QUEUE]
+    if args.variant:
+        unknown = set(args.variant) - set(names)
+        if unknown:
+            raise SystemExit('unknown variants: ' + ', '.join(sorted(unknown)))
+        names = [name for name in names if name in args.variant]
+
+    command = [
+        sys.executable,
+        os.path.abspath(__file__),
+        'worker',
+        '--values', str(args.values),
+        '--warmups', str(args.warmups),
+        '--min-time', str(args.min_time),
+    ]
+    if args.fast:
+        command.append('--fast')
+
+    summaries = {}
+    skipped = {}
+    for variant in names:
+        samples = {}
+        for process in range(args.processes):
+            out = subprocess.run(
+                command + ['--variant', variant],
+                check=True,
+                stdout=subprocess.PIPE,
+                cwd=os.path.dirname(os.path.abspath(__file__)),
+            ).stdout
+            for name, result in json.loads(out).items():
+                key = '{}: {}'.format(variant, name)
+                if 'skipped' in result:
+                    skipped[key] = result['skipped']
+                else:
+                    samples.setdefault(key, []).extend(result['values'])
+
+        for key, values in samples.items():
+            summaries[key] = summarize(values)
+            print('{:<48}{}'.format(key, format_time(summaries[key])))
+        sys.stdout.flush()
+
+    for key, reason in skipped.items():
+        print('{:<48}skipped: {}'.format(key, reason))
+
+    results = {
+        'version': FORMAT_VERSION,
+        'date': datetime.datetime.now().isoformat(timespec='seconds'),
+        'python': sys.version,
+        'platform': platform.platform(),
+        'options': {
+            'processes': args.processes,
+            'values': args.values,
+            'warmups': args.warmups,
+            'min_time': args.min_time,
+            'fast': args.fast,
+        },
+        'benchmarks': summaries,
+        'skipped': skipped,
+    }
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write('\n')
+
+    if args.baseline:
+        return report(load(args.baseline), results, args.threshold)
+    return 0
+
+
+def format_seconds(seconds):
+    for unit, scale in (('s', 1), ('ms', 1e3), ('us', 1e6), ('ns', 1e9)):
+        if seconds * scale >= 1 or unit == 'ns':
+            return '{:.2f} {}'.format(seconds * scale, unit)
+
+
+def format_time(result):
+    return '{:>12} +- {:.1f}%'.format(
+        format_seconds(result['mean']),
+        100 * result['stdev'] / result['mean'] if result['mean'] else 0,
+    )
+
+
+def load(path):
+    with open(path) as f:
+        results = json.load(f)
+    if results.get('version') != FORMAT_VERSION:
+        raise SystemExit('{}: unsupported results version'.format(path))
+    return results
+
+
+def significant(base, new):
+    """Whether the means differ by more than the noise, using Welch's t-test
+    at about 99% confidence.
+    """
+    error = math.sqrt(
+        base['stdev'] ** 2 / len(base['values']) +
+        new['stdev'] ** 2 / len(new['values']),
+    )
+    if not error:
+        return base['mean'] != new['mean']
+    return abs(new['mean'] - base['mean']) / error > 2.6
+
+
+def report(baseline, results, threshold):
+    """Print each benchmark against the baseline and return 1 if any is
+    slower by more than ``threshold`` and more than the noise.
+    """
+    slower = 0
+    base_benchmarks = baseline['benchmarks']
+    new_benchmarks = results['benchmarks']
+    print()
+    print('{:<48}{:>12}{:>12}{:>9}'.format('', 'baseline', 'new', 'change'))
+    for key in sorted(set(base_benchmarks) | set(new_benchmarks)):
+        base = base_benchmarks.get(key)
+        new = new_benchmarks.get(key)
+        if not base or not new:
+            print('{:<48}{}'.format(
+                key,
+                'only in baseline' if base else 'not in baseline',
+            ))
+            continue
+
+        ratio = new['mean'] / base['mean']
+        flag = ''
+        if significant(base, new):
+            if ratio > 1 + threshold:
+                flag = 'SLOWER'
+                slower += 1
+            elif ratio < 1 / (1 + threshold):
+                flag = 'faster'
+        print('{:<48}{:>12}{:>12}{:>+8.1f}% {}'.format(
+            key,
+            format_seconds(base['mean']),
+            format_seconds(new['mean']),
+            100 * (ratio - 1),
+            flag,
+        ))
+
+    print()
+    print('{} significantly slower than the baseline'.format(slower))
+    return 1 if slower else 0
+
+
+def compare(args):
+    return report(load(args.baseline), load(args.results), args.threshold)
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    def add_run_options(command):
+        command.add_argument(
+            '--values',
+            type=int,
+            default=5,
+            help='the timed values per benchmark per process',
+        )
+        command.add_argument('--warmups', type=int, default=1)
+        command.add_argument(
+            '--min-time',
+            type=float,
+            default=0.05,
+            help='the least seconds for one value',
+        )
+        command.add_argument(
+            '--fast',
+            action='store_true',
+            help='time fewer sizes, for a quick check',
+        )
+
+    def add_threshold(command):
+        command.add_argument(
+            '--threshold',
+            type=float,
+            default=0.05,
+            help='the smallest slowdown to flag, as a fraction',
+        )
+
+    run_parser = commands.add_parser('run', help='run the benchmarks')
+    add_run_options(run_parser)
+    run_parser.add_argument('--processes', type=int, default=3)
+    run_parser.add_argument(
+        '--variant',
+        action='append',
+        help='only run this variant; may be repeated',
+    )
+    run_parser.add_argument('--output', help='write the results as JSON')
+    run_parser.add_argument(
+        '--baseline',
+        help='compare against these results afterwards',
+    )
+    add_threshold(run_parser)
+    run_parser.set_defaults(func=run)
+
+    compare_parser = commands.add_parser(
+        'compare',
+        help='compare two results files',
+    )
+    compare_parser.add_argument('baseline')
+    compare_parser.add_argument('results')
+    add_threshold(compare_parser)
+    compare_parser.set_defaults(func=compare)
+
+    worker_parser = commands.add_parser('worker')
+    add_run_options(worker_parser)
+    worker_parser.add_argument('--variant', required=True)
+    worker_parser.set_defaults(func=worker)
+
+    args = parser.parse_args(argv)
+    return args.func(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
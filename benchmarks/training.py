@@ -0,0 +1,182 @@
+"""The training workload for the profile-guided build in ``pgo.py``.
+
+The instrumented extensions record which branches and calls this workload
+takes, and the optimized build lays out the code around them. So it should
+look like real use: sweeps of ``fib`` over small and large indices, and queue
+churn at several depths with single and batched pushes and pops.
+
+.. code-block:: bash
+
+   $ python training.py --fib variants.fib_complete \
+         --queue variants.queue_complete
+   $ python training.py --path ../exercises/fib --fib fib.fib --repeat 5
+
+``--path`` imports the modules from another directory first. With ``--repeat``
+each workload runs that many times and prints its fastest time.
+"""
+import argparse
+import importlib
+import random
+import sys
+import time
+
+
+class Unsupported(Exception):
+    """The module doesn't have what a workload needs."""
+
+
+def require(Queue, *names):
+    missing = [name for name in names if not hasattr(Queue, name)]
+    if missing:
+        raise Unsupported('no ' + ', '.join(missing))
+
+
+def fib_small(fib):
+    """Every index whose result fits in a machine word, many times."""
+    for _ in range(5000):
+        for n in range(94):
+            fib(n)
+
+
+def fib_large(fib):
+    """A sweep of indices whose results need arbitrary precision."""
+    for _ in range(10):
+        for n in range(94, 20000, 97):
+            fib(n)
+
+
+def queue_steady(Queue):
+    """A producer and a consumer which keep the queue at a fixed depth."""
+    for depth in (0, 16, 1024):
+        q = Queue()
+        push = q.push
+        pop = q.pop
+        for n in range(depth):
+            push(n)
+        for n in range(500000):
+            push(n)
+            pop()
+
+
+def queue_bursts(Queue):
+    """Bursts of pushes drained by bursts of pops, so the queue grows and
+    shrinks.
+    """
+    rng = random.Random(0)
+    q = Queue()
+    push = q.push
+    pop = q.pop
+    size = 0
+    for _ in range(10000):
+        for n in range(rng.randrange(1, 256)):
+            push(n)
+            size += 1
+        for _ in range(rng.randrange(0, size + 1)):
+            pop()
+            size -= 1
+
+
+def queue_batches(Queue):
+    """``push_many`` and ``pop_many`` with assorted batch sizes."""
+    require(Queue, 'push_many', 'pop_many')
+    rng = random.Random(1)
+    batches = [list(range(rng.randrange(1, 512))) for _ in range(64)]
+    q = Queue()
+    for _ in range(800):
+        for batch in batches:
+            q.push_many(batch)
+            q.pop_many(len(batch))
+
+
+def queue_bounded(Queue):
+    """A bounded queue which overwrites its oldest elements when full."""
+    require(Queue, 'overflow')
+    q = Queue(maxsize=256, overflow='overwrite_oldest')
+    push = q.push
+    for n in range(2000000):
+        push(n)
+
+
+def queue_inspect(Queue):
+    """The read side: ``rotate``, ``in``, ``len`` and iteration."""
+    require(Queue, 'rotate', '__contains__', '__iter__')
+    q = Queue()
+    for n in range(4096):
+        q.push(n)
+    for steps in range(1, 4000):
+        q.rotate(steps)
+        steps in q
+        len(q)
+    for _ in range(200):
+        for _ in q:
+            pass
+
+
+# the kind of module -> (the attribute which the workloads use, the workloads)
+WORKLOADS = {
+    'fib': ('fib', [fib_small, fib_large]),
+    'queue': (
+        'Queue',
+        [
+            queue_steady,
+            queue_bursts,
+            queue_batches,
+            queue_bounded,
+            queue_inspect,
+        ],
+    ),
+}
+
+# the exercise stubs raise NotImplementedError until they are filled in, and
+# don't have the extensions to the exercise
+SKIPPED = (NotImplementedError, Unsupported)
+
+
+def timed(workload, target):
+    start = time.perf_counter()
+    workload(target)
+    return time.perf_counter() - start
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    for kind, (attribute, _) in WORKLOADS.items():
+        parser.add_argument(
+            '--' + kind,
+            action='append',
+            default=[],
+            help='a module which defines {}; may be repeated'.format(
+                attribute,
+            ),
+        )
+    parser.add_argument(
+        '--path',
+        help='a directory to import the modules from',
+    )
+    parser.add_argument(
+        '--repeat',
+        type=int,
+        default=1,
+        help='run each workload this many times and print the fastest',
+    )
+    args = parser.parse_args(argv)
+    if args.path:
+        sys.path.insert(0, args.path)
+
+    for kind, (attribute, workloads) in WORKLOADS.items():
+        for name in getattr(args, kind):
+            target = getattr(importlib.import_module(name), attribute)
+            for workload in workloads:
+                key = '{}: {}'.format(name, workload.__name__)
+                try:
+                    seconds = min(
+                        timed(workload, target) for _ in range(args.repeat)
+                    )
+                except SKIPPED as e:
+                    print('{:<48}skipped: {}'.format(key, e))
+                    continue
+                print('{:<48}{:.3f} s'.format(key, seconds))
+
+
+if __name__ == '__main__':
+    main()
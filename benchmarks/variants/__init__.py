@@ -0,0 +1,26 @@
+"""Every implementation of the exercises, built side by side as
+``variants.<name>`` by ``benchmarks/setup.py``.
+
+Each source defines ``PyInit_fib`` or ``PyInit_queue``; the build renames it
+with ``-DPyInit_fib=PyInit_<name>`` so one interpreter can import them all.
+"""
+
+# (module name, source relative to the repository root, original module name)
+FIB = [
+    ('fib', 'exercises/fib/fib/fib.c', 'fib'),
+    ('fib_error_handling', 'exercises/fib/fib/fib-error-handling.c', 'fib'),
+    ('fib_abstract_api', 'exercises/fib/fib/fib-abstract-api.c', 'fib'),
+    (
+        'fib_abstract_api_extra',
+        'exercises/fib/fib/fib-abstract-api-extra.c',
+        'fib',
+    ),
+    ('fib_complete', 'exercises/fib/fib/fib-complete.c', 'fib'),
+]
+
+QUEUE = [
+    ('queue', 'exercises/queue/queue/queue.c', 'queue'),
+    ('queue_complete', 'exercises/queue/queue/queue-complete.c', 'queue'),
+]
+
+VARIANTS = FIB + QUEUE
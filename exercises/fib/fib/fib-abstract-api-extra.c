@@ -1,17 +1,93 @@
 #include <Python.h>
 
-static unsigned long
+#if defined(__GNUC__) && defined(__x86_64__)
+/* We can compile an AVX2 kernel for `fib_array` with a target attribute and
+   pick it at runtime, so the module still loads on older CPUs. */
+#define FIB_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+/* The number of Fibonacci numbers that fit in 64 bits, `cfib(n)` is exact for
+   every `n < FIB_TABLE_SIZE`. */
+#define FIB_TABLE_SIZE 93
+
+/* `cfib(n)` for each `n < FIB_TABLE_SIZE`. This is written out so it is
+   computed at compile time; `fib(0)` is 1 like the original loop. */
+static const uint64_t fib_table[FIB_TABLE_SIZE] = {
+    1ULL, 1ULL, 1ULL,
+    2ULL, 3ULL, 5ULL,
+    8ULL, 13ULL, 21ULL,
+    34ULL, 55ULL, 89ULL,
+    144ULL, 233ULL, 377ULL,
+    610ULL, 987ULL, 1597ULL,
+    2584ULL, 4181ULL, 6765ULL,
+    10946ULL, 17711ULL, 28657ULL,
+    46368ULL, 75025ULL, 121393ULL,
+    196418ULL, 317811ULL, 514229ULL,
+    832040ULL, 1346269ULL, 2178309ULL,
+    3524578ULL, 5702887ULL, 9227465ULL,
+    14930352ULL, 24157817ULL, 39088169ULL,
+    63245986ULL, 102334155ULL, 165580141ULL,
+    267914296ULL, 433494437ULL, 701408733ULL,
+    1134903170ULL, 1836311903ULL, 2971215073ULL,
+    4807526976ULL, 7778742049ULL, 12586269025ULL,
+    20365011074ULL, 32951280099ULL, 53316291173ULL,
+    86267571272ULL, 139583862445ULL, 225851433717ULL,
+    365435296162ULL, 591286729879ULL, 956722026041ULL,
+    1548008755920ULL, 2504730781961ULL, 4052739537881ULL,
+    6557470319842ULL, 10610209857723ULL, 17167680177565ULL,
+    27777890035288ULL, 44945570212853ULL, 72723460248141ULL,
+    117669030460994ULL, 190392490709135ULL, 308061521170129ULL,
+    498454011879264ULL, 806515533049393ULL, 1304969544928657ULL,
+    2111485077978050ULL, 3416454622906707ULL, 5527939700884757ULL,
+    8944394323791464ULL, 14472334024676221ULL, 23416728348467685ULL,
+    37889062373143906ULL, 61305790721611591ULL, 99194853094755497ULL,
+    160500643816367088ULL, 259695496911122585ULL, 420196140727489673ULL,
+    679891637638612258ULL, 1100087778366101931ULL, 1779979416004714189ULL,
+    2880067194370816120ULL, 4660046610375530309ULL, 7540113804746346429ULL
+};
+
+static unsigned long long
 cfib(unsigned long n)
 {
-    unsigned long a = 1;
-    unsigned long b = 1;
-    unsigned long c;
+    /* every result that fits in 64 bits is in the table */
+    return fib_table[n];
+}
+
+#ifdef __SIZEOF_INT128__
+/* The compiler gives us a native 128 bit integer so we can stay in C for
+   larger results before falling back to Python ints. */
+#define FIB_HAVE_NATIVE_TIERS 1
+
+typedef unsigned __int128 fib_u128;
+
+/* The largest `n` such that `cfib128(n)` fits in 128 bits. */
+#define FIB_U128_MAX_N 186
+
+/* The largest `n` computed with fixed width limbs in `fib_limbs`. */
+#define FIB_LIMBS_MAX_N 4096
+
+/* The largest `n` computed without big integer arithmetic on Python ints. */
+#define FIB_NATIVE_MAX_N FIB_LIMBS_MAX_N
+
+/* The number of 64 bit limbs needed to hold F(FIB_LIMBS_MAX_N + 1) with one
+   limb to spare. F(n) has about 0.695 * n bits. */
+#define FIB_MAX_LIMBS 48
+
+static fib_u128
+cfib128(unsigned long n)
+{
+    /* start from the last two entries in the table */
+    fib_u128 a = fib_table[FIB_TABLE_SIZE - 2];
+    fib_u128 b = fib_table[FIB_TABLE_SIZE - 1];
+    fib_u128 c;
+    unsigned long k;
 
-    if (n <= 1) {
-        return 1;
+    if (n < FIB_TABLE_SIZE) {
+        return fib_table[n];
     }
 
-    while (--n > 1) {
+    for (k = FIB_TABLE_SIZE; k <= n; ++k) {
         c = a + b;
         a = b;
         b = c;
@@ -20,59 +96,1804 @@ cfib(unsigned long n)
     return b;
 }
 
+/* Helpers for unsigned integers stored as little endian arrays of 64 bit
+   limbs. Each returns the number of limbs in the result with no leading zero
+   limbs. The output may not alias the inputs. */
+
+static Py_ssize_t
+limbs_add(uint64_t* out,
+          const uint64_t* x,
+          Py_ssize_t xn,
+          const uint64_t* y,
+          Py_ssize_t yn)
+{
+    fib_u128 carry = 0;
+    Py_ssize_t n;
+
+    if (xn < yn) {
+        const uint64_t* tmp = x;
+        Py_ssize_t tmpn = xn;
+        x = y;
+        xn = yn;
+        y = tmp;
+        yn = tmpn;
+    }
+
+    for (n = 0; n < xn; ++n) {
+        carry += x[n];
+        if (n < yn) {
+            carry += y[n];
+        }
+        out[n] = (uint64_t) carry;
+        carry >>= 64;
+    }
+    if (carry) {
+        out[n++] = (uint64_t) carry;
+    }
+    return n;
+}
+
+/* `x - y` where `x >= y` */
+static Py_ssize_t
+limbs_sub(uint64_t* out,
+          const uint64_t* x,
+          Py_ssize_t xn,
+          const uint64_t* y,
+          Py_ssize_t yn)
+{
+    uint64_t borrow = 0;
+    uint64_t lhs;
+    uint64_t rhs;
+    Py_ssize_t n;
+
+    for (n = 0; n < xn; ++n) {
+        lhs = x[n];
+        rhs = (n < yn) ? y[n] : 0;
+        out[n] = lhs - rhs - borrow;
+        borrow = (lhs < rhs) || (lhs - rhs < borrow);
+    }
+    while (xn && !out[xn - 1]) {
+        --xn;
+    }
+    return xn;
+}
+
+/* schoolbook multiplication, our numbers are too small to benefit from
+   anything fancier */
+static Py_ssize_t
+limbs_mul(uint64_t* out,
+          const uint64_t* x,
+          Py_ssize_t xn,
+          const uint64_t* y,
+          Py_ssize_t yn)
+{
+    fib_u128 acc;
+    Py_ssize_t i;
+    Py_ssize_t j;
+    Py_ssize_t outn = xn + yn;
+
+    if (!xn || !yn) {
+        return 0;
+    }
+
+    memset(out, 0, outn * sizeof(uint64_t));
+    for (i = 0; i < xn; ++i) {
+        acc = 0;
+        for (j = 0; j < yn; ++j) {
+            acc += (fib_u128) x[i] * y[j] + out[i + j];
+            out[i + j] = (uint64_t) acc;
+            acc >>= 64;
+        }
+        out[i + yn] = (uint64_t) acc;
+    }
+    while (outn && !out[outn - 1]) {
+        --outn;
+    }
+    return outn;
+}
+
+/* Build a Python int from limbs with a single allocation. */
+static PyObject*
+limbs_to_pylong(const uint64_t* limbs, Py_ssize_t n)
+{
+    unsigned char bytes[FIB_MAX_LIMBS * 2 * sizeof(uint64_t)];
+    Py_ssize_t i;
+    int j;
+
+    /* serialize explicitly so this doesn't depend on the host's byte
+       order */
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < 8; ++j) {
+            bytes[i * 8 + j] = (unsigned char) (limbs[i] >> (8 * j));
+        }
+    }
+    return _PyLong_FromByteArray(bytes,
+                                 n * sizeof(uint64_t),
+                                 1,  /* little_endian */
+                                 0   /* is_signed */);
+}
+
+/* Compute the standard F(n) and F(n + 1) for `n <= FIB_LIMBS_MAX_N` with the
+   same fast doubling as `fib_pair`, but on fixed size buffers on the C stack.
+   No Python objects are created until the results are converted once at the
+   end. */
+static int
+fib_limbs(unsigned long n, PyObject** fn_out, PyObject** fn1_out)
+{
+    /* products can have one more limb than the final result, leave space for
+       two full width operands */
+    uint64_t fk_buf[FIB_MAX_LIMBS * 2];
+    uint64_t fk1_buf[FIB_MAX_LIMBS * 2];
+    uint64_t f2k_buf[FIB_MAX_LIMBS * 2];
+    uint64_t f2k1_buf[FIB_MAX_LIMBS * 2];
+    uint64_t t1[FIB_MAX_LIMBS * 2];
+    uint64_t t2[FIB_MAX_LIMBS * 2];
+    uint64_t* fk = fk_buf;    /* F(k) */
+    uint64_t* fk1 = fk1_buf;  /* F(k + 1) */
+    uint64_t* f2k = f2k_buf;  /* F(2k) */
+    uint64_t* f2k1 = f2k1_buf;  /* F(2k + 1) */
+    uint64_t* swap;
+    Py_ssize_t fkn = 0;
+    Py_ssize_t fk1n = 1;
+    Py_ssize_t f2kn;
+    Py_ssize_t f2k1n;
+    Py_ssize_t t1n;
+    Py_ssize_t t2n;
+    unsigned long bit = 1;
+
+    fk1[0] = 1;
+
+    while (bit <= n / 2) {
+        bit <<= 1;
+    }
+
+    for (; n && bit; bit >>= 1) {
+        /* F(2k) = F(k) * (2 * F(k + 1) - F(k)), F(k + 1) >= F(k) so this
+           never goes negative */
+        t1n = limbs_add(t1, fk1, fk1n, fk1, fk1n);
+        t2n = limbs_sub(t2, t1, t1n, fk, fkn);
+        f2kn = limbs_mul(f2k, fk, fkn, t2, t2n);
+
+        /* F(2k + 1) = F(k) ** 2 + F(k + 1) ** 2 */
+        t1n = limbs_mul(t1, fk, fkn, fk, fkn);
+        t2n = limbs_mul(t2, fk1, fk1n, fk1, fk1n);
+        f2k1n = limbs_add(f2k1, t1, t1n, t2, t2n);
+
+        if (n & bit) {
+            /* step to (F(2k + 1), F(2k + 2)) */
+            fk1n = limbs_add(fk, f2k, f2kn, f2k1, f2k1n);
+            swap = fk1;
+            fk1 = fk;
+            fk = f2k1;
+            f2k1 = swap;
+            fkn = f2k1n;
+        }
+        else {
+            /* step to (F(2k), F(2k + 1)) by swapping buffers */
+            swap = fk;
+            fk = f2k;
+            f2k = swap;
+            swap = fk1;
+            fk1 = f2k1;
+            f2k1 = swap;
+            fkn = f2kn;
+            fk1n = f2k1n;
+        }
+    }
+
+    if (!(*fn_out = limbs_to_pylong(fk, fkn))) {
+        return -1;
+    }
+    if (!(*fn1_out = limbs_to_pylong(fk1, fk1n))) {
+        Py_CLEAR(*fn_out);
+        return -1;
+    }
+    return 0;
+}
+#else
+#define FIB_NATIVE_MAX_N (FIB_TABLE_SIZE - 1)
+#endif
+
+/* Compute the standard Fibonacci numbers F(n) and F(n + 1), where F(0) = 0 and
+   F(1) = 1, using fast doubling:
+
+     F(2k)     = F(k) * (2 * F(k + 1) - F(k))
+     F(2k + 1) = F(k) ** 2 + F(k + 1) ** 2
+
+   We walk the bits of `n` from the most significant down, doubling the index
+   at each step and adding one when the bit is set. This needs O(log n) big
+   integer multiplications instead of O(n) additions. */
+static int
+fib_pair(unsigned long n, PyObject** fn_out, PyObject** fn1_out)
+{
+    PyObject* fk = NULL;      /* F(k) */
+    PyObject* fk1 = NULL;     /* F(k + 1) */
+    PyObject* f2k = NULL;     /* F(2k) */
+    PyObject* f2k1 = NULL;    /* F(2k + 1) */
+    PyObject* tmp = NULL;
+    PyObject* tmp2 = NULL;
+    unsigned long bit = 1;
+
+    if (!(fk = PyLong_FromLong(0)) || !(fk1 = PyLong_FromLong(1))) {
+        goto error;
+    }
+
+    /* find the most significant set bit of `n` */
+    while (bit <= n / 2) {
+        bit <<= 1;
+    }
+
+    for (; n && bit; bit >>= 1) {
+        /* F(2k) = F(k) * (2 * F(k + 1) - F(k)) */
+        if (!(tmp = PyNumber_Add(fk1, fk1)) ||
+            !(tmp2 = PyNumber_Subtract(tmp, fk))) {
+            goto error;
+        }
+        Py_CLEAR(tmp);
+        if (!(f2k = PyNumber_Multiply(fk, tmp2))) {
+            goto error;
+        }
+        Py_CLEAR(tmp2);
+
+        /* F(2k + 1) = F(k) ** 2 + F(k + 1) ** 2 */
+        if (!(tmp = PyNumber_Multiply(fk, fk)) ||
+            !(tmp2 = PyNumber_Multiply(fk1, fk1)) ||
+            !(f2k1 = PyNumber_Add(tmp, tmp2))) {
+            goto error;
+        }
+        Py_CLEAR(tmp);
+        Py_CLEAR(tmp2);
+        Py_DECREF(fk);
+        Py_DECREF(fk1);
+
+        if (n & bit) {
+            /* step to (F(2k + 1), F(2k + 2)) */
+            fk = f2k1;
+            fk1 = PyNumber_Add(f2k, f2k1);
+            Py_DECREF(f2k);
+        }
+        else {
+            /* step to (F(2k), F(2k + 1)) */
+            fk = f2k;
+            fk1 = f2k1;
+        }
+        f2k = f2k1 = NULL;
+
+        if (!fk1) {
+            goto error;
+        }
+    }
+
+    *fn_out = fk;
+    *fn1_out = fk1;
+    return 0;
+
+error:
+    Py_XDECREF(fk);
+    Py_XDECREF(fk1);
+    Py_XDECREF(f2k);
+    Py_XDECREF(f2k1);
+    Py_XDECREF(tmp);
+    Py_XDECREF(tmp2);
+    return -1;
+}
+
+/* The number of results `fib` remembers by default. */
+#define FIB_CACHE_DEFAULT_SIZE 128
+
+/* A cached pair of consecutive Fibonacci numbers. A pair is a checkpoint we
+   can restart from for any larger `n`, not just an answer for `n`. */
+typedef struct {
+    unsigned long n;
+    PyObject* fn;                 /* the standard F(n) */
+    PyObject* fn1;                /* the standard F(n + 1) */
+    unsigned long long last_used; /* the value of `fib_cache_clock` when this
+                                     entry was last read or written */
+} fib_cache_entry;
+
+/* The cache is a small array searched linearly. This is cheap next to the big
+   integer arithmetic it saves and lets us find the nearest checkpoint below a
+   missed `n` in the same pass. */
+static fib_cache_entry* fib_cache = NULL;
+static Py_ssize_t fib_cache_size = 0;
+static Py_ssize_t fib_cache_maxsize = FIB_CACHE_DEFAULT_SIZE;
+static unsigned long long fib_cache_clock = 0;
+static Py_ssize_t fib_cache_hits = 0;
+static Py_ssize_t fib_cache_misses = 0;
+
+static PyTypeObject fib_cache_info_type;
+
+static PyStructSequence_Field fib_cache_info_fields[] = {
+    {"hits", "the number of calls answered from the cache"},
+    {"misses", "the number of calls which computed a new result"},
+    {"maxsize", "the most results the cache will hold"},
+    {"currsize", "the number of results in the cache"},
+    {NULL},
+};
+
+static PyStructSequence_Desc fib_cache_info_desc = {
+    "fib.CacheInfo",
+    "Statistics about the cache used by ``fib``.",
+    fib_cache_info_fields,
+    4,
+};
+
+/* Compute the standard F(n) and F(n + 1) with the cheapest available
+   method. */
+static int
+fib_pair_any(unsigned long n, PyObject** fn_out, PyObject** fn1_out)
+{
+    if (n + 1 < FIB_TABLE_SIZE) {
+        /* `fib_table` holds the standard values except at 0 */
+        if (!(*fn_out = PyLong_FromUnsignedLongLong(n ? fib_table[n] : 0))) {
+            return -1;
+        }
+        if (!(*fn1_out = PyLong_FromUnsignedLongLong(fib_table[n + 1]))) {
+            Py_CLEAR(*fn_out);
+            return -1;
+        }
+        return 0;
+    }
+
+#ifdef FIB_HAVE_NATIVE_TIERS
+    if (n <= FIB_LIMBS_MAX_N) {
+        return fib_limbs(n, fn_out, fn1_out);
+    }
+#endif
+
+    return fib_pair(n, fn_out, fn1_out);
+}
+
+/* Compute the standard F(n) and F(n + 1) starting from a cached checkpoint
+   F(m), F(m + 1) with `m < n`. With `d = n - m`:
+
+     F(m + d)     = F(d - 1) * F(m) + F(d) * F(m + 1)
+     F(m + d + 1) = F(d) * F(m) + F(d + 1) * F(m + 1)
+
+   F(d - 1), F(d) and F(d + 1) are much smaller than the result, so this is
+   cheaper than doubling all the way from 0 when `d` is small. */
+static int
+fib_pair_from(const fib_cache_entry* checkpoint,
+              unsigned long n,
+              PyObject** fn_out,
+              PyObject** fn1_out)
+{
+    PyObject* fd_1 = NULL;  /* F(d - 1) */
+    PyObject* fd = NULL;    /* F(d) */
+    PyObject* fd1 = NULL;   /* F(d + 1) */
+    PyObject* lhs = NULL;
+    PyObject* rhs = NULL;
+    PyObject* fn = NULL;
+    PyObject* fn1 = NULL;
+
+    if (fib_pair_any(n - checkpoint->n - 1, &fd_1, &fd) ||
+        !(fd1 = PyNumber_Add(fd_1, fd))) {
+        goto error;
+    }
+
+    if (!(lhs = PyNumber_Multiply(fd_1, checkpoint->fn)) ||
+        !(rhs = PyNumber_Multiply(fd, checkpoint->fn1)) ||
+        !(fn = PyNumber_Add(lhs, rhs))) {
+        goto error;
+    }
+    Py_CLEAR(lhs);
+    Py_CLEAR(rhs);
+
+    if (!(lhs = PyNumber_Multiply(fd, checkpoint->fn)) ||
+        !(rhs = PyNumber_Multiply(fd1, checkpoint->fn1)) ||
+        !(fn1 = PyNumber_Add(lhs, rhs))) {
+        goto error;
+    }
+
+    Py_DECREF(fd_1);
+    Py_DECREF(fd);
+    Py_DECREF(fd1);
+    Py_DECREF(lhs);
+    Py_DECREF(rhs);
+    *fn_out = fn;
+    *fn1_out = fn1;
+    return 0;
+
+error:
+    Py_XDECREF(fd_1);
+    Py_XDECREF(fd);
+    Py_XDECREF(fd1);
+    Py_XDECREF(lhs);
+    Py_XDECREF(rhs);
+    Py_XDECREF(fn);
+    Py_XDECREF(fn1);
+    return -1;
+}
+
+/* Remember F(n) and F(n + 1), evicting the least recently used entry if the
+   cache is full. */
+static int
+fib_cache_store(unsigned long n, PyObject* fn, PyObject* fn1)
+{
+    fib_cache_entry* entry;
+    Py_ssize_t ix;
+
+    if (!fib_cache_maxsize) {
+        /* caching is disabled */
+        return 0;
+    }
+
+    if (!fib_cache) {
+        if (!(fib_cache = PyMem_New(fib_cache_entry, fib_cache_maxsize))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    if (fib_cache_size < fib_cache_maxsize) {
+        entry = &fib_cache[fib_cache_size++];
+    }
+    else {
+        entry = &fib_cache[0];
+        for (ix = 1; ix < fib_cache_size; ++ix) {
+            if (fib_cache[ix].last_used < entry->last_used) {
+                entry = &fib_cache[ix];
+            }
+        }
+        Py_DECREF(entry->fn);
+        Py_DECREF(entry->fn1);
+    }
+
+    Py_INCREF(fn);
+    Py_INCREF(fn1);
+    entry->n = n;
+    entry->fn = fn;
+    entry->fn1 = fn1;
+    entry->last_used = ++fib_cache_clock;
+    return 0;
+}
+
+/* Compute the standard F(n) for an `n` too large for the native tiers, using
+   and updating the cache. */
+static PyObject*
+fib_cached(unsigned long n)
+{
+    fib_cache_entry* checkpoint = NULL;
+    PyObject* fn;
+    PyObject* fn1;
+    Py_ssize_t ix;
+
+    for (ix = 0; ix < fib_cache_size; ++ix) {
+        if (fib_cache[ix].n == n) {
+            /* hit, we don't need to allocate anything */
+            ++fib_cache_hits;
+            fib_cache[ix].last_used = ++fib_cache_clock;
+            Py_INCREF(fib_cache[ix].fn);
+            return fib_cache[ix].fn;
+        }
+        if (fib_cache[ix].n < n &&
+            (!checkpoint || fib_cache[ix].n > checkpoint->n)) {
+            checkpoint = &fib_cache[ix];
+        }
+    }
+
+    ++fib_cache_misses;
+
+    /* Restart from the nearest checkpoint if it is closer to `n` than 0 is to
+       the checkpoint. Otherwise doubling from 0 does less work. */
+    if (checkpoint &&
+        n - checkpoint->n < checkpoint->n &&
+        n > FIB_NATIVE_MAX_N) {
+        checkpoint->last_used = ++fib_cache_clock;
+        if (fib_pair_from(checkpoint, n, &fn, &fn1)) {
+            return NULL;
+        }
+    }
+    else if (fib_pair_any(n, &fn, &fn1)) {
+        return NULL;
+    }
+
+    if (fib_cache_store(n, fn, fn1)) {
+        Py_DECREF(fn);
+        Py_DECREF(fn1);
+        return NULL;
+    }
+    Py_DECREF(fn1);
+    return fn;
+}
+
 PyDoc_STRVAR(fib_doc, "compute the nth Fibonacci number");
 
 static PyObject*
 pyfib(PyObject* self, PyObject* n)
 {
-    PyObject* a = NULL;
-    PyObject* b = NULL;
-    PyObject* c;
-
     unsigned long n_as_unsigned_long = PyLong_AsUnsignedLong(n);
     if (PyErr_Occurred()) {
         return NULL;
     }
 
-    if (!(a = PyLong_FromUnsignedLong(1))) {
+    if (n_as_unsigned_long < FIB_TABLE_SIZE) {
+        /* the result is in the table */
+        return PyLong_FromUnsignedLongLong(cfib(n_as_unsigned_long));
+    }
+
+#ifdef FIB_HAVE_NATIVE_TIERS
+    if (n_as_unsigned_long <= FIB_U128_MAX_N) {
+        /* the result fits in 128 bits */
+        fib_u128 result = cfib128(n_as_unsigned_long);
+        unsigned char bytes[sizeof(fib_u128)];
+        size_t i;
+
+        for (i = 0; i < sizeof(fib_u128); ++i) {
+            bytes[i] = (unsigned char) (result >> (8 * i));
+        }
+        return _PyLong_FromByteArray(bytes,
+                                     sizeof(fib_u128),
+                                     1,  /* little_endian */
+                                     0   /* is_signed */);
+    }
+#endif
+
+    /* `cfib(n)` is the standard F(n) for n > 0. Larger results are built with
+       fixed width limbs or fast doubling on Python ints, and are cached. */
+    return fib_cached(n_as_unsigned_long);
+}
+
+PyDoc_STRVAR(cache_info_doc,
+             "Report statistics about the cache used by ``fib``.\n"
+             "\n"
+             "Results that fit in 128 bits are computed natively and are not\n"
+             "cached.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "info : CacheInfo\n"
+             "    A named tuple of ``hits``, ``misses``, ``maxsize`` and\n"
+             "    ``currsize``.\n");
+
+static PyObject*
+cache_info(PyObject* self, PyObject* unused)
+{
+    PyObject* info;
+
+    if (!(info = PyStructSequence_New(&fib_cache_info_type))) {
+        return NULL;
+    }
+
+    PyStructSequence_SET_ITEM(info, 0, PyLong_FromSsize_t(fib_cache_hits));
+    PyStructSequence_SET_ITEM(info, 1, PyLong_FromSsize_t(fib_cache_misses));
+    PyStructSequence_SET_ITEM(info, 2, PyLong_FromSsize_t(fib_cache_maxsize));
+    PyStructSequence_SET_ITEM(info, 3, PyLong_FromSsize_t(fib_cache_size));
+    if (PyErr_Occurred()) {
+        Py_DECREF(info);
+        return NULL;
+    }
+    return info;
+}
+
+PyDoc_STRVAR(cache_clear_doc,
+             "Empty the cache used by ``fib`` and reset its statistics.\n");
+
+static PyObject*
+cache_clear(PyObject* self, PyObject* unused)
+{
+    Py_ssize_t ix;
+
+    for (ix = 0; ix < fib_cache_size; ++ix) {
+        Py_DECREF(fib_cache[ix].fn);
+        Py_DECREF(fib_cache[ix].fn1);
+    }
+    fib_cache_size = 0;
+    fib_cache_hits = 0;
+    fib_cache_misses = 0;
+
+    Py_RETURN_NONE;
+}
+
+/* order cache entries from most to least recently used */
+static int
+fib_cache_entry_compare(const void* lhs, const void* rhs)
+{
+    unsigned long long lhs_used = ((const fib_cache_entry*) lhs)->last_used;
+    unsigned long long rhs_used = ((const fib_cache_entry*) rhs)->last_used;
+
+    return (lhs_used < rhs_used) - (lhs_used > rhs_used);
+}
+
+PyDoc_STRVAR(set_cache_size_doc,
+             "Set the most results the cache used by ``fib`` will hold.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "size : int\n"
+             "    The new size. 0 disables the cache. If the cache holds more\n"
+             "    results, the least recently used are evicted.\n");
+
+static PyObject*
+set_cache_size(PyObject* self, PyObject* size_ob)
+{
+    Py_ssize_t size = PyNumber_AsSsize_t(size_ob, PyExc_OverflowError);
+    fib_cache_entry* resized;
+    Py_ssize_t ix;
+
+    if (size == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache size must be non-negative");
+        return NULL;
+    }
+
+    if (size < fib_cache_size) {
+        /* keep the most recently used entries */
+        qsort(fib_cache,
+              fib_cache_size,
+              sizeof(fib_cache_entry),
+              fib_cache_entry_compare);
+        for (ix = size; ix < fib_cache_size; ++ix) {
+            Py_DECREF(fib_cache[ix].fn);
+            Py_DECREF(fib_cache[ix].fn1);
+        }
+        fib_cache_size = size;
+    }
+
+    if (!size) {
+        PyMem_Free(fib_cache);
+        fib_cache = NULL;
+    }
+    else if (fib_cache) {
+        resized = fib_cache;
+        if (!PyMem_Resize(resized, fib_cache_entry, size)) {
+            return PyErr_NoMemory();
+        }
+        fib_cache = resized;
+    }
+    fib_cache_maxsize = size;
+
+    Py_RETURN_NONE;
+}
+
+/* Describe the buffer format `format` as an integer type. Returns 0 and sets
+   `*is_signed` if the format is a native integer, otherwise -1. */
+static int
+fib_index_format(const char* format, int* is_signed)
+{
+    if (!format) {
+        /* no format means unsigned bytes */
+        *is_signed = 0;
+        return 0;
+    }
+
+    /* native byte order and size prefixes are fine, anything else is not */
+    if (*format == '@' || *format == '=') {
+        ++format;
+    }
+    if (!format[0] || format[1]) {
+        return -1;
+    }
+
+    switch (*format) {
+    case 'b':
+    case 'h':
+    case 'i':
+    case 'l':
+    case 'q':
+    case 'n':
+        *is_signed = 1;
+        return 0;
+    case 'B':
+    case 'H':
+    case 'I':
+    case 'L':
+    case 'Q':
+    case 'N':
+        *is_signed = 0;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* Read the index at `p` into `*out`. Returns -1 if the index is negative. */
+static int
+fib_read_index(const char* p, Py_ssize_t itemsize, int is_signed, uint64_t* out)
+{
+    int64_t signed_value;
+
+    switch (itemsize) {
+    case 1:
+        signed_value = is_signed ? *(const int8_t*) p : *(const uint8_t*) p;
+        break;
+    case 2: {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        signed_value = is_signed ? (int16_t) v : v;
+        break;
+    }
+    case 4: {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        signed_value = is_signed ? (int64_t) (int32_t) v : (int64_t) v;
+        break;
+    }
+    default:
+        memcpy(out, p, sizeof(*out));
+        return (is_signed && (int64_t) *out < 0) ? -1 : 0;
+    }
+
+    if (signed_value < 0) {
+        return -1;
+    }
+    *out = (uint64_t) signed_value;
+    return 0;
+}
+
+/* Look up `cfib` of each index in `indices[start:stop]`. Out of range indices
+   write 0 when `mask` is set, otherwise we stop and return the position of the
+   bad index. Returns -1 when every index was in range or masked. */
+static Py_ssize_t
+fib_array_scalar(const char* indices,
+                 Py_ssize_t itemsize,
+                 int is_signed,
+                 Py_ssize_t start,
+                 Py_ssize_t stop,
+                 uint64_t* out,
+                 int mask)
+{
+    uint64_t ix;
+    Py_ssize_t n;
+
+    for (n = start; n < stop; ++n) {
+        if (!fib_read_index(indices + n * itemsize, itemsize, is_signed, &ix) &&
+            ix < FIB_TABLE_SIZE) {
+            out[n] = fib_table[ix];
+        }
+        else if (mask) {
+            out[n] = 0;
+        }
+        else {
+            return n;
+        }
+    }
+    return -1;
+}
+
+#ifdef FIB_HAVE_AVX2
+/* The same as `fib_array_scalar` for 4 and 8 byte indices, but looks up 4
+   indices at a time with a vector gather. Any block of 4 with an index out of
+   range, and the tail, are handled by `fib_array_scalar`. Large unsigned
+   values look negative here and so also go to the scalar path, which handles
+   them correctly. */
+__attribute__((target("avx2"))) static Py_ssize_t
+fib_array_avx2(const char* indices,
+               Py_ssize_t itemsize,
+               int is_signed,
+               Py_ssize_t size,
+               uint64_t* out,
+               int mask)
+{
+    const __m256i table_size = _mm256_set1_epi64x(FIB_TABLE_SIZE);
+    const __m256i minus_one = _mm256_set1_epi64x(-1);
+    __m256i ix;
+    __m256i in_range;
+    Py_ssize_t n;
+    Py_ssize_t bad;
+
+    for (n = 0; n + 4 <= size; n += 4) {
+        if (itemsize == 8) {
+            ix = _mm256_loadu_si256((const __m256i*) (indices + n * 8));
+        }
+        else {
+            /* sign extend 4 int32s into int64 lanes */
+            ix = _mm256_cvtepi32_epi64(
+                _mm_loadu_si128((const __m128i*) (indices + n * 4)));
+        }
+
+        /* -1 < ix < FIB_TABLE_SIZE in every lane */
+        in_range = _mm256_and_si256(_mm256_cmpgt_epi64(ix, minus_one),
+                                    _mm256_cmpgt_epi64(table_size, ix));
+        if (_mm256_movemask_epi8(in_range) != -1) {
+            bad = fib_array_scalar(indices,
+                                   itemsize,
+                                   is_signed,
+                                   n,
+                                   n + 4,
+                                   out,
+                                   mask);
+            if (bad >= 0) {
+                return bad;
+            }
+            continue;
+        }
+
+        _mm256_storeu_si256(
+            (__m256i*) (out + n),
+            _mm256_i64gather_epi64((const long long*) fib_table, ix, 8));
+    }
+
+    return fib_array_scalar(indices, itemsize, is_signed, n, size, out, mask);
+}
+#endif
+
+PyDoc_STRVAR(fib_array_doc,
+             "Compute the Fibonacci number for each index in a buffer.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "indices : buffer\n"
+             "    A contiguous buffer of integers, like an ``array.array``,\n"
+             "    ``memoryview`` or NumPy array.\n"
+             "out : buffer, optional\n"
+             "    A writable contiguous buffer of unsigned 64 bit integers with\n"
+             "    the same number of elements as ``indices``. If not given, a\n"
+             "    new one is allocated.\n"
+             "mask : bool, optional\n"
+             "    Write 0 for indices whose result does not fit in 64 bits\n"
+             "    instead of raising.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "out : buffer\n"
+             "    ``out``, or a new ``memoryview`` of format ``'Q'``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "OverflowError\n"
+             "    Raised when an index is negative or its result does not fit\n"
+             "    in 64 bits and ``mask`` is False.\n");
+
+/* Get a contiguous buffer of integer indices from `indices_ob`. On success,
+   the caller must release `indices`. */
+static int
+fib_get_indices(PyObject* indices_ob,
+                Py_buffer* indices,
+                int* is_signed,
+                Py_ssize_t* size)
+{
+    if (PyObject_GetBuffer(indices_ob,
+                           indices,
+                           PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)) {
+        return -1;
+    }
+
+    if (fib_index_format(indices->format, is_signed) ||
+        indices->itemsize > 8) {
+        PyErr_Format(PyExc_TypeError,
+                     "indices must be a buffer of integers, got format '%s'",
+                     indices->format ? indices->format : "B");
+        PyBuffer_Release(indices);
+        return -1;
+    }
+
+    *size = indices->len / indices->itemsize;
+    return 0;
+}
+
+/* Get a writable buffer of `size` unsigned 64 bit integers from `*out_ob`.
+   If `*out_ob` is `None`, allocate a new one. On success, `*out_ob` is a new
+   reference and the caller must release `out`. */
+static int
+fib_get_out(PyObject** out_ob, Py_ssize_t size, Py_buffer* out)
+{
+    PyObject* storage;
+    PyObject* view;
+    int is_signed;
+
+    if (*out_ob == Py_None) {
+        /* allocate the output as a bytearray and hand back a typed view of
+           it */
+        if (!(storage = PyByteArray_FromStringAndSize(NULL,
+                                                      size * sizeof(uint64_t)))) {
+            return -1;
+        }
+        view = PyMemoryView_FromObject(storage);
+        Py_DECREF(storage);
+        if (!view) {
+            return -1;
+        }
+        *out_ob = PyObject_CallMethod(view, "cast", "s", "Q");
+        Py_DECREF(view);
+        if (!*out_ob) {
+            return -1;
+        }
+    }
+    else {
+        Py_INCREF(*out_ob);
+    }
+
+    if (PyObject_GetBuffer(*out_ob,
+                           out,
+                           PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)) {
+        Py_CLEAR(*out_ob);
+        return -1;
+    }
+
+    if (fib_index_format(out->format, &is_signed) ||
+        is_signed ||
+        out->itemsize != sizeof(uint64_t)) {
+        PyErr_Format(PyExc_TypeError,
+                     "out must be a buffer of unsigned 64 bit integers, got "
+                     "format '%s'",
+                     out->format ? out->format : "B");
+    }
+    else if (out->len / out->itemsize != size) {
+        PyErr_Format(PyExc_ValueError,
+                     "out has %zd elements but indices has %zd",
+                     out->len / out->itemsize,
+                     size);
+    }
+    else {
+        return 0;
+    }
+
+    PyBuffer_Release(out);
+    Py_CLEAR(*out_ob);
+    return -1;
+}
+
+static PyObject*
+fib_array(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"indices", "out", "mask", NULL};
+    PyObject* indices_ob;
+    PyObject* out_ob = Py_None;
+    int mask = 0;
+    Py_buffer indices;
+    Py_buffer out;
+    Py_ssize_t size;
+    Py_ssize_t bad = -1;
+    int is_signed;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O|Op:fib_array",
+                                     keywords,
+                                     &indices_ob,
+                                     &out_ob,
+                                     &mask)) {
+        return NULL;
+    }
+
+    if (fib_get_indices(indices_ob, &indices, &is_signed, &size)) {
+        return NULL;
+    }
+    if (fib_get_out(&out_ob, size, &out)) {
+        PyBuffer_Release(&indices);
+        return NULL;
+    }
+
+    /* The kernel only touches the two buffers, which we hold exports of, so
+       other threads can run while it works. */
+    Py_BEGIN_ALLOW_THREADS
+#ifdef FIB_HAVE_AVX2
+    if ((indices.itemsize == 4 || indices.itemsize == 8) &&
+        __builtin_cpu_supports("avx2")) {
+        bad = fib_array_avx2(indices.buf,
+                             indices.itemsize,
+                             is_signed,
+                             size,
+                             out.buf,
+                             mask);
+    }
+    else
+#endif
+    {
+        bad = fib_array_scalar(indices.buf,
+                               indices.itemsize,
+                               is_signed,
+                               0,
+                               size,
+                               out.buf,
+                               mask);
+    }
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&out);
+    PyBuffer_Release(&indices);
+
+    if (bad >= 0) {
+        PyErr_Format(PyExc_OverflowError,
+                     "index at position %zd is negative or its Fibonacci "
+                     "number does not fit in 64 bits",
+                     bad);
+        Py_DECREF(out_ob);
         return NULL;
     }
+    return out_ob;
+}
+
+/* `x * y % m` without overflowing */
+static uint64_t
+fib_mulmod(uint64_t x, uint64_t y, uint64_t m)
+{
+    if (m <= UINT32_MAX) {
+        /* `x, y < m` so the product fits in 64 bits, and a 64 bit remainder
+           is a single instruction where a 128 bit one is a library call */
+        return x * y % m;
+    }
+#ifdef __SIZEOF_INT128__
+    return (uint64_t) ((unsigned __int128) x * y % m);
+#else
+    /* shift and add, keeping every partial sum below `m` */
+    uint64_t result = 0;
+
+    x %= m;
+    while (y) {
+        if (y & 1) {
+            result = (result >= m - x) ? result - (m - x) : result + x;
+        }
+        x = (x >= m - x) ? x - (m - x) : x + x;
+        y >>= 1;
+    }
+    return result;
+#endif
+}
+
+/* `(x + y) % m` for `x, y < m` without overflowing */
+static uint64_t
+fib_addmod(uint64_t x, uint64_t y, uint64_t m)
+{
+    return (x >= m - y) ? x - (m - y) : x + y;
+}
+
+/* Advance the fast doubling state (F(k), F(k + 1)) mod `m` over the `nbits`
+   low bits of `word`, most significant first. This is `fib_pair` with every
+   operation reduced mod `m`, so it never needs more than 128 bits. */
+static void
+fib_mod_step(uint64_t* fk, uint64_t* fk1, uint64_t word, int nbits, uint64_t m)
+{
+    uint64_t f2k;
+    uint64_t f2k1;
+    uint64_t t;
+
+    while (nbits--) {
+        /* F(2k) = F(k) * (2 * F(k + 1) - F(k)) */
+        t = fib_addmod(*fk1, *fk1, m);
+        t = fib_addmod(t, m - *fk, m);
+        f2k = fib_mulmod(*fk, t, m);
+        /* F(2k + 1) = F(k) ** 2 + F(k + 1) ** 2 */
+        f2k1 = fib_addmod(fib_mulmod(*fk, *fk, m),
+                          fib_mulmod(*fk1, *fk1, m),
+                          m);
+
+        if ((word >> nbits) & 1) {
+            *fk = f2k1;
+            *fk1 = fib_addmod(f2k, f2k1, m);
+        }
+        else {
+            *fk = f2k;
+            *fk1 = f2k1;
+        }
+    }
+}
+
+/* The standard F(n) mod `m` in O(log n) steps. */
+static uint64_t
+fib_mod_u64(uint64_t n, uint64_t m)
+{
+    uint64_t fk = 0;
+    uint64_t fk1 = 1 % m;
+    int nbits = 0;
+
+    while (nbits < 64 && (n >> nbits)) {
+        ++nbits;
+    }
+    fib_mod_step(&fk, &fk1, n, nbits, m);
+    return fk;
+}
+
+/* An index beyond 64 bits is reduced by the Pisano period when the modulus
+   is at most this, which bounds the walk since the period of `m` is at most
+   `6 * m`. An index which fits in 64 bits never needs the period: fast
+   doubling takes at most 64 steps, far fewer than the walk. */
+#define FIB_PISANO_MAX_M 65536
+
+/* The number of Pisano periods remembered, indexed by `m` modulo this. */
+#define FIB_PISANO_CACHE_SIZE 64
+
+/* Batches may precompute every F(k) mod `m` in a period up to this long. */
+#define FIB_PISANO_TABLE_MAX 16384
+
+/* A batch spends at most this many steps per index looking for the period. */
+#define FIB_PISANO_STEPS_PER_INDEX 64
+
+static struct {
+    uint64_t m;
+    uint64_t period;
+} fib_pisano_cache[FIB_PISANO_CACHE_SIZE];
+
+/* The Pisano period of `m`, the period of the standard Fibonacci sequence mod
+   `m`, or 0 if it is longer than `limit`. The walk takes one step per term so
+   it gives up after `limit` steps. */
+static uint64_t
+fib_pisano_period(uint64_t m, uint64_t limit)
+{
+    size_t slot = m % FIB_PISANO_CACHE_SIZE;
+    uint64_t a = 0;
+    uint64_t b = 1 % m;
+    uint64_t c;
+    uint64_t period = 0;
+
+    if (fib_pisano_cache[slot].m == m) {
+        period = fib_pisano_cache[slot].period;
+        return period <= limit ? period : 0;
+    }
+
+    /* step until we are back at (F(0), F(1)) */
+    do {
+        if (period == limit) {
+            return 0;
+        }
+        c = fib_addmod(a, b, m);
+        a = b;
+        b = c;
+        ++period;
+    } while (a != 0 || b != 1 % m);
+
+    fib_pisano_cache[slot].m = m;
+    fib_pisano_cache[slot].period = period;
+    return period;
+}
+
+/* Convert a positive modulus argument. */
+static int
+fib_get_modulus(PyObject* m_ob, uint64_t* m)
+{
+    unsigned long long value = PyLong_AsUnsignedLongLong(m_ob);
 
-    if (n_as_unsigned_long == 0) {
-        return a;
+    if (value == (unsigned long long) -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (!value) {
+        PyErr_SetString(PyExc_ZeroDivisionError, "fib_mod() modulo by zero");
+        return -1;
     }
+    *m = value;
+    return 0;
+}
+
+PyDoc_STRVAR(fib_mod_doc,
+             "Compute ``fib(n) % m`` without computing ``fib(n)``.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "n : int\n"
+             "    The non-negative index, which may be arbitrarily large.\n"
+             "m : int\n"
+             "    The modulus, between 1 and 2 ** 64 - 1.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "result : int\n"
+             "    ``fib(n) % m``\n");
 
-    if (n_as_unsigned_long < 93) {
-        PyObject* result = PyLong_FromUnsignedLong(cfib(n_as_unsigned_long));
+static PyObject*
+fib_mod(PyObject* self, PyObject* args)
+{
+    PyObject* n_ob;
+    PyObject* m_ob;
+    PyObject* reduced;
+    PyObject* bytes;
+    PyObject* tmp;
+    uint64_t m;
+    uint64_t period;
+    unsigned long long n;
+    uint64_t fk = 0;
+    uint64_t fk1;
+    Py_ssize_t nbits;
+    Py_ssize_t ix;
+
+    if (!PyArg_ParseTuple(args, "OO:fib_mod", &n_ob, &m_ob)) {
+        return NULL;
+    }
+    if (fib_get_modulus(m_ob, &m)) {
+        return NULL;
+    }
+
+    /* like `fib` itself, first try `n` as a C integer */
+    n = PyLong_AsUnsignedLongLong(n_ob);
+    if (!PyErr_Occurred()) {
+        if (!n) {
+            /* `fib(0)` is 1 */
+            return PyLong_FromUnsignedLongLong(1 % m);
+        }
+        return PyLong_FromUnsignedLongLong(fib_mod_u64(n, m));
+    }
+    if (!PyErr_ExceptionMatches(PyExc_OverflowError) ||
+        _PyLong_Sign(n_ob) < 0) {
+        /* not an int, or negative */
+        return NULL;
+    }
+    PyErr_Clear();
+
+    if (m <= FIB_PISANO_MAX_M && (period = fib_pisano_period(m, 6 * m))) {
+        /* F(n) mod m repeats every `period` terms, so we only need
+           `n % period`, which fits in 64 bits */
+        if (!(tmp = PyLong_FromUnsignedLongLong(period))) {
+            return NULL;
+        }
+        reduced = PyNumber_Remainder(n_ob, tmp);
+        Py_DECREF(tmp);
+        if (!reduced) {
+            return NULL;
+        }
+        n = PyLong_AsUnsignedLongLong(reduced);
+        Py_DECREF(reduced);
         if (PyErr_Occurred()) {
             return NULL;
         }
-        return result;
+        return PyLong_FromUnsignedLongLong(fib_mod_u64(n, m));
+    }
+
+    /* Walk the bits of `n` from the most significant, a byte at a time. */
+    if (!(tmp = PyObject_CallMethod(n_ob, "bit_length", NULL))) {
+        return NULL;
+    }
+    nbits = PyLong_AsSsize_t(tmp);
+    Py_DECREF(tmp);
+    if (nbits == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (!(bytes = PyObject_CallMethod(n_ob,
+                                      "to_bytes",
+                                      "ns",
+                                      (nbits + 7) / 8,
+                                      "big"))) {
+        return NULL;
+    }
+
+    fk1 = 1 % m;
+    for (ix = 0; ix < PyBytes_GET_SIZE(bytes); ++ix) {
+        fib_mod_step(&fk,
+                     &fk1,
+                     (unsigned char) PyBytes_AS_STRING(bytes)[ix],
+                     8,
+                     m);
+    }
+    Py_DECREF(bytes);
+
+    return PyLong_FromUnsignedLongLong(fk);
+}
+
+PyDoc_STRVAR(fib_mod_array_doc,
+             "Compute ``fib(n) % m`` for each index in a buffer.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "indices : buffer\n"
+             "    A contiguous buffer of non-negative integers.\n"
+             "m : int\n"
+             "    The modulus, between 1 and 2 ** 64 - 1.\n"
+             "out : buffer, optional\n"
+             "    A writable contiguous buffer of unsigned 64 bit integers with\n"
+             "    the same number of elements as ``indices``. If not given, a\n"
+             "    new one is allocated.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "out : buffer\n"
+             "    ``out``, or a new ``memoryview`` of format ``'Q'``.\n");
+
+static PyObject*
+fib_mod_array(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"indices", "m", "out", NULL};
+    PyObject* indices_ob;
+    PyObject* m_ob;
+    PyObject* out_ob = Py_None;
+    Py_buffer indices;
+    Py_buffer out;
+    Py_ssize_t size;
+    Py_ssize_t bad = -1;
+    Py_ssize_t ix;
+    int is_signed;
+    uint64_t m;
+    uint64_t period;
+    uint64_t n;
+    uint64_t* table = NULL;
+    uint64_t* results;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "OO|O:fib_mod_array",
+                                     keywords,
+                                     &indices_ob,
+                                     &m_ob,
+                                     &out_ob)) {
+        return NULL;
+    }
+    if (fib_get_modulus(m_ob, &m)) {
+        return NULL;
+    }
+
+    if (fib_get_indices(indices_ob, &indices, &is_signed, &size)) {
+        return NULL;
+    }
+    if (fib_get_out(&out_ob, size, &out)) {
+        PyBuffer_Release(&indices);
+        return NULL;
+    }
+    results = out.buf;
+
+    /* Finding the period takes a step per term, so it is only looked for up
+       to a length which the batch pays for. When the period is shorter than
+       the batch, tabulate one period and answer every index with a lookup.
+       Otherwise each index is still reduced to `n % period`, which saves
+       doubling steps that each cost many steps of the walk. */
+    period = fib_pisano_period(m,
+                               (uint64_t) size * FIB_PISANO_STEPS_PER_INDEX);
+    if (period && period <= FIB_PISANO_TABLE_MAX && (uint64_t) size > period) {
+        if (!(table = PyMem_New(uint64_t, period))) {
+            PyBuffer_Release(&out);
+            PyBuffer_Release(&indices);
+            Py_DECREF(out_ob);
+            return PyErr_NoMemory();
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (table) {
+        table[0] = 0;
+        if (period > 1) {
+            table[1] = 1 % m;
+        }
+        for (n = 2; n < period; ++n) {
+            table[n] = fib_addmod(table[n - 1], table[n - 2], m);
+        }
+    }
+
+    for (ix = 0; ix < size; ++ix) {
+        if (fib_read_index((const char*) indices.buf + ix * indices.itemsize,
+                           indices.itemsize,
+                           is_signed,
+                           &n)) {
+            /* negative index */
+            bad = ix;
+            break;
+        }
+
+        if (!n) {
+            /* `fib(0)` is 1 */
+            results[ix] = 1 % m;
+        }
+        else if (table) {
+            results[ix] = table[n % period];
+        }
+        else {
+            results[ix] = fib_mod_u64(period ? n % period : n, m);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    PyMem_Free(table);
+    PyBuffer_Release(&out);
+    PyBuffer_Release(&indices);
+
+    if (bad >= 0) {
+        PyErr_Format(PyExc_OverflowError,
+                     "index at position %zd is negative",
+                     bad);
+        Py_DECREF(out_ob);
+        return NULL;
+    }
+    return out_ob;
+}
+
+/* Below this many steps `fib.iter.skip` steps one term at a time instead of
+   jumping with fast doubling. */
+#define FIB_ITER_SKIP_THRESHOLD 64
+
+typedef struct {
+    PyObject fi_base;        /* storage for our type and reference count */
+    PyObject* fi_a;          /* the first seed, S(0) */
+    PyObject* fi_b;          /* the second seed, S(1) */
+    unsigned long fi_index;  /* the `n` of the next term to produce */
+    unsigned long fi_stop;   /* stop before this `n` if `fi_has_stop` */
+    int fi_has_stop;
+    int fi_native;           /* the pair is held in `fi_x` and `fi_y` */
+    uint64_t fi_x;           /* the next term, in native mode */
+    uint64_t fi_y;           /* the term after `fi_x`, in native mode */
+    PyObject* fi_x_ob;       /* the next term, when not in native mode */
+    PyObject* fi_y_ob;       /* the term after `fi_x_ob`, when not in native
+                                mode */
+} fib_iterator;
+
+/* The `n`th term is S(n) for n < 2 and S(n - 1) otherwise, where
+   S(0) = a, S(1) = b and S(k) = S(k - 1) + S(k - 2). With a = b = 1 this is
+   `fib(n)`, which repeats 1 for n = 0, 1 and 2. This maps `n` to the index
+   into S. */
+static unsigned long
+fib_iter_sequence_index(unsigned long n)
+{
+    return (n < 2) ? n : n - 1;
+}
+
+/* Store the pair (S(j), S(j + 1)) as Python objects, taking ownership of `x`
+   and `y`, and switch to native mode if both fit in 64 bits. */
+static void
+fib_iter_set_pair(fib_iterator* self, PyObject* x, PyObject* y)
+{
+    unsigned long long x_native;
+    unsigned long long y_native;
+
+    Py_CLEAR(self->fi_x_ob);
+    Py_CLEAR(self->fi_y_ob);
+
+    if (PyLong_CheckExact(x) && PyLong_CheckExact(y)) {
+        x_native = PyLong_AsUnsignedLongLong(x);
+        if (!PyErr_Occurred()) {
+            y_native = PyLong_AsUnsignedLongLong(y);
+            if (!PyErr_Occurred()) {
+                self->fi_native = 1;
+                self->fi_x = x_native;
+                self->fi_y = y_native;
+                Py_DECREF(x);
+                Py_DECREF(y);
+                return;
+            }
+        }
+        /* negative or too large, use Python ints */
+        PyErr_Clear();
+    }
+
+    self->fi_native = 0;
+    self->fi_x_ob = x;
+    self->fi_y_ob = y;
+}
+
+/* Move the pair from S(j) to S(j + 1). */
+static int
+fib_iter_step(fib_iterator* self)
+{
+    PyObject* next;
+
+    if (self->fi_native) {
+        uint64_t sum;
+
+        if (!__builtin_add_overflow(self->fi_x, self->fi_y, &sum)) {
+            /* the common case, no Python objects involved */
+            self->fi_x = self->fi_y;
+            self->fi_y = sum;
+            return 0;
+        }
+
+        /* the next term doesn't fit in 64 bits, switch to Python ints for the
+           rest of the sequence */
+        if (!(self->fi_x_ob = PyLong_FromUnsignedLongLong(self->fi_x))) {
+            return -1;
+        }
+        if (!(self->fi_y_ob = PyLong_FromUnsignedLongLong(self->fi_y))) {
+            Py_CLEAR(self->fi_x_ob);
+            return -1;
+        }
+        self->fi_native = 0;
+    }
+
+    if (!(next = PyNumber_Add(self->fi_x_ob, self->fi_y_ob))) {
+        return -1;
+    }
+    Py_SETREF(self->fi_x_ob, self->fi_y_ob);
+    self->fi_y_ob = next;
+    return 0;
+}
+
+/* Move to the `n`th term. `n` must be at least `fi_index`. */
+static int
+fib_iter_advance(fib_iterator* self, unsigned long n)
+{
+    unsigned long j = fib_iter_sequence_index(self->fi_index);
+    unsigned long target = fib_iter_sequence_index(n);
+    PyObject* fj_1 = NULL;  /* F(target - 1) */
+    PyObject* fj = NULL;    /* F(target) */
+    PyObject* fj1 = NULL;   /* F(target + 1) */
+    PyObject* lhs = NULL;
+    PyObject* rhs = NULL;
+    PyObject* x = NULL;
+    PyObject* y = NULL;
+
+    if (target - j < FIB_ITER_SKIP_THRESHOLD ||
+        !PyLong_CheckExact(self->fi_a) ||
+        !PyLong_CheckExact(self->fi_b)) {
+        /* Close by, or the seeds are not ints and might round differently
+           when multiplied; step one term at a time. */
+        for (; j < target; ++j) {
+            if (fib_iter_step(self)) {
+                return -1;
+            }
+        }
+        self->fi_index = n;
+        return 0;
+    }
+
+    /* S(t) = a * F(t - 1) + b * F(t) and
+       S(t + 1) = a * F(t) + b * F(t + 1), which we can jump to directly with
+       fast doubling. `target` is at least `FIB_ITER_SKIP_THRESHOLD` so
+       `target - 1` can't underflow. */
+    if (fib_pair_any(target - 1, &fj_1, &fj) ||
+        !(fj1 = PyNumber_Add(fj_1, fj))) {
+        goto error;
+    }
+
+    if (!(lhs = PyNumber_Multiply(self->fi_a, fj_1)) ||
+        !(rhs = PyNumber_Multiply(self->fi_b, fj)) ||
+        !(x = PyNumber_Add(lhs, rhs))) {
+        goto error;
+    }
+    Py_CLEAR(lhs);
+    Py_CLEAR(rhs);
+
+    if (!(lhs = PyNumber_Multiply(self->fi_a, fj)) ||
+        !(rhs = PyNumber_Multiply(self->fi_b, fj1)) ||
+        !(y = PyNumber_Add(lhs, rhs))) {
+        goto error;
     }
 
-    if (!(b = PyLong_FromUnsignedLong(1))) {
-        Py_DECREF(a);
+    Py_DECREF(fj_1);
+    Py_DECREF(fj);
+    Py_DECREF(fj1);
+    Py_DECREF(lhs);
+    Py_DECREF(rhs);
+    fib_iter_set_pair(self, x, y);
+    self->fi_index = n;
+    return 0;
+
+error:
+    Py_XDECREF(fj_1);
+    Py_XDECREF(fj);
+    Py_XDECREF(fj1);
+    Py_XDECREF(lhs);
+    Py_XDECREF(rhs);
+    Py_XDECREF(x);
+    Py_XDECREF(y);
+    return -1;
+}
+
+static PyObject*
+fib_iter_new(PyTypeObject* cls, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"a", "b", "start", "stop", NULL};
+
+    fib_iterator* self;
+    PyObject* a = NULL;
+    PyObject* b = NULL;
+    PyObject* start_ob = NULL;
+    unsigned long start = 0;
+    PyObject* stop = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|OOOO:iter",
+                                     keywords,
+                                     &a,
+                                     &b,
+                                     &start_ob,
+                                     &stop)) {
         return NULL;
     }
 
-    while (--n_as_unsigned_long > 1) {
-        c = PyNumber_Add(a, b);
-        Py_DECREF(a);
+    /* the "k" format would silently wrap a negative start around */
+    if (start_ob) {
+        start = PyLong_AsUnsignedLong(start_ob);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+
+    if (!(self = (fib_iterator*) cls->tp_alloc(cls, 0))) {
+        return NULL;
+    }
 
-        if (!c) {
-            Py_DECREF(b);
+    if (stop != Py_None) {
+        self->fi_stop = PyLong_AsUnsignedLong(stop);
+        if (PyErr_Occurred()) {
+            Py_DECREF(self);
             return NULL;
         }
+        self->fi_has_stop = 1;
+    }
 
-        a = b;
-        b = c;
+    if (!(self->fi_a = a ? (Py_INCREF(a), a) : PyLong_FromLong(1)) ||
+        !(self->fi_b = b ? (Py_INCREF(b), b) : PyLong_FromLong(1))) {
+        Py_DECREF(self);
+        return NULL;
     }
-    Py_DECREF(a);
-    return b;
+
+    /* start at (S(0), S(1)) and move to `start` */
+    Py_INCREF(self->fi_a);
+    Py_INCREF(self->fi_b);
+    fib_iter_set_pair(self, self->fi_a, self->fi_b);
+    if (fib_iter_advance(self, start)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject*) self;
+}
+
+static int
+fib_iter_traverse(fib_iterator* self, visitproc visit, void* arg)
+{
+    Py_VISIT(self->fi_a);
+    Py_VISIT(self->fi_b);
+    Py_VISIT(self->fi_x_ob);
+    Py_VISIT(self->fi_y_ob);
+    return 0;
 }
 
+static int
+fib_iter_clear(fib_iterator* self)
+{
+    Py_CLEAR(self->fi_a);
+    Py_CLEAR(self->fi_b);
+    Py_CLEAR(self->fi_x_ob);
+    Py_CLEAR(self->fi_y_ob);
+    return 0;
+}
+
+static void
+fib_iter_dealloc(fib_iterator* self)
+{
+    PyObject_GC_UnTrack(self);
+    fib_iter_clear(self);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject*
+fib_iter_next(fib_iterator* self)
+{
+    PyObject* result;
+
+    if (self->fi_has_stop && self->fi_index >= self->fi_stop) {
+        /* returning NULL without an exception set means StopIteration */
+        return NULL;
+    }
+
+    if (self->fi_native) {
+        result = PyLong_FromUnsignedLongLong(self->fi_x);
+    }
+    else {
+        result = self->fi_x_ob;
+        Py_INCREF(result);
+    }
+    if (!result) {
+        return NULL;
+    }
+
+    /* `fib(1)` and `fib(2)` are both S(1), only step for the other terms */
+    if (self->fi_index != 1 && fib_iter_step(self)) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    ++self->fi_index;
+
+    return result;
+}
+
+static PyObject*
+fib_iter_length_hint(fib_iterator* self, PyObject* unused)
+{
+    if (!self->fi_has_stop) {
+        /* infinite, we don't know */
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    if (self->fi_index >= self->fi_stop) {
+        return PyLong_FromLong(0);
+    }
+    return PyLong_FromUnsignedLong(self->fi_stop - self->fi_index);
+}
+
+PyDoc_STRVAR(fib_iter_skip_doc,
+             "Skip the next ``k`` terms without computing each of them.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "k : int\n"
+             "    The number of terms to skip. Large jumps use fast doubling\n"
+             "    when the seeds are ints.\n");
+
+static PyObject*
+fib_iter_skip(fib_iterator* self, PyObject* k_ob)
+{
+    unsigned long k = PyLong_AsUnsignedLong(k_ob);
+    unsigned long n;
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    if (k > ULONG_MAX - self->fi_index) {
+        PyErr_SetString(PyExc_OverflowError, "skipped past the largest index");
+        return NULL;
+    }
+    n = self->fi_index + k;
+    if (self->fi_has_stop && n > self->fi_stop) {
+        /* don't compute terms we will never produce */
+        n = (self->fi_index > self->fi_stop) ? self->fi_index : self->fi_stop;
+    }
+
+    if (fib_iter_advance(self, n)) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyMethodDef fib_iter_methods[] = {
+    {"__length_hint__",
+     (PyCFunction) fib_iter_length_hint,
+     METH_NOARGS,
+     NULL},
+    {"skip", (PyCFunction) fib_iter_skip, METH_O, fib_iter_skip_doc},
+    {NULL},
+};
+
+PyDoc_STRVAR(fib_iter_doc,
+             "iter(a=1, b=1, start=0, stop=None)\n"
+             "\n"
+             "Iterate over the seeded sequence for ``n`` in\n"
+             "``range(start, stop)``, or forever if ``stop`` is None.\n"
+             "\n"
+             "The ``n``th term is ``S(n)`` for ``n < 2`` and ``S(n - 1)``\n"
+             "otherwise, where ``S(0) = a``, ``S(1) = b`` and\n"
+             "``S(k) = S(k - 1) + S(k - 2)``. The default seeds give\n"
+             "``fib(n)``.\n"
+             "\n"
+             "Each term is computed from the last two, natively while they\n"
+             "fit in 64 bits.\n");
+
+static PyTypeObject fib_iter_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fib.iter",                                 /* tp_name */
+    sizeof(fib_iterator),                       /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) fib_iter_dealloc,              /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,                         /* tp_flags */
+    fib_iter_doc,                               /* tp_doc */
+    (traverseproc) fib_iter_traverse,           /* tp_traverse */
+    (inquiry) fib_iter_clear,                   /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc) fib_iter_next,               /* tp_iternext */
+    fib_iter_methods,                           /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    0,                                          /* tp_init */
+    0,                                          /* tp_alloc */
+    (newfunc) fib_iter_new,                     /* tp_new */
+};
+
 PyMethodDef methods[] = {
     {"fib", (PyCFunction) pyfib, METH_O, fib_doc},
+    {"cache_info", (PyCFunction) cache_info, METH_NOARGS, cache_info_doc},
+    {"cache_clear", (PyCFunction) cache_clear, METH_NOARGS, cache_clear_doc},
+    {"set_cache_size",
+     (PyCFunction) set_cache_size,
+     METH_O,
+     set_cache_size_doc},
+    {"fib_array",
+     (PyCFunction) fib_array,
+     METH_VARARGS | METH_KEYWORDS,
+     fib_array_doc},
+    {"fib_mod", (PyCFunction) fib_mod, METH_VARARGS, fib_mod_doc},
+    {"fib_mod_array",
+     (PyCFunction) fib_mod_array,
+     METH_VARARGS | METH_KEYWORDS,
+     fib_mod_array_doc},
     {NULL},
 };
 
@@ -93,5 +1914,29 @@ PyModuleDef fib_module = {
 PyMODINIT_FUNC
 PyInit_fib(void)
 {
-    return PyModule_Create(&fib_module);
+    PyObject* m;
+
+    if (!fib_cache_info_type.tp_name &&
+        PyStructSequence_InitType2(&fib_cache_info_type,
+                                   &fib_cache_info_desc)) {
+        return NULL;
+    }
+
+    if (PyType_Ready(&fib_iter_type)) {
+        return NULL;
+    }
+
+    if (!(m = PyModule_Create(&fib_module))) {
+        return NULL;
+    }
+
+    if (PyObject_SetAttrString(m,
+                               "CacheInfo",
+                               (PyObject*) &fib_cache_info_type) ||
+        PyObject_SetAttrString(m, "iter", (PyObject*) &fib_iter_type)) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    return m;
 }
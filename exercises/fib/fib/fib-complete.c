@@ -1,26 +1,195 @@
 #include <Python.h>
 
+/* Below this `n` the additions in `pyfib` are cheaper than the multiplications
+   done by fast doubling. */
+#define FIB_DOUBLING_THRESHOLD 40
+
+/* Compute the standard Fibonacci numbers F(n) and F(n + 1), where F(0) = 0 and
+   F(1) = 1, using fast doubling:
+
+     F(2k)     = F(k) * (2 * F(k + 1) - F(k))
+     F(2k + 1) = F(k) ** 2 + F(k + 1) ** 2
+
+   We walk the bits of `n` from the most significant down, doubling the index
+   at each step and adding one when the bit is set. This needs O(log n) big
+   integer multiplications instead of O(n) additions. */
+static int
+fib_pair(unsigned long n, PyObject** fn_out, PyObject** fn1_out)
+{
+    PyObject* fk = NULL;      /* F(k) */
+    PyObject* fk1 = NULL;     /* F(k + 1) */
+    PyObject* f2k = NULL;     /* F(2k) */
+    PyObject* f2k1 = NULL;    /* F(2k + 1) */
+    PyObject* tmp = NULL;
+    PyObject* tmp2 = NULL;
+    unsigned long bit = 1;
+
+    if (!(fk = PyLong_FromLong(0)) || !(fk1 = PyLong_FromLong(1))) {
+        goto error;
+    }
+
+    /* find the most significant set bit of `n` */
+    while (bit <= n / 2) {
+        bit <<= 1;
+    }
+
+    for (; n && bit; bit >>= 1) {
+        /* F(2k) = F(k) * (2 * F(k + 1) - F(k)) */
+        if (!(tmp = PyNumber_Add(fk1, fk1)) ||
+            !(tmp2 = PyNumber_Subtract(tmp, fk))) {
+            goto error;
+        }
+        Py_CLEAR(tmp);
+        if (!(f2k = PyNumber_Multiply(fk, tmp2))) {
+            goto error;
+        }
+        Py_CLEAR(tmp2);
+
+        /* F(2k + 1) = F(k) ** 2 + F(k + 1) ** 2 */
+        if (!(tmp = PyNumber_Multiply(fk, fk)) ||
+            !(tmp2 = PyNumber_Multiply(fk1, fk1)) ||
+            !(f2k1 = PyNumber_Add(tmp, tmp2))) {
+            goto error;
+        }
+        Py_CLEAR(tmp);
+        Py_CLEAR(tmp2);
+        Py_DECREF(fk);
+        Py_DECREF(fk1);
+
+        if (n & bit) {
+            /* step to (F(2k + 1), F(2k + 2)) */
+            fk = f2k1;
+            fk1 = PyNumber_Add(f2k, f2k1);
+            Py_DECREF(f2k);
+        }
+        else {
+            /* step to (F(2k), F(2k + 1)) */
+            fk = f2k;
+            fk1 = f2k1;
+        }
+        f2k = f2k1 = NULL;
+
+        if (!fk1) {
+            goto error;
+        }
+    }
+
+    *fn_out = fk;
+    *fn1_out = fk1;
+    return 0;
+
+error:
+    Py_XDECREF(fk);
+    Py_XDECREF(fk1);
+    Py_XDECREF(f2k);
+    Py_XDECREF(f2k1);
+    Py_XDECREF(tmp);
+    Py_XDECREF(tmp2);
+    return -1;
+}
+
+/* Compute `a * F(n) + b * F(n + 1)`, which is the `n + 1`th term of the
+   sequence that starts with `a, b` and adds the last two terms. */
+static PyObject*
+fib_combination(PyObject* a, PyObject* b, unsigned long n)
+{
+    PyObject* fn;
+    PyObject* fn1;
+    PyObject* lhs;
+    PyObject* rhs;
+    PyObject* result;
+
+    if (fib_pair(n, &fn, &fn1)) {
+        return NULL;
+    }
+
+    lhs = PyNumber_Multiply(a, fn);
+    Py_DECREF(fn);
+    if (!lhs) {
+        Py_DECREF(fn1);
+        return NULL;
+    }
+
+    rhs = PyNumber_Multiply(b, fn1);
+    Py_DECREF(fn1);
+    if (!rhs) {
+        Py_DECREF(lhs);
+        return NULL;
+    }
+
+    result = PyNumber_Add(lhs, rhs);
+    Py_DECREF(lhs);
+    Py_DECREF(rhs);
+    return result;
+}
+
 PyDoc_STRVAR(fib_doc, "compute the nth Fibonacci number");
 
 static PyObject*
-pyfib(PyObject* self, PyObject* args, PyObject* kwargs)
+pyfib(PyObject* self,
+      PyObject* const* args,
+      Py_ssize_t nargs,
+      PyObject* kwnames)
 {
-    static char* keywords[] = {"n", "a", "b", NULL};
+    static const char* const keywords[] = {"n", "a", "b", NULL};
+    PyObject* argv[3] = {NULL, NULL, NULL};
     PyObject* n_ob;
     unsigned long n;
     PyObject* a = NULL;
     PyObject* b = NULL;
     PyObject* c;
+    Py_ssize_t nkwargs;
+    Py_ssize_t k;
+    Py_ssize_t ix;
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "O|$OO:fib",
-                                     keywords,
-                                     &n_ob,
-                                     &a,
-                                     &b)) {
+    /* This is called with `METH_FASTCALL | METH_KEYWORDS` so the arguments
+       arrive as a C array followed by a tuple of keyword names instead of a
+       tuple and a dict. We match them ourselves instead of using a format
+       string; this is the same as "O|$OO:fib". */
+    if (nargs > 1) {
+        PyErr_Format(PyExc_TypeError,
+                     "fib() takes at most 1 positional argument (%zd given)",
+                     nargs);
         return NULL;
     }
+    if (nargs) {
+        argv[0] = args[0];
+    }
+
+    nkwargs = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    for (k = 0; k < nkwargs; ++k) {
+        PyObject* name = PyTuple_GET_ITEM(kwnames, k);
+
+        for (ix = 0; keywords[ix]; ++ix) {
+            if (!PyUnicode_CompareWithASCIIString(name, keywords[ix])) {
+                break;
+            }
+        }
+
+        if (!keywords[ix]) {
+            PyErr_Format(PyExc_TypeError,
+                         "fib() got an unexpected keyword argument '%U'",
+                         name);
+            return NULL;
+        }
+        if (argv[ix]) {
+            PyErr_Format(PyExc_TypeError,
+                         "fib() got multiple values for argument '%s'",
+                         keywords[ix]);
+            return NULL;
+        }
+
+        /* the keyword argument values follow the positional arguments */
+        argv[ix] = args[nargs + k];
+    }
+
+    if (!(n_ob = argv[0])) {
+        PyErr_SetString(PyExc_TypeError,
+                        "fib() missing required argument 'n' (pos 1)");
+        return NULL;
+    }
+    a = argv[1];
+    b = argv[2];
 
     n = PyLong_AsUnsignedLong(n_ob);
     if (PyErr_Occurred()) {
@@ -50,6 +219,20 @@ pyfib(PyObject* self, PyObject* args, PyObject* kwargs)
         Py_INCREF(b);
     }
 
+    if (n > FIB_DOUBLING_THRESHOLD &&
+        PyLong_CheckExact(a) &&
+        PyLong_CheckExact(b)) {
+        /* The loop below returns S(n - 1) where S(0) = a, S(1) = b and
+           S(k) = S(k - 1) + S(k - 2). This is a * F(n - 2) + b * F(n - 1), so
+           we can compute it with fast doubling. We only do this for exact
+           ints: other types like float may round differently when multiplied
+           than when added repeatedly. */
+        c = fib_combination(a, b, n - 2);
+        Py_DECREF(a);
+        Py_DECREF(b);
+        return c;
+    }
+
     while (--n > 1) {
         c = PyNumber_Add(a, b);
         Py_DECREF(a);
@@ -67,7 +250,10 @@ pyfib(PyObject* self, PyObject* args, PyObject* kwargs)
 }
 
 PyMethodDef methods[] = {
-    {"fib", (PyCFunction) pyfib, METH_VARARGS | METH_KEYWORDS, fib_doc},
+    {"fib",
+     (PyCFunction) (void (*)(void)) pyfib,
+     METH_FASTCALL | METH_KEYWORDS,
+     fib_doc},
     {NULL},
 };
 
@@ -1,4 +1,24 @@
+from . import queue as _queue
 from .queue import Queue
 
 
 __all__ = ['Queue']
+
+# The exercise, `queue.c`, only defines `Queue`. `queue-complete.c` defines
+# the rest, except that `SharedQueue` is Linux only and `all_stats` is left
+# out of builds with `QUEUE_NO_STATS`.
+for _name in [
+    'Empty',
+    'Full',
+    'Int64Queue',
+    'Float64Queue',
+    'SPSCQueue',
+    'MPMCQueue',
+    'SharedQueue',
+    'PriorityQueue',
+    'all_stats',
+]:
+    if hasattr(_queue, _name):
+        globals()[_name] = getattr(_queue, _name)
+        __all__.append(_name)
+del _name
@@ -1,341 +1,7083 @@
 #include <Python.h>
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+/* `SharedQueue` needs memfd and futexes, which are Linux only */
+#ifdef __linux__
+#define QUEUE_HAVE_SHARED
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* The smallest number of slots we will allocate for the ring buffer. A ring
+   of this size is stored inline in the `Queue` object itself, so queues that
+   never grow past it don't allocate any storage. */
+#define QUEUE_MIN_CAPACITY 8
+
+/* The longest time in nanoseconds a blocked `push` or `pop` waits with the GIL
+   released before checking for signals like SIGINT. Condition variables are
+   not interrupted by signals so we need to wake up ourselves. */
+#define QUEUE_SIGNAL_CHECK_INTERVAL 50000000L
+
+/* The number of dead `Queue` objects kept for reuse by the next `Queue()`. */
+#define QUEUE_FREELIST_SIZE 16
+
+/* Heap ring buffers are pooled by capacity, one pool per power of 2 from
+   `2 * QUEUE_MIN_CAPACITY` up to `QUEUE_POOL_MAX_CAPACITY` slots. Each pool
+   keeps at most `QUEUE_POOL_DEPTH` free buffers; larger rings always go back
+   to the allocator. */
+#define QUEUE_POOL_MAX_CAPACITY 4096
+#define QUEUE_POOL_CLASSES 9
+#define QUEUE_POOL_DEPTH 8
+
+/* The freelist and the pools are plain globals guarded by the GIL. The
+   free-threaded build has no GIL to protect them, so it always uses the
+   allocator. */
+#ifndef Py_GIL_DISABLED
+#define QUEUE_USE_FREELISTS
+#endif
+
+/* `Queue` keeps counters for `Queue.stats` and `all_stats` unless built with
+   `-DQUEUE_NO_STATS`, which removes the counters, the registry of live queues
+   and the residency histogram entirely. */
+#ifndef QUEUE_NO_STATS
+#define QUEUE_STATS
+#endif
+
+/* The residency histogram of a `Queue(residency=True)` has one bucket for
+   times under a microsecond and then one per power of 2 microseconds. The
+   last bucket also counts everything longer, from about 18 minutes. */
+#define QUEUE_RESIDENCY_BUCKETS 32
+
+/* exception types raised when a non-blocking or timed operation fails */
+static PyObject* queue_empty_error;
+static PyObject* queue_full_error;
+
+/* On the free-threaded build there is no GIL to serialize access to a queue's
+   storage, so the `Queue` and typed queue methods run inside a critical
+   section on `self`. A critical section is suspended whenever the thread
+   detaches, like while a blocked `push` or `pop` waits, the same way the GIL
+   would be released.
+
+   `QUEUE_DEFINE_LOCKED(name, ...)` defines `name_locked` which calls `name`
+   in a critical section, and `QUEUE_LOCKED(name)` names the function to put
+   in a method or slot table. With the GIL both are no-ops. */
+#ifdef Py_GIL_DISABLED
+#define QUEUE_LOCKED(name) name##_locked
+#define QUEUE_DEFINE_LOCKED(name, rettype, params, args)                \
+    static rettype name##_locked params                                 \
+    {                                                                   \
+        rettype result;                                                 \
+        Py_BEGIN_CRITICAL_SECTION(self);                                \
+        result = name args;                                             \
+        Py_END_CRITICAL_SECTION();                                      \
+        return result;                                                  \
+    }
+#else
+#define QUEUE_LOCKED(name) name
+#define QUEUE_DEFINE_LOCKED(name, rettype, params, args)
+#endif
+
+/* what `push` does when the queue is already at `q_maxsize` */
+typedef enum {
+    QUEUE_OVERFLOW_RAISE,            /* block, then raise `Full` */
+    QUEUE_OVERFLOW_DROP_NEWEST,      /* discard the pushed element */
+    QUEUE_OVERFLOW_OVERWRITE_OLDEST, /* discard the element at the front */
+} queue_overflow;
+
+/* the names of the `queue_overflow` values, in order */
+static const char* const queue_overflow_names[] = {
+    "raise",
+    "drop_newest",
+    "overwrite_oldest",
+    NULL,
+};
+
+/* A FIFO of the `async_push` or `async_pop` awaitables waiting on a queue.
+   Waking an awaitable takes it off the list and resolves its future; it
+   does the operation itself once its task resumes. Until then it counts in
+   `wl_woken` so that the element or space it was woken for is left for it. */
+typedef struct {
+    struct queue_awaitable* wl_first;
+    struct queue_awaitable* wl_last;
+    Py_ssize_t wl_woken;  /* awaitables woken but not resumed yet */
+} queue_waitlist;
+
+/* `Queue` is a variable-size object: `ob_size` is the number of slots in
+   `q_inline`, which is always `QUEUE_MIN_CAPACITY`. */
+typedef struct queue {
+    PyVarObject q_base;    /* storage for our type, reference count and size */
+    Py_ssize_t q_maxsize;  /* the maximum number of elements in the queue */
+    queue_overflow q_overflow; /* what to do when pushing to a full queue */
+    Py_ssize_t q_dropped;  /* elements discarded by the overflow policy */
+    PyObject** q_slots;    /* ring buffer of owned references to the elements */
+    Py_ssize_t q_capacity; /* the number of slots in `q_slots`, a power of 2 */
+    Py_ssize_t q_head;     /* the index in `q_slots` of the first element */
+    Py_ssize_t q_size;     /* the number of elements in the queue */
+    size_t q_version;      /* bumped whenever the elements change */
+    PyObject* q_index;     /* element -> count dict, NULL unless indexed */
+
+    /* Synchronization for blocking `push` and `pop`. The elements are only
+       ever touched while holding the GIL; the mutex only guards sleeping and
+       waking up on the condition variables while the GIL is released. */
+    pthread_mutex_t q_mutex;
+    pthread_cond_t q_not_empty;  /* signalled when an element is pushed */
+    pthread_cond_t q_not_full;   /* signalled when space is freed */
+    Py_ssize_t q_getters;        /* the number of threads waiting in `pop` */
+    Py_ssize_t q_putters;        /* the number of threads waiting in `push` */
+
+    /* `async_pop` and `async_push` awaitables waiting for an element or for
+       space */
+    queue_waitlist q_async_getters;
+    queue_waitlist q_async_putters;
+
+#ifdef QUEUE_STATS
+    /* Counters for `stats`. They are only ever incremented on the push and
+       pop paths; everything else is computed when they are read. */
+    Py_ssize_t q_pushes;      /* elements stored by any kind of push */
+    Py_ssize_t q_pops;        /* elements removed by any kind of pop */
+    Py_ssize_t q_full;        /* pushes which raised `Full` */
+    Py_ssize_t q_empty;       /* pops which raised `Empty` */
+    Py_ssize_t q_high_water;  /* the largest `q_size` since the last reset */
+
+    /* With `residency=True`, the time each element was pushed, in the same
+       layout as `q_slots`, and the histogram of how long popped elements
+       waited. Both are NULL otherwise. */
+    int64_t* q_stamps;
+    Py_ssize_t* q_residency;
+
+    /* `q_registry_next` and the pointer which points at this queue, either
+       `queue_registry` or the previous queue's `q_registry_next`. NULL when
+       the queue isn't in the registry. */
+    struct queue* q_registry_next;
+    struct queue** q_registry_link;
+#endif
+
+    /* the ring buffer while it has at most `Py_SIZE(self)` slots */
+    PyObject* q_inline[];
+} queue;
+
+/* Look up the slot for the element at logical index `ix` of the queue. The
+   capacity is always a power of two so we can wrap around the end of the ring
+   with a mask instead of a division. This is only valid when
+   `q_capacity > 0`. */
+#define QUEUE_SLOT(self, ix)                                            \
+    ((self)->q_slots[((self)->q_head + (ix)) & ((self)->q_capacity - 1)])
+
+/* Counting in the push and pop paths. `QUEUE_STATS_PUSHED` also moves the
+   high-water mark, so it goes after `q_size` has grown.
+   `QUEUE_STATS_STAMP` records the push time of the `count` elements from
+   logical index `first`, and `QUEUE_STATS_RESIDENCY` records how long the
+   first `count` elements waited just before they are popped. Both do nothing
+   unless the queue was created with `residency=True`.
+   `QUEUE_STATS_MOVE_STAMP` follows an element moved between physical slots.
+   Without `QUEUE_STATS` they all compile to nothing. */
+#ifdef QUEUE_STATS
+#define QUEUE_STATS_PUSHED(self, n)                                     \
+    do {                                                                \
+        (self)->q_pushes += (n);                                        \
+        if ((self)->q_size > (self)->q_high_water) {                    \
+            (self)->q_high_water = (self)->q_size;                      \
+        }                                                               \
+    } while (0)
+#define QUEUE_STATS_POPPED(self, n) ((self)->q_pops += (n))
+#define QUEUE_STATS_FULL(self) (++(self)->q_full)
+#define QUEUE_STATS_EMPTY(self) (++(self)->q_empty)
+#define QUEUE_STATS_STAMP(self, first, count)                           \
+    do {                                                                \
+        if ((self)->q_stamps) {                                         \
+            queue_stats_stamp((self), (first), (count));                \
+        }                                                               \
+    } while (0)
+#define QUEUE_STATS_RESIDENCY(self, count)                              \
+    do {                                                                \
+        if ((self)->q_stamps) {                                         \
+            queue_stats_residency((self), (count));                     \
+        }                                                               \
+    } while (0)
+#define QUEUE_STATS_MOVE_STAMP(self, to, from)                          \
+    do {                                                                \
+        if ((self)->q_stamps) {                                         \
+            (self)->q_stamps[(to)] = (self)->q_stamps[(from)];          \
+        }                                                               \
+    } while (0)
+#else
+#define QUEUE_STATS_PUSHED(self, n) ((void) 0)
+#define QUEUE_STATS_POPPED(self, n) ((void) 0)
+#define QUEUE_STATS_FULL(self) ((void) 0)
+#define QUEUE_STATS_EMPTY(self) ((void) 0)
+#define QUEUE_STATS_STAMP(self, first, count) ((void) 0)
+#define QUEUE_STATS_RESIDENCY(self, count) ((void) 0)
+#define QUEUE_STATS_MOVE_STAMP(self, to, from) ((void) 0)
+#endif
+
+static PyTypeObject queue_type;
+static int queue_contains(queue* self, PyObject* element);
+
+/* the state of an `async_push` or `async_pop` awaitable */
+typedef enum {
+    QUEUE_AWAITABLE_NEW,     /* not waiting */
+    QUEUE_AWAITABLE_PARKED,  /* on a waitlist with an unresolved future */
+    QUEUE_AWAITABLE_WOKEN,   /* taken off the waitlist, future resolved */
+    QUEUE_AWAITABLE_DONE,    /* the operation completed */
+} queue_awaitable_state;
+
+/* The awaitable returned by `Queue.async_push` and `Queue.async_pop`. It is
+   its own iterator: each step tries the operation and either finishes or
+   yields an asyncio future to the task driving it. */
+typedef struct queue_awaitable {
+    PyObject aw_base;            /* storage for our type and reference count */
+    queue* aw_queue;             /* the queue to push to or pop from */
+    PyObject* aw_element;        /* the element to push, NULL for `pop` */
+    PyObject* aw_future;         /* the future yielded while parked */
+    PyObject* aw_loop;           /* the event loop `aw_future` belongs to */
+    int aw_push;                 /* 1 for `async_push`, 0 for `async_pop` */
+    queue_awaitable_state aw_state;
+    struct queue_awaitable* aw_prev;  /* neighbours on the waitlist */
+    struct queue_awaitable* aw_next;
+} queue_awaitable;
+
+#ifdef QUEUE_USE_FREELISTS
+/* Dead `Queue` objects whose mutex and condition variables are still
+   initialized. They are untracked and hold no storage. */
+static queue* queue_freelist[QUEUE_FREELIST_SIZE];
+static int queue_freelist_size;
+
+/* Dead `async_push` and `async_pop` awaitables. They are untracked and hold
+   no references. */
+static queue_awaitable* queue_awaitable_freelist[QUEUE_FREELIST_SIZE];
+static int queue_awaitable_freelist_size;
+
+/* `queue_pool[c]` holds free ring buffers of `2 * QUEUE_MIN_CAPACITY << c`
+   slots */
+static PyObject** queue_pool[QUEUE_POOL_CLASSES][QUEUE_POOL_DEPTH];
+static int queue_pool_size[QUEUE_POOL_CLASSES];
+
+/* Find the pool for ring buffers of `capacity` slots, or return -1 if rings
+   that large are not pooled. `capacity` must be a power of 2 and larger than
+   `QUEUE_MIN_CAPACITY`. */
+static int
+queue_pool_class(Py_ssize_t capacity)
+{
+    int class = 0;
+
+    if (capacity > QUEUE_POOL_MAX_CAPACITY) {
+        return -1;
+    }
+    while ((2 * QUEUE_MIN_CAPACITY << class) < capacity) {
+        ++class;
+    }
+    return class;
+}
+#endif
+
+#ifdef QUEUE_STATS
+/* Every live `Queue`, newest first, for `all_stats`. With the GIL nothing
+   else runs while the list changes; the free-threaded build guards it with a
+   mutex. */
+static queue* queue_registry;
+#ifdef Py_GIL_DISABLED
+static PyMutex queue_registry_mutex;
+#define QUEUE_REGISTRY_LOCK() PyMutex_Lock(&queue_registry_mutex)
+#define QUEUE_REGISTRY_UNLOCK() PyMutex_Unlock(&queue_registry_mutex)
+#else
+#define QUEUE_REGISTRY_LOCK()
+#define QUEUE_REGISTRY_UNLOCK()
+#endif
+
+static void
+queue_registry_add(queue* self)
+{
+    QUEUE_REGISTRY_LOCK();
+    self->q_registry_next = queue_registry;
+    self->q_registry_link = &queue_registry;
+    if (queue_registry) {
+        queue_registry->q_registry_link = &self->q_registry_next;
+    }
+    queue_registry = self;
+    QUEUE_REGISTRY_UNLOCK();
+}
+
+/* Unlink `self` if it is in the registry. This must happen before anything
+   in `queue_dealloc` can run code which might read the registry. */
+static void
+queue_registry_remove(queue* self)
+{
+    QUEUE_REGISTRY_LOCK();
+    if (self->q_registry_link) {
+        *self->q_registry_link = self->q_registry_next;
+        if (self->q_registry_next) {
+            self->q_registry_next->q_registry_link = self->q_registry_link;
+        }
+        self->q_registry_next = NULL;
+        self->q_registry_link = NULL;
+    }
+    QUEUE_REGISTRY_UNLOCK();
+}
+
+/* the monotonic clock in nanoseconds */
+static int64_t
+queue_stats_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Stamp the `count` elements from logical index `first` with the time they
+   were pushed. One clock read covers a whole batch. */
+static void
+queue_stats_stamp(queue* self, Py_ssize_t first, Py_ssize_t count)
+{
+    int64_t now = queue_stats_now();
+    Py_ssize_t n;
+
+    for (n = first; n < first + count; ++n) {
+        self->q_stamps[(self->q_head + n) & (self->q_capacity - 1)] = now;
+    }
+}
+
+/* Count how long each of the first `count` elements waited in the residency
+   histogram. Bucket 0 is under a microsecond and bucket `b` is from
+   `2 ** (b - 1)` up to `2 ** b` microseconds. */
+static void
+queue_stats_residency(queue* self, Py_ssize_t count)
+{
+    int64_t now = queue_stats_now();
+    uint64_t micros;
+    int bucket;
+    Py_ssize_t n;
+
+    for (n = 0; n < count; ++n) {
+        micros = (uint64_t) (now - self->q_stamps[(self->q_head + n) &
+                                                  (self->q_capacity - 1)]) /
+            1000;
+        for (bucket = 0;
+             micros && bucket < QUEUE_RESIDENCY_BUCKETS - 1;
+             ++bucket) {
+            micros >>= 1;
+        }
+        ++self->q_residency[bucket];
+    }
+}
+#endif
+
+/* Allocate a ring buffer of `capacity` slots for `self`. A small ring uses
+   the inline slots; otherwise we reuse a pooled buffer when we have one of
+   the right size. */
+static PyObject**
+queue_slots_alloc(queue* self, Py_ssize_t capacity)
+{
+    PyObject** slots;
+#ifdef QUEUE_USE_FREELISTS
+    int class;
+#endif
+
+    if (capacity <= Py_SIZE(self)) {
+        return self->q_inline;
+    }
+
+#ifdef QUEUE_USE_FREELISTS
+    class = queue_pool_class(capacity);
+
+    if (class >= 0 && queue_pool_size[class]) {
+        return queue_pool[class][--queue_pool_size[class]];
+    }
+#endif
+
+    if (!(slots = PyMem_New(PyObject*, capacity))) {
+        PyErr_NoMemory();
+    }
+    return slots;
+}
+
+/* Give back a ring buffer of `capacity` slots from `queue_slots_alloc`.
+   `slots` may be NULL. */
+static void
+queue_slots_free(queue* self, PyObject** slots, Py_ssize_t capacity)
+{
+#ifdef QUEUE_USE_FREELISTS
+    int class;
+#endif
+
+    if (slots == self->q_inline) {
+        return;
+    }
+
+#ifdef QUEUE_USE_FREELISTS
+    if (slots &&
+        (class = queue_pool_class(capacity)) >= 0 &&
+        queue_pool_size[class] < QUEUE_POOL_DEPTH) {
+        queue_pool[class][queue_pool_size[class]++] = slots;
+        return;
+    }
+#endif
+
+    PyMem_Free(slots);
+}
+
+static int
+queue_resize(queue* self, Py_ssize_t needed)
+{
+    Py_ssize_t new_capacity = QUEUE_MIN_CAPACITY;
+    PyObject** new_slots;
+    Py_ssize_t n;
+
+    /* grow geometrically so that a sequence of `push` calls is amortized
+       O(1) */
+    while (new_capacity < needed) {
+        if (new_capacity > PY_SSIZE_T_MAX / 2 / (Py_ssize_t) sizeof(PyObject*)) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        new_capacity *= 2;
+    }
+
+    /* The ring never resizes to its own capacity, so the inline slots are
+       never both the source and the destination of the copy below. */
+    assert(new_capacity != self->q_capacity);
+    if (!(new_slots = queue_slots_alloc(self, new_capacity))) {
+        return -1;
+    }
+
+#ifdef QUEUE_STATS
+    /* the push times move with the elements */
+    if (self->q_residency) {
+        int64_t* new_stamps;
+
+        if (!(new_stamps = PyMem_New(int64_t, new_capacity))) {
+            queue_slots_free(self, new_slots, new_capacity);
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (n = 0; n < self->q_size; ++n) {
+            new_stamps[n] =
+                self->q_stamps[(self->q_head + n) & (self->q_capacity - 1)];
+        }
+        PyMem_Free(self->q_stamps);
+        self->q_stamps = new_stamps;
+    }
+#endif
+
+    /* copy the elements into the new buffer so that the head is at index 0;
+       this moves the references, no reference counts change */
+    for (n = 0; n < self->q_size; ++n) {
+        new_slots[n] = QUEUE_SLOT(self, n);
+    }
+
+    queue_slots_free(self, self->q_slots, self->q_capacity);
+    self->q_slots = new_slots;
+    self->q_capacity = new_capacity;
+    self->q_head = 0;
+    return 0;
+}
+
+/* Wake up one thread waiting on `cond` if there are any `waiters`. This must
+   be called with the GIL held after the queue has changed. */
+static void
+queue_notify(queue* self, pthread_cond_t* cond, Py_ssize_t waiters)
+{
+    if (!waiters) {
+        /* nobody is waiting, don't pay for the mutex */
+        return;
+    }
+
+    pthread_mutex_lock(&self->q_mutex);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&self->q_mutex);
+}
+
+/* Append `aw` to the waitlist, or put it at the front if `front` is true. */
+static void
+queue_waitlist_park(queue_waitlist* list, queue_awaitable* aw, int front)
+{
+    if (front) {
+        aw->aw_prev = NULL;
+        aw->aw_next = list->wl_first;
+    }
+    else {
+        aw->aw_prev = list->wl_last;
+        aw->aw_next = NULL;
+    }
+    if (aw->aw_prev) {
+        aw->aw_prev->aw_next = aw;
+    }
+    else {
+        list->wl_first = aw;
+    }
+    if (aw->aw_next) {
+        aw->aw_next->aw_prev = aw;
+    }
+    else {
+        list->wl_last = aw;
+    }
+    aw->aw_state = QUEUE_AWAITABLE_PARKED;
+}
+
+/* Take a parked `aw` off the waitlist. */
+static void
+queue_waitlist_unpark(queue_waitlist* list, queue_awaitable* aw)
+{
+    if (aw->aw_prev) {
+        aw->aw_prev->aw_next = aw->aw_next;
+    }
+    else {
+        list->wl_first = aw->aw_next;
+    }
+    if (aw->aw_next) {
+        aw->aw_next->aw_prev = aw->aw_prev;
+    }
+    else {
+        list->wl_last = aw->aw_prev;
+    }
+    aw->aw_prev = aw->aw_next = NULL;
+    aw->aw_state = QUEUE_AWAITABLE_NEW;
+}
+
+/* Look up `module_name.name` the first time it is needed and cache it in
+   `*cache`. Returns a borrowed reference, or NULL with an exception set. */
+static PyObject*
+queue_import(const char* module_name, const char* name, PyObject** cache)
+{
+    PyObject* module;
+
+#ifdef Py_GIL_DISABLED
+    static PyMutex import_mutex;
+
+    PyMutex_Lock(&import_mutex);
+#endif
+    if (!*cache && (module = PyImport_ImportModule(module_name))) {
+        *cache = PyObject_GetAttrString(module, name);
+        Py_DECREF(module);
+    }
+#ifdef Py_GIL_DISABLED
+    PyMutex_Unlock(&import_mutex);
+#endif
+    return *cache;
+}
+
+/* `asyncio._get_running_loop`, imported the first time a task is woken */
+static PyObject* queue_current_loop;
+
+/* The callback which resolves a future on its own loop for a waker on another
+   thread, created when the module is imported. */
+static PyObject* queue_resolve_future_callback;
+
+/* Resolve `future` unless it was cancelled while the callback was on its way
+   to the loop. */
+static PyObject*
+queue_resolve_future(PyObject* unused, PyObject* future)
+{
+    PyObject* done;
+    int is_done;
+
+    if (!(done = PyObject_CallMethod(future, "done", NULL))) {
+        return NULL;
+    }
+    is_done = PyObject_IsTrue(done);
+    Py_DECREF(done);
+    if (is_done < 0) {
+        return NULL;
+    }
+    if (is_done) {
+        Py_RETURN_NONE;
+    }
+    return PyObject_CallMethod(future, "set_result", "O", Py_None);
+}
+
+static PyMethodDef queue_resolve_future_def = {
+    "_resolve_future",
+    (PyCFunction) queue_resolve_future,
+    METH_O,
+    NULL,
+};
+
+/* Resolve the future of a woken awaitable. Futures aren't thread-safe, so
+   unless we are running on the loop the future belongs to, the loop is asked
+   to do it with `call_soon_threadsafe`, which also wakes the loop up if it is
+   blocked waiting for I/O. `*current` caches the loop running on this thread
+   across calls, starting out as NULL. Returns 0, or -1 with an exception
+   set. */
+static int
+queue_resolve(PyObject* future, PyObject* loop, PyObject** current)
+{
+    PyObject* get_current_loop;
+    PyObject* result;
+
+    if (!*current) {
+        if (!(get_current_loop = queue_import("asyncio",
+                                              "_get_running_loop",
+                                              &queue_current_loop)) ||
+            !(*current = PyObject_CallObject(get_current_loop, NULL))) {
+            return -1;
+        }
+    }
+
+    if (*current == loop) {
+        result = PyObject_CallMethod(future, "set_result", "O", Py_None);
+    }
+    else {
+        result = PyObject_CallMethod(loop,
+                                     "call_soon_threadsafe",
+                                     "OO",
+                                     queue_resolve_future_callback,
+                                     future);
+    }
+    if (!result) {
+        return -1;
+    }
+    Py_DECREF(result);
+    return 0;
+}
+
+/* Wake up the parked awaitables that can make progress now: one getter per
+   element not already promised to a woken getter, and one putter per free
+   slot not already promised to a woken putter. Resolving a future calls into
+   the event loop, so this must only be called once the queue is
+   consistent. It may be called from any thread, not just the one running the
+   loop of the parked tasks. It never raises; a future which can't be
+   resolved, because it was cancelled or its loop is closed, is dropped from
+   the waitlist. */
+static void
+queue_async_wake(queue* self)
+{
+    PyObject* exc_type;
+    PyObject* exc_value;
+    PyObject* exc_tb;
+    PyObject* current = NULL;
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    for (;;) {
+        queue_waitlist* list;
+        queue_awaitable* aw;
+        PyObject* future;
+        PyObject* loop;
+
+        if (self->q_async_getters.wl_first &&
+            self->q_size > self->q_async_getters.wl_woken) {
+            list = &self->q_async_getters;
+        }
+        else if (self->q_async_putters.wl_first &&
+                 (self->q_maxsize <= 0 ||
+                  self->q_size + self->q_async_putters.wl_woken <
+                  self->q_maxsize)) {
+            list = &self->q_async_putters;
+        }
+        else {
+            break;
+        }
+
+        /* Update our bookkeeping before calling into the loop, which may run
+           code that uses this queue. */
+        aw = list->wl_first;
+        queue_waitlist_unpark(list, aw);
+        aw->aw_state = QUEUE_AWAITABLE_WOKEN;
+        ++list->wl_woken;
+        future = aw->aw_future;
+        aw->aw_future = NULL;
+        loop = aw->aw_loop;
+        aw->aw_loop = NULL;
+
+        Py_INCREF(aw);
+        if (queue_resolve(future, loop, &current)) {
+            /* nobody is waiting on this future anymore */
+            PyErr_Clear();
+            if (aw->aw_state == QUEUE_AWAITABLE_WOKEN) {
+                aw->aw_state = QUEUE_AWAITABLE_NEW;
+                --list->wl_woken;
+            }
+        }
+        Py_DECREF(future);
+        Py_DECREF(loop);
+        Py_DECREF(aw);
+    }
+    Py_XDECREF(current);
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/* Wake up any `async_push` or `async_pop` awaitables which can make progress
+   after the queue changed. With nobody waiting this is two loads. */
+static void
+queue_async_notify(queue* self)
+{
+    if (self->q_async_getters.wl_first || self->q_async_putters.wl_first) {
+        queue_async_wake(self);
+    }
+}
+
+/* Convert an optional `timeout` argument in seconds into an absolute deadline
+   on the monotonic clock. `*has_deadline` is set to 0 when `timeout` is
+   `None`. */
+static int
+queue_deadline(PyObject* timeout,
+               struct timespec* deadline,
+               int* has_deadline)
+{
+    double seconds;
+
+    if (!timeout || timeout == Py_None) {
+        /* wait forever */
+        *has_deadline = 0;
+        return 0;
+    }
+
+    seconds = PyFloat_AsDouble(timeout);
+    if (seconds == -1.0 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (!(seconds >= 0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "'timeout' must be a non-negative number");
+        return -1;
+    }
+    if (seconds > (double) (PY_TIMEOUT_MAX / 1000000)) {
+        PyErr_SetString(PyExc_OverflowError, "timeout value is too large");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += (time_t) seconds;
+    deadline->tv_nsec += (long) ((seconds - (double) (time_t) seconds) * 1e9);
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+
+    *has_deadline = 1;
+    return 0;
+}
+
+/* Block on `cond` with the GIL released until another thread notifies us,
+   `deadline` passes, or it is time to check for signals. The caller must
+   re-check the state of the queue when this returns 0.
+
+   Returns 1 if the deadline has passed, 0 if the caller should check again,
+   and -1 with an exception set if a signal handler raised. */
+static int
+queue_wait(queue* self,
+           pthread_cond_t* cond,
+           Py_ssize_t* waiters,
+           const struct timespec* deadline)
+{
+    struct timespec now;
+    struct timespec wake;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (deadline &&
+        (now.tv_sec > deadline->tv_sec ||
+         (now.tv_sec == deadline->tv_sec &&
+          now.tv_nsec >= deadline->tv_nsec))) {
+        return 1;
+    }
+
+    /* never sleep past the next signal check */
+    wake = now;
+    wake.tv_nsec += QUEUE_SIGNAL_CHECK_INTERVAL;
+    if (wake.tv_nsec >= 1000000000L) {
+        wake.tv_sec += 1;
+        wake.tv_nsec -= 1000000000L;
+    }
+    if (deadline &&
+        (deadline->tv_sec < wake.tv_sec ||
+         (deadline->tv_sec == wake.tv_sec &&
+          deadline->tv_nsec < wake.tv_nsec))) {
+        wake = *deadline;
+    }
+
+    /* Register as a waiter and take the mutex while we still hold the GIL.
+       Another thread can only change the queue after we release the GIL, and
+       it must take the mutex to notify us, which it can't do until we are
+       inside `pthread_cond_timedwait`. This means no notification is lost
+       between checking the queue and going to sleep. */
+    ++*waiters;
+    pthread_mutex_lock(&self->q_mutex);
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_cond_timedwait(cond, &self->q_mutex, &wake);
+    pthread_mutex_unlock(&self->q_mutex);
+    Py_END_ALLOW_THREADS
+
+    --*waiters;
+
+    if (PyErr_CheckSignals()) {
+        /* a signal handler raised an exception */
+        return -1;
+    }
+    return 0;
+}
+
+/* Match the arguments of a `METH_FASTCALL | METH_KEYWORDS` call against the
+   NULL terminated array of parameter names in `keywords`. On success, `out`
+   holds a borrowed reference to each argument, or NULL if it was not passed.
+   The first `required` parameters must be passed.
+
+   This does the same job as `PyArg_ParseTupleAndKeywords` without packing the
+   arguments into a tuple and a dict first. Callers should still check for
+   their common cases, like a single positional argument, before calling
+   this. */
+static int
+queue_unpack_args(const char* fname,
+                  PyObject* const* args,
+                  Py_ssize_t nargs,
+                  PyObject* kwnames,
+                  const char* const* keywords,
+                  Py_ssize_t required,
+                  PyObject** out)
+{
+    Py_ssize_t nkeywords = 0;
+    Py_ssize_t nkwargs;
+    Py_ssize_t n;
+    Py_ssize_t k;
+    PyObject* name;
+
+    while (keywords[nkeywords]) {
+        ++nkeywords;
+    }
+
+    if (nargs > nkeywords) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s() takes at most %zd positional arguments (%zd given)",
+                     fname,
+                     nkeywords,
+                     nargs);
+        return -1;
+    }
+
+    for (n = 0; n < nkeywords; ++n) {
+        out[n] = (n < nargs) ? args[n] : NULL;
+    }
+
+    nkwargs = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    for (k = 0; k < nkwargs; ++k) {
+        name = PyTuple_GET_ITEM(kwnames, k);
+
+        for (n = 0; n < nkeywords; ++n) {
+            if (!PyUnicode_CompareWithASCIIString(name, keywords[n])) {
+                break;
+            }
+        }
+
+        if (n == nkeywords) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() got an unexpected keyword argument '%U'",
+                         fname,
+                         name);
+            return -1;
+        }
+        if (out[n]) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() got multiple values for argument '%s'",
+                         fname,
+                         keywords[n]);
+            return -1;
+        }
+
+        /* the keyword argument values follow the positional arguments */
+        out[n] = args[nargs + k];
+    }
+
+    for (n = 0; n < required; ++n) {
+        if (!out[n]) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() missing required argument '%s' (pos %zd)",
+                         fname,
+                         keywords[n],
+                         n + 1);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Look up the `overflow` policy named by `overflow_ob`. NULL means the
+   default, "raise". */
+static int
+queue_parse_overflow(PyObject* overflow_ob, queue_overflow* overflow)
+{
+    int n;
+
+    *overflow = QUEUE_OVERFLOW_RAISE;
+    if (!overflow_ob) {
+        return 0;
+    }
+
+    if (!PyUnicode_Check(overflow_ob)) {
+        PyErr_Format(PyExc_TypeError,
+                     "overflow must be a str, not %.200s",
+                     Py_TYPE(overflow_ob)->tp_name);
+        return -1;
+    }
+
+    for (n = 0; queue_overflow_names[n]; ++n) {
+        if (!PyUnicode_CompareWithASCIIString(overflow_ob,
+                                              queue_overflow_names[n])) {
+            *overflow = (queue_overflow) n;
+            return 0;
+        }
+    }
+
+    PyErr_Format(PyExc_ValueError,
+                 "overflow must be 'raise', 'drop_newest' or "
+                 "'overwrite_oldest', not %R",
+                 overflow_ob);
+    return -1;
+}
+
+/* Create the mutex and condition variables used to block in `push` and
+   `pop`. The condition variables time out against the monotonic clock so
+   changes to the wall clock don't affect timeouts. On failure this destroys
+   whatever it already created and returns -1 with an exception set. */
+static int
+queue_init_sync(queue* self)
+{
+    pthread_condattr_t attr;
+
+    if (pthread_condattr_init(&attr)) {
+        goto error;
+    }
+    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+        pthread_mutex_init(&self->q_mutex, NULL)) {
+        goto error_attr;
+    }
+    if (pthread_cond_init(&self->q_not_empty, &attr)) {
+        goto error_mutex;
+    }
+    if (pthread_cond_init(&self->q_not_full, &attr)) {
+        goto error_not_empty;
+    }
+    pthread_condattr_destroy(&attr);
+    return 0;
+
+error_not_empty:
+    pthread_cond_destroy(&self->q_not_empty);
+error_mutex:
+    pthread_mutex_destroy(&self->q_mutex);
+error_attr:
+    pthread_condattr_destroy(&attr);
+error:
+    PyErr_SetString(PyExc_RuntimeError,
+                    "failed to create the queue's condition variables");
+    return -1;
+}
+
+/* Allocate and initialize a new, empty queue. This is shared by `tp_new` and
+   the vectorcall constructor. */
+static PyObject*
+queue_alloc(PyTypeObject* cls,
+            Py_ssize_t maxsize,
+            queue_overflow overflow,
+            int index,
+            int residency)
+{
+    queue* self;
+
+#ifdef QUEUE_USE_FREELISTS
+    /* Reuse a dead queue if we have one. Its mutex and condition variables
+       are still initialized and its storage was released by `queue_clear`,
+       so we only need to bring it back to life and reset the counters that
+       `tp_alloc` would have zeroed. */
+    if (cls == &queue_type && queue_freelist_size) {
+        self = queue_freelist[--queue_freelist_size];
+        PyObject_InitVar((PyVarObject*) self, cls, QUEUE_MIN_CAPACITY);
+        self->q_dropped = 0;
+        self->q_version = 0;
+#ifdef QUEUE_STATS
+        self->q_pushes = 0;
+        self->q_pops = 0;
+        self->q_full = 0;
+        self->q_empty = 0;
+        self->q_high_water = 0;
+#endif
+        PyObject_GC_Track(self);
+        goto initialized;
+    }
+#endif
+
+    /* Allocate memory for the instance with `tp_alloc`. We are a varobject
+       so `nitems` is the number of inline slots to allocate after the
+       struct. `tp_alloc` zeros the memory so we start with no slots, a
+       capacity of 0, and no elements. The ring buffer is set up lazily on
+       the first push. */
+    if (!(self = (queue*) cls->tp_alloc(cls, QUEUE_MIN_CAPACITY))) {
+        /* allocation of the instance failed */
+        return NULL;
+    }
+
+    if (queue_init_sync(self)) {
+        /* `queue_dealloc` would destroy the mutex and condition variables,
+           so free the empty object directly. `Queue` can't be subclassed, so
+           `cls` is our static type and holds no reference to drop. */
+        PyObject_GC_UnTrack(self);
+        cls->tp_free(self);
+        return NULL;
+    }
+
+#ifdef QUEUE_USE_FREELISTS
+initialized:
+#endif
+    /* normalize "unlimited" to -1 */
+    if (maxsize < 0) {
+        maxsize = -1;
+    }
+
+    /* store the maxsize and overflow policy on the instance */
+    self->q_maxsize = maxsize;
+    self->q_overflow = overflow;
+
+    /* an indexed queue starts with an empty multiset of its elements */
+    if (index && !(self->q_index = PyDict_New())) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+#ifdef QUEUE_STATS
+    /* the push times are allocated with the ring; the histogram is now */
+    if (residency &&
+        !(self->q_residency = PyMem_Calloc(QUEUE_RESIDENCY_BUCKETS,
+                                           sizeof(Py_ssize_t)))) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    queue_registry_add(self);
+#else
+    if (residency) {
+        PyErr_SetString(PyExc_ValueError,
+                        "queue statistics are not compiled in");
+        Py_DECREF(self);
+        return NULL;
+    }
+#endif
+
+    /* erase the type queue c level type information and return to Python as a
+       generic object */
+    return (PyObject*) self;
+}
+
+static PyObject*
+queue_new(PyTypeObject* cls, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"maxsize",
+                               "overflow",
+                               "index",
+                               "residency",
+                               NULL};
+
+    Py_ssize_t maxsize = -1;
+    PyObject* overflow_ob = NULL;
+    queue_overflow overflow;
+    int index = 0;
+    int residency = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|nOpp:Queue",
+                                     keywords,
+                                     &maxsize,
+                                     &overflow_ob,
+                                     &index,
+                                     &residency)) {
+        /* argument parsing failed */
+        return NULL;
+    }
+
+    if (queue_parse_overflow(overflow_ob, &overflow)) {
+        return NULL;
+    }
+
+    return queue_alloc(cls, maxsize, overflow, index, residency);
+}
+
+#if PY_VERSION_HEX >= 0x03090000
+/* `Queue(...)` calls this directly instead of `tp_new`. This skips building
+   an argument tuple and kwargs dict and the generic `type.__call__`
+   machinery. */
+static PyObject*
+queue_vectorcall(PyObject* cls,
+                 PyObject* const* args,
+                 size_t nargsf,
+                 PyObject* kwnames)
+{
+    static const char* const keywords[] = {"maxsize",
+                                           "overflow",
+                                           "index",
+                                           "residency",
+                                           NULL};
+
+    PyObject* argv[4];
+    Py_ssize_t maxsize = -1;
+    queue_overflow overflow;
+    int index = 0;
+    int residency = 0;
+
+    if (queue_unpack_args("Queue",
+                          args,
+                          PyVectorcall_NARGS(nargsf),
+                          kwnames,
+                          keywords,
+                          0,
+                          argv)) {
+        /* argument parsing failed */
+        return NULL;
+    }
+
+    if (argv[0] &&
+        (maxsize = PyNumber_AsSsize_t(argv[0], PyExc_OverflowError)) == -1 &&
+        PyErr_Occurred()) {
+        return NULL;
+    }
+
+    if (queue_parse_overflow(argv[1], &overflow)) {
+        return NULL;
+    }
+
+    if (argv[2] && (index = PyObject_IsTrue(argv[2])) < 0) {
+        return NULL;
+    }
+    if (argv[3] && (residency = PyObject_IsTrue(argv[3])) < 0) {
+        return NULL;
+    }
+
+    return queue_alloc((PyTypeObject*) cls,
+                       maxsize,
+                       overflow,
+                       index,
+                       residency);
+}
+#endif
+
+static int
+queue_clear(queue* self)
+{
+    PyObject* inline_slots[QUEUE_MIN_CAPACITY];
+    PyObject** slots = self->q_slots;
+    Py_ssize_t capacity = self->q_capacity;
+    Py_ssize_t head = self->q_head;
+    Py_ssize_t size = self->q_size;
+    PyObject* index = self->q_index;
+    Py_ssize_t n;
+
+    /* Detach the storage from `self` before releasing any references.
+       Decrementing an element's reference count may run arbitrary code, like
+       a `__del__` method, which could try to use this queue. The queue must
+       already look empty when that happens. A re-entrant push would reuse
+       the inline slots, so we move their references out first. */
+    if (slots == self->q_inline) {
+        memcpy(inline_slots, slots, capacity * sizeof(PyObject*));
+        slots = inline_slots;
+    }
+    self->q_slots = NULL;
+    self->q_capacity = 0;
+    self->q_head = 0;
+    self->q_size = 0;
+    self->q_index = NULL;
+    ++self->q_version;
+#ifdef QUEUE_STATS
+    PyMem_Free(self->q_stamps);
+    self->q_stamps = NULL;
+    PyMem_Free(self->q_residency);
+    self->q_residency = NULL;
+#endif
+
+    /* the index holds references to the elements too */
+    Py_XDECREF(index);
+    for (n = 0; n < size; ++n) {
+        Py_DECREF(slots[(head + n) & (capacity - 1)]);
+    }
+    if (slots != inline_slots) {
+        queue_slots_free(self, slots, capacity);
+    }
+
+    /* 0 means success */
+    return 0;
+}
+
+static void
+queue_dealloc(queue* self)
+{
+    /* tell the cyclic gc to stop watching our object */
+    PyObject_GC_UnTrack(self);
+
+    /* Releasing the last reference to an element which is itself a queue
+       deallocates it from inside this function, so a long chain of nested
+       queues would recurse once per queue and overflow the C stack. The
+       trashcan, which `list` uses too, defers the deallocations past a fixed
+       depth and runs them once the stack has unwound. */
+    Py_TRASHCAN_BEGIN(self, queue_dealloc)
+
+#ifdef QUEUE_STATS
+    /* `all_stats` must not find a queue which is being destroyed */
+    queue_registry_remove(self);
+#endif
+
+    /* release our references to the elements and free the ring buffer */
+    queue_clear(self);
+
+#ifdef QUEUE_USE_FREELISTS
+    /* Keep the object, with its mutex and condition variables, for the next
+       `Queue()`. Only exact queues go on the freelist because `queue_alloc`
+       hands them back out as `queue_type`. This must still leave through
+       `Py_TRASHCAN_END`, which undoes the depth count of
+       `Py_TRASHCAN_BEGIN`. */
+    if (Py_TYPE(self) == &queue_type &&
+        queue_freelist_size < QUEUE_FREELIST_SIZE) {
+        queue_freelist[queue_freelist_size++] = self;
+        goto done;
+    }
+#endif
+
+    /* No thread can be waiting on the condition variables because a waiting
+       thread holds a reference to `self`. */
+    pthread_cond_destroy(&self->q_not_full);
+    pthread_cond_destroy(&self->q_not_empty);
+    pthread_mutex_destroy(&self->q_mutex);
+
+    /* deallocate our self */
+    Py_TYPE(self)->tp_free(self);
+
+#ifdef QUEUE_USE_FREELISTS
+done:
+#endif
+    Py_TRASHCAN_END
+}
+
+static int
+queue_traverse(queue* self, visitproc visit, void* arg)
+{
+    Py_ssize_t n;
+
+    /* visit each element we hold a reference to */
+    for (n = 0; n < self->q_size; ++n) {
+        Py_VISIT(QUEUE_SLOT(self, n));
+    }
+    Py_VISIT(self->q_index);
+
+    /* 0 means success */
+    return 0;
+}
+
+static PyObject*
+queue_repr(queue* self)
+{
+    if (self->q_maxsize < 0) {
+        /* repr which looks like '<queue.Queue: 4>' with 4 elements in the
+           queue */
+        return PyUnicode_FromFormat("<%s: %zd>",
+                                    Py_TYPE(self)->tp_name,
+                                    self->q_size);
+    }
+
+    return PyUnicode_FromFormat("<%s: %zd/%zd>",
+                                Py_TYPE(self)->tp_name,
+                                self->q_size,
+                                self->q_maxsize);
+}
+
+PyDoc_STRVAR(queue_push_doc,
+             "Push an element onto the end of the queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "element : any\n"
+             "    The element to push.\n"
+             "block : bool, optional\n"
+             "    Wait for space if the queue is full. Defaults to True.\n"
+             "timeout : float, optional\n"
+             "    The most seconds to wait for space. ``None`` waits forever.\n"
+             "unique : bool, optional\n"
+             "    Don't push ``element`` if an equal element is already in\n"
+             "    the queue. Defaults to False.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "pushed : bool or None\n"
+             "    With ``unique=True``, False if ``element`` was rejected as\n"
+             "    a duplicate and True otherwise. None without ``unique``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Full\n"
+             "    Raised when the queue is still full after waiting.\n"
+             "TypeError\n"
+             "    Raised when the queue was created with ``index=True`` and\n"
+             "    ``element`` is not hashable.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "If the queue was created with ``overflow='drop_newest'`` or\n"
+             "``overflow='overwrite_oldest'``, pushing to a full queue never\n"
+             "blocks or raises. It discards ``element`` or the element at\n"
+             "the front of the queue instead and counts it in ``dropped``.\n"
+             "\n"
+             "``unique=True`` checks for duplicates in O(1) on a queue\n"
+             "created with ``index=True`` and scans the whole queue\n"
+             "otherwise. A duplicate is rejected without blocking.\n");
+
+/* The index of a queue created with `index=True` is a dict from each distinct
+   element to the number of times it is in the queue. It is updated with every
+   change to the ring so `in` is a hash lookup instead of a scan. */
+
+/* Count one more `element` in the index. */
+static int
+queue_index_add(queue* self, PyObject* element)
+{
+    PyObject* count;
+    Py_ssize_t n = 0;
+    int status;
+
+    if (!(count = PyDict_GetItemWithError(self->q_index, element))) {
+        if (PyErr_Occurred()) {
+            /* most likely `element` is unhashable */
+            return -1;
+        }
+    }
+    else {
+        n = PyLong_AsSsize_t(count);
+    }
+
+    if (!(count = PyLong_FromSsize_t(n + 1))) {
+        return -1;
+    }
+    status = PyDict_SetItem(self->q_index, element, count);
+    Py_DECREF(count);
+    return status;
+}
+
+/* Count one fewer `element` in the index. `element` has already left the ring
+   so there is no way to report an error to the caller; the only errors are
+   from `__eq__` or a hash which changed while the element was queued. This
+   also undoes `queue_index_add` on error paths, so the pending exception is
+   saved around the dict calls. */
+static void
+queue_index_discard(queue* self, PyObject* element)
+{
+    PyObject* exc_type;
+    PyObject* exc_value;
+    PyObject* exc_tb;
+    PyObject* count;
+    Py_ssize_t n;
+    int status = 0;
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    if (!(count = PyDict_GetItemWithError(self->q_index, element))) {
+        status = PyErr_Occurred() ? -1 : 0;
+    }
+    else if ((n = PyLong_AsSsize_t(count)) <= 1) {
+        status = PyDict_DelItem(self->q_index, element);
+    }
+    else if ((count = PyLong_FromSsize_t(n - 1))) {
+        status = PyDict_SetItem(self->q_index, element, count);
+        Py_DECREF(count);
+    }
+    else {
+        status = -1;
+    }
+    if (status) {
+        PyErr_WriteUnraisable((PyObject*) self);
+    }
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/* Count `items[0:count]` in the index before they are stored in the ring. On
+   failure the index is left as it was. Hashing and comparing the elements may
+   run code which uses this queue; the caller's checks for room would be stale
+   then, so the push fails like iterating over a dict which changed size. */
+static int
+queue_index_add_many(queue* self, PyObject** items, Py_ssize_t count)
+{
+    size_t version = self->q_version;
+    Py_ssize_t maxsize = self->q_maxsize;
+    Py_ssize_t n;
+
+    for (n = 0; n < count; ++n) {
+        if (queue_index_add(self, items[n])) {
+            goto error;
+        }
+    }
+    if (self->q_version != version || self->q_maxsize != maxsize) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "queue changed while indexing the pushed elements");
+        goto error;
+    }
+    return 0;
+
+error:
+    while (n--) {
+        queue_index_discard(self, items[n]);
+    }
+    return -1;
+}
+
+/* Push `element` onto a full queue according to the overflow policy. This is
+   O(1) and never allocates unless the queue is indexed. */
+static PyObject*
+queue_push_overflow(queue* self, PyObject* element)
+{
+    PyObject* oldest;
+
+    if (self->q_overflow == QUEUE_OVERFLOW_DROP_NEWEST) {
+        /* leave the queue as it is */
+        ++self->q_dropped;
+        Py_RETURN_NONE;
+    }
+
+    if (self->q_index && queue_index_add_many(self, &element, 1)) {
+        return NULL;
+    }
+    ++self->q_dropped;
+
+    /* Overwrite the oldest element: advance the head past it and store the
+       new element in the slot after the old tail. The ring already has at
+       least `q_size` slots so this reuses storage we have. */
+    oldest = QUEUE_SLOT(self, 0);
+    self->q_head = (self->q_head + 1) & (self->q_capacity - 1);
+    Py_INCREF(element);
+    QUEUE_SLOT(self, self->q_size - 1) = element;
+    ++self->q_version;
+    QUEUE_STATS_STAMP(self, self->q_size - 1, 1);
+    QUEUE_STATS_PUSHED(self, 1);
+
+    /* wake up a thread blocked in `pop` */
+    queue_notify(self, &self->q_not_empty, self->q_getters);
+
+    /* Release the dropped element last. Its `__del__` may use this queue,
+       which must already be consistent. */
+    if (self->q_index) {
+        queue_index_discard(self, oldest);
+    }
+    Py_DECREF(oldest);
+    Py_RETURN_NONE;
+}
+
+/* Append `element` to a queue which has room for it. */
+static int
+queue_put(queue* self, PyObject* element)
+{
+    if (self->q_index && queue_index_add_many(self, &element, 1)) {
+        return -1;
+    }
+    if (self->q_size == self->q_capacity &&
+        queue_resize(self, self->q_size + 1)) {
+        if (self->q_index) {
+            queue_index_discard(self, element);
+        }
+        return -1;
+    }
+
+    /* the ring buffer takes a new reference to the element */
+    Py_INCREF(element);
+    QUEUE_SLOT(self, self->q_size) = element;
+    QUEUE_STATS_STAMP(self, self->q_size, 1);
+    ++self->q_size;
+    ++self->q_version;
+    QUEUE_STATS_PUSHED(self, 1);
+
+    /* wake up a thread blocked in `pop` or a task in `async_pop` */
+    queue_notify(self, &self->q_not_empty, self->q_getters);
+    queue_async_notify(self);
+
+    return 0;
+}
+
+static PyObject*
+queue_push(queue* self,
+           PyObject* const* args,
+           Py_ssize_t nargs,
+           PyObject* kwnames)
+{
+    static const char* const keywords[] = {"element",
+                                           "block",
+                                           "timeout",
+                                           "unique",
+                                           NULL};
+    PyObject* argv[4];
+    PyObject* element;
+    int block = 1;
+    PyObject* timeout = NULL;
+    int unique = 0;
+    struct timespec deadline;
+    int has_deadline = 0;
+    int waited = 0;
+    int status;
+    PyObject* result;
+
+    if (nargs == 1 && !kwnames) {
+        /* fast path for the common `q.push(element)` */
+        element = args[0];
+    }
+    else {
+        if (queue_unpack_args("push", args, nargs, kwnames, keywords, 1, argv)) {
+            return NULL;
+        }
+        element = argv[0];
+        if (argv[1] && (block = PyObject_IsTrue(argv[1])) < 0) {
+            return NULL;
+        }
+        timeout = argv[2];
+        if (argv[3] && (unique = PyObject_IsTrue(argv[3])) < 0) {
+            return NULL;
+        }
+    }
+
+    if (unique) {
+        /* reject a duplicate before waiting for space */
+        if ((status = queue_contains(self, element)) < 0) {
+            return NULL;
+        }
+        if (status) {
+            Py_RETURN_FALSE;
+        }
+    }
+
+    if (self->q_maxsize > 0 && self->q_size >= self->q_maxsize &&
+        self->q_overflow != QUEUE_OVERFLOW_RAISE) {
+        /* the other overflow policies never block or raise */
+        if (!(result = queue_push_overflow(self, element)) || !unique) {
+            return result;
+        }
+        Py_DECREF(result);
+        Py_RETURN_TRUE;
+    }
+
+    if (block && queue_deadline(timeout, &deadline, &has_deadline)) {
+        return NULL;
+    }
+
+    while (self->q_maxsize > 0 && self->q_size >= self->q_maxsize) {
+        if (!block) {
+            QUEUE_STATS_FULL(self);
+            PyErr_SetString(queue_full_error, "full");
+            return NULL;
+        }
+
+        status = queue_wait(self,
+                            &self->q_not_full,
+                            &self->q_putters,
+                            has_deadline ? &deadline : NULL);
+        if (status < 0) {
+            return NULL;
+        }
+        if (status && self->q_size >= self->q_maxsize) {
+            /* the timeout expired and the queue is still full */
+            QUEUE_STATS_FULL(self);
+            PyErr_SetString(queue_full_error, "full");
+            return NULL;
+        }
+        waited = 1;
+    }
+
+    if (unique && waited) {
+        /* another thread may have pushed a duplicate while we waited */
+        if ((status = queue_contains(self, element)) < 0) {
+            return NULL;
+        }
+        if (status) {
+            Py_RETURN_FALSE;
+        }
+    }
+
+    if (queue_put(self, element)) {
+        return NULL;
+    }
+    if (unique) {
+        Py_RETURN_TRUE;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(queue_pop_doc,
+             "Remove and return the element at the front of the queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "block : bool, optional\n"
+             "    Wait for an element if the queue is empty. Defaults to True.\n"
+             "timeout : float, optional\n"
+             "    The most seconds to wait for an element. ``None`` waits\n"
+             "    forever.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Empty\n"
+             "    Raised when the queue is still empty after waiting.\n");
+
+/* Shrink the ring once it is at most a quarter full, so a queue gives back
+   the memory of a burst as it is popped. The new ring is the smallest power
+   of 2 which is at least twice the size, so it is at most half full and a
+   queue that hovers around a power of 2 doesn't reallocate on every step;
+   the copies stay amortized O(1) per pop like the copies for growing. An
+   empty ring is freed entirely unless it is the inline one. This is only an
+   optimization so a failed allocation is ignored.
+
+   Every pop checks whether to shrink, so the check is inlined into the pops
+   and the rare reallocation is kept out of line. */
+static Py_NO_INLINE void
+queue_shrink_slow(queue* self)
+{
+    PyObject* exc_type;
+    PyObject* exc_value;
+    PyObject* exc_tb;
+
+    if (!self->q_size) {
+        /* give everything back; the next push allocates again */
+        queue_slots_free(self, self->q_slots, self->q_capacity);
+        self->q_slots = NULL;
+        self->q_capacity = 0;
+        self->q_head = 0;
+#ifdef QUEUE_STATS
+        PyMem_Free(self->q_stamps);
+        self->q_stamps = NULL;
+#endif
+        return;
+    }
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    if (queue_resize(self, 2 * self->q_size)) {
+        PyErr_Clear();
+    }
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+static void
+queue_shrink(queue* self)
+{
+    if (self->q_size <= self->q_capacity / 4 &&
+        self->q_capacity > QUEUE_MIN_CAPACITY) {
+        queue_shrink_slow(self);
+    }
+}
+
+/* Remove the element at the front of a non-empty queue. The caller owns the
+   returned reference. */
+static PyObject*
+queue_take(queue* self)
+{
+    PyObject* element;
+
+    /* move the reference out of the head slot and advance the head; this is
+       amortized O(1) regardless of the size of the queue */
+    QUEUE_STATS_RESIDENCY(self, 1);
+    element = QUEUE_SLOT(self, 0);
+    self->q_head = (self->q_head + 1) & (self->q_capacity - 1);
+    --self->q_size;
+    ++self->q_version;
+    QUEUE_STATS_POPPED(self, 1);
+    queue_shrink(self);
+
+    /* wake up a thread blocked in `push` or a task in `async_push` */
+    queue_notify(self, &self->q_not_full, self->q_putters);
+    queue_async_notify(self);
+
+    if (self->q_index) {
+        queue_index_discard(self, element);
+    }
+
+    /* the reference owned by the ring buffer is given to the caller */
+    return element;
+}
+
+static PyObject*
+queue_pop(queue* self,
+          PyObject* const* args,
+          Py_ssize_t nargs,
+          PyObject* kwnames)
+{
+    static const char* const keywords[] = {"block", "timeout", NULL};
+    PyObject* argv[2];
+    int block = 1;
+    PyObject* timeout = NULL;
+    struct timespec deadline;
+    int has_deadline = 0;
+    int status;
+
+    /* `q.pop()` with no arguments needs no parsing at all */
+    if (nargs || kwnames) {
+        if (queue_unpack_args("pop", args, nargs, kwnames, keywords, 0, argv)) {
+            return NULL;
+        }
+        if (argv[0] && (block = PyObject_IsTrue(argv[0])) < 0) {
+            return NULL;
+        }
+        timeout = argv[1];
+    }
+
+    if (block && queue_deadline(timeout, &deadline, &has_deadline)) {
+        return NULL;
+    }
+
+    while (!self->q_size) {
+        if (!block) {
+            QUEUE_STATS_EMPTY(self);
+            PyErr_SetString(queue_empty_error, "empty");
+            return NULL;
+        }
+
+        status = queue_wait(self,
+                            &self->q_not_empty,
+                            &self->q_getters,
+                            has_deadline ? &deadline : NULL);
+        if (status < 0) {
+            return NULL;
+        }
+        if (status && !self->q_size) {
+            /* the timeout expired and the queue is still empty */
+            QUEUE_STATS_EMPTY(self);
+            PyErr_SetString(queue_empty_error, "empty");
+            return NULL;
+        }
+    }
+
+    return queue_take(self);
+}
+
+PyDoc_STRVAR(queue_push_many_doc,
+             "Push every element of an iterable onto the end of the queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "elements : iterable\n"
+             "    The elements to push, in order.\n"
+             "partial : bool, optional\n"
+             "    If the elements don't all fit, push as many as fit instead\n"
+             "    of raising. Defaults to False.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "count : int\n"
+             "    The number of elements pushed.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Full\n"
+             "    Raised when ``partial`` is False and the elements don't all\n"
+             "    fit. Nothing is pushed in this case.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "This never blocks. With ``overflow='drop_newest'`` the\n"
+             "elements that don't fit are dropped as if ``partial`` were\n"
+             "True. With ``overflow='overwrite_oldest'`` every element is\n"
+             "pushed and the oldest elements are dropped to make room.\n");
+
+/* Push every element of the list or tuple `elements` onto a queue which
+   overwrites its oldest elements when full. Only the newest `q_maxsize`
+   elements of the queue and the batch together are kept. Steals the
+   reference to `elements`. */
+static PyObject*
+queue_push_many_overwrite(queue* self, PyObject* elements)
+{
+    PyObject** items = PySequence_Fast_ITEMS(elements);
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(elements);
+    Py_ssize_t skip = 0;
+    Py_ssize_t evict;
+    PyObject* evicted;
+    Py_ssize_t n;
+
+    if (count > self->q_maxsize) {
+        /* the start of the batch would be overwritten by its own end */
+        skip = count - self->q_maxsize;
+    }
+    if (self->q_index &&
+        queue_index_add_many(self, items + skip, count - skip)) {
+        Py_DECREF(elements);
+        return NULL;
+    }
+    evict = self->q_size + (count - skip) - self->q_maxsize;
+
+    /* Move the evicted elements into a list instead of releasing them right
+       away. Their `__del__` methods could use this queue, so they are only
+       released once the queue is consistent again. */
+    if (!(evicted = PyList_New(evict)) ||
+        (self->q_size + (count - skip) - evict > self->q_capacity &&
+         queue_resize(self, self->q_maxsize))) {
+        Py_XDECREF(evicted);
+        if (self->q_index) {
+            for (n = skip; n < count; ++n) {
+                queue_index_discard(self, items[n]);
+            }
+        }
+        Py_DECREF(elements);
+        return NULL;
+    }
+
+    for (n = 0; n < evict; ++n) {
+        PyList_SET_ITEM(evicted, n, QUEUE_SLOT(self, n));
+    }
+    if (evict) {
+        self->q_head = (self->q_head + evict) & (self->q_capacity - 1);
+        self->q_size -= evict;
+    }
+
+    for (n = skip; n < count; ++n) {
+        Py_INCREF(items[n]);
+        QUEUE_SLOT(self, self->q_size + n - skip) = items[n];
+    }
+    QUEUE_STATS_STAMP(self, self->q_size, count - skip);
+    self->q_size += count - skip;
+    self->q_dropped += evict + skip;
+    ++self->q_version;
+    QUEUE_STATS_PUSHED(self, count - skip);
+
+    if (count && self->q_getters) {
+        pthread_mutex_lock(&self->q_mutex);
+        pthread_cond_broadcast(&self->q_not_empty);
+        pthread_mutex_unlock(&self->q_mutex);
+    }
+    queue_async_notify(self);
+
+    if (self->q_index) {
+        for (n = 0; n < evict; ++n) {
+            queue_index_discard(self, PyList_GET_ITEM(evicted, n));
+        }
+    }
+    Py_DECREF(elements);
+    Py_DECREF(evicted);
+    return PyLong_FromSsize_t(count);
+}
+
+static PyObject*
+queue_push_many(queue* self, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"elements", "partial", NULL};
+    PyObject* elements_ob;
+    int partial = 0;
+    PyObject* elements;
+    PyObject** items;
+    Py_ssize_t count;
+    Py_ssize_t dropped = 0;
+    Py_ssize_t n;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O|p:push_many",
+                                     keywords,
+                                     &elements_ob,
+                                     &partial)) {
+        return NULL;
+    }
+
+    /* `PySequence_Fast` returns lists and tuples unchanged and only copies
+       other iterables into a list. This gives us a plain array of references
+       to copy from. Indexing the elements may run code which could resize a
+       list, so an indexed queue copies lists into a tuple too. */
+    if (!(elements = self->q_index ?
+          PySequence_Tuple(elements_ob) :
+          PySequence_Fast(elements_ob,
+                          "push_many() argument must be iterable"))) {
+        return NULL;
+    }
+
+    items = PySequence_Fast_ITEMS(elements);
+    count = PySequence_Fast_GET_SIZE(elements);
+
+    /* one capacity check for the whole batch */
+    if (self->q_maxsize > 0 && count > self->q_maxsize - self->q_size) {
+        if (self->q_overflow == QUEUE_OVERFLOW_OVERWRITE_OLDEST) {
+            return queue_push_many_overwrite(self, elements);
+        }
+        if (!partial && self->q_overflow == QUEUE_OVERFLOW_RAISE) {
+            Py_DECREF(elements);
+            QUEUE_STATS_FULL(self);
+            PyErr_SetString(queue_full_error, "full");
+            return NULL;
+        }
+        if (self->q_overflow == QUEUE_OVERFLOW_DROP_NEWEST) {
+            dropped = count - (self->q_maxsize - self->q_size);
+        }
+        count = self->q_maxsize - self->q_size;
+    }
+
+    if (self->q_index && queue_index_add_many(self, items, count)) {
+        Py_DECREF(elements);
+        return NULL;
+    }
+
+    /* one resize for the whole batch */
+    if (self->q_size + count > self->q_capacity &&
+        queue_resize(self, self->q_size + count)) {
+        if (self->q_index) {
+            for (n = 0; n < count; ++n) {
+                queue_index_discard(self, items[n]);
+            }
+        }
+        Py_DECREF(elements);
+        return NULL;
+    }
+
+    for (n = 0; n < count; ++n) {
+        /* the ring buffer takes a new reference to each element */
+        Py_INCREF(items[n]);
+        QUEUE_SLOT(self, self->q_size + n) = items[n];
+    }
+    QUEUE_STATS_STAMP(self, self->q_size, count);
+    self->q_size += count;
+    self->q_dropped += dropped;
+    ++self->q_version;
+    QUEUE_STATS_PUSHED(self, count);
+    Py_DECREF(elements);
+
+    if (count && self->q_getters) {
+        /* there may be enough elements for more than one blocked `pop` */
+        pthread_mutex_lock(&self->q_mutex);
+        pthread_cond_broadcast(&self->q_not_empty);
+        pthread_mutex_unlock(&self->q_mutex);
+    }
+    queue_async_notify(self);
+
+    return PyLong_FromSsize_t(count);
+}
+
+PyDoc_STRVAR(queue_pop_many_doc,
+             "Remove and return up to ``n`` elements from the front of the\n"
+             "queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "n : int, optional\n"
+             "    The most elements to pop. Defaults to every element.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "elements : list\n"
+             "    The popped elements in queue order. This may be shorter than\n"
+             "    ``n`` or empty.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "This never blocks.\n");
+
+static PyObject*
+queue_pop_many(queue* self, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"n", NULL};
+    Py_ssize_t count = -1;
+    PyObject* elements;
+    Py_ssize_t n;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|n:pop_many",
+                                     keywords,
+                                     &count)) {
+        return NULL;
+    }
+
+    if (count < 0 || count > self->q_size) {
+        count = self->q_size;
+    }
+
+    if (!(elements = PyList_New(count))) {
+        return NULL;
+    }
+
+    for (n = 0; n < count; ++n) {
+        /* `PyList_SET_ITEM` steals the reference owned by the ring buffer so
+           no reference counts change */
+        PyList_SET_ITEM(elements, n, QUEUE_SLOT(self, n));
+    }
+    if (count) {
+        QUEUE_STATS_RESIDENCY(self, count);
+        self->q_head = (self->q_head + count) & (self->q_capacity - 1);
+        self->q_size -= count;
+        ++self->q_version;
+        QUEUE_STATS_POPPED(self, count);
+        queue_shrink(self);
+    }
+
+    if (count && self->q_putters) {
+        /* there may be enough space for more than one blocked `push` */
+        pthread_mutex_lock(&self->q_mutex);
+        pthread_cond_broadcast(&self->q_not_full);
+        pthread_mutex_unlock(&self->q_mutex);
+    }
+    queue_async_notify(self);
+
+    if (self->q_index) {
+        for (n = 0; n < count; ++n) {
+            queue_index_discard(self, PyList_GET_ITEM(elements, n));
+        }
+    }
+    return elements;
+}
+
+PyDoc_STRVAR(queue_rotate_doc,
+             "Rotate the members of the queue ``steps`` steps to the right.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "steps : int\n"
+             "    The number of steps to rotate the queue.\n");
+
+static PyObject*
+queue_rotate(queue* self,
+             PyObject* const* args,
+             Py_ssize_t nargs,
+             PyObject* kwnames)
+{
+    static const char* const keywords[] = {"steps", NULL};
+
+    PyObject* steps_ob;
+    Py_ssize_t steps;
+    Py_ssize_t current_size;
+    Py_ssize_t mask;
+
+    if (nargs == 1 && !kwnames) {
+        /* fast path for the common `q.rotate(steps)` */
+        steps_ob = args[0];
+    }
+    else if (queue_unpack_args("rotate",
+                               args,
+                               nargs,
+                               kwnames,
+                               keywords,
+                               1,
+                               &steps_ob)) {
+        /* argument parsing failed */
+        return NULL;
+    }
+
+    /* convert with `__index__` like the "n" format code does */
+    steps = PyNumber_AsSsize_t(steps_ob, PyExc_OverflowError);
+    if (steps == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+
+    current_size = self->q_size;
+
+    if (!current_size) {
+        /* the queue is empty, rotating is the identity */
+        Py_RETURN_NONE;
+    }
+
+    /* c modulo of -1 % n == -1 for n > 1. rotating left by n is the same as
+       rotating right by size - n so we add the current size to a negative
+       remainder */
+    steps %= current_size;
+    if (steps < 0) {
+        steps += current_size;
+    }
+    if (!steps) {
+        Py_RETURN_NONE;
+    }
+    ++self->q_version;
+
+    mask = self->q_capacity - 1;
+
+    if (current_size == self->q_capacity) {
+        /* The ring is full so there is no gap between the tail and the head.
+           Rotating right is just moving the head back by `steps`. */
+        self->q_head = (self->q_head - steps) & mask;
+    }
+    else if (steps <= current_size - steps) {
+        /* Move the last `steps` elements, one at a time, into the free slots
+           in front of the head. After the head moves back by one, the old
+           tail is at `q_head + current_size`. */
+        while (steps--) {
+            self->q_head = (self->q_head - 1) & mask;
+            self->q_slots[self->q_head] =
+                self->q_slots[(self->q_head + current_size) & mask];
+            QUEUE_STATS_MOVE_STAMP(self,
+                                   self->q_head,
+                                   (self->q_head + current_size) & mask);
+        }
+    }
+    else {
+        /* Rotating right by `steps` is rotating left by
+           `current_size - steps`, which is the shorter distance here. Move the
+           first elements, one at a time, into the free slots after the
+           tail. */
+        steps = current_size - steps;
+        while (steps--) {
+            self->q_slots[(self->q_head + current_size) & mask] =
+                self->q_slots[self->q_head];
+            QUEUE_STATS_MOVE_STAMP(self,
+                                   (self->q_head + current_size) & mask,
+                                   self->q_head);
+            self->q_head = (self->q_head + 1) & mask;
+        }
+    }
+
+    /* The elements were only moved between slots in the ring. We still own
+       exactly one reference to each of them so no reference counts change and
+       nothing was allocated. */
+    Py_RETURN_NONE;
+}
+
+/* `iter(q)` returns a `queue_iterator`, which walks the ring by index. Like a
+   `collections.deque` iterator it stops with a `RuntimeError` if the queue
+   changes under it, which it detects by comparing the queue's `q_version`
+   with the one it saw when it was created. */
+typedef struct {
+    PyObject qi_base;           /* storage for our type and reference count */
+    queue* qi_queue;            /* the queue, or NULL once exhausted */
+    Py_ssize_t qi_index;        /* the logical index of the next element */
+    size_t qi_version;          /* `q_version` when the iterator was made */
+} queue_iterator;
+
+/* `q.drain()` returns a `queue_drainer`, which pops an element on every step
+   until the queue is empty. */
+typedef struct {
+    PyObject qd_base;           /* storage for our type and reference count */
+    queue* qd_queue;            /* the queue, or NULL once exhausted */
+} queue_drainer;
+
+static PyTypeObject queue_iterator_type;
+static PyTypeObject queue_drain_type;
+
+static PyObject*
+queue_iter(queue* self)
+{
+    queue_iterator* it;
+
+    if (!(it = PyObject_GC_New(queue_iterator, &queue_iterator_type))) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    it->qi_queue = self;
+    it->qi_index = 0;
+    it->qi_version = self->q_version;
+    PyObject_GC_Track(it);
+    return (PyObject*) it;
+}
+
+static void
+queue_iterator_dealloc(queue_iterator* it)
+{
+    PyObject_GC_UnTrack(it);
+    Py_XDECREF(it->qi_queue);
+    PyObject_GC_Del(it);
+}
+
+static int
+queue_iterator_traverse(queue_iterator* it, visitproc visit, void* arg)
+{
+    Py_VISIT(it->qi_queue);
+    return 0;
+}
+
+/* Take the next element for `it` from `self`, its queue. This is split out
+   so that it runs in a critical section on the queue, not the iterator. */
+static PyObject*
+queue_iterator_step(queue* self, queue_iterator* it)
+{
+    PyObject* element;
+
+    if (it->qi_version != self->q_version) {
+        /* keep raising on later calls, like a deque iterator */
+        it->qi_index = self->q_size;
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Queue mutated during iteration");
+        return NULL;
+    }
+
+    if (it->qi_index >= self->q_size) {
+        /* exhausted; return NULL without an exception to stop */
+        return NULL;
+    }
+
+    element = QUEUE_SLOT(self, it->qi_index);
+    ++it->qi_index;
+    Py_INCREF(element);
+    return element;
+}
+
+QUEUE_DEFINE_LOCKED(queue_iterator_step, PyObject*,
+                    (queue* self, queue_iterator* it),
+                    (self, it))
+
+static PyObject*
+queue_iterator_next(queue_iterator* it)
+{
+    queue* self = it->qi_queue;
+    PyObject* element;
+
+    if (!self) {
+        return NULL;
+    }
+
+    if (!(element = QUEUE_LOCKED(queue_iterator_step)(self, it)) &&
+        !PyErr_Occurred()) {
+        /* drop our reference to the queue as soon as we are done with it */
+        it->qi_queue = NULL;
+        Py_DECREF(self);
+    }
+    return element;
+}
+
+static PyObject*
+queue_iterator_length_hint(queue_iterator* it, PyObject* unused)
+{
+    Py_ssize_t remaining = 0;
+
+    if (it->qi_queue && it->qi_version == it->qi_queue->q_version) {
+        remaining = it->qi_queue->q_size - it->qi_index;
+    }
+    return PyLong_FromSsize_t(remaining);
+}
+
+PyMethodDef queue_iterator_methods[] = {
+    {"__length_hint__",
+     (PyCFunction) queue_iterator_length_hint,
+     METH_NOARGS,
+     NULL},
+    {NULL},
+};
+
+static PyTypeObject queue_iterator_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.QueueIterator",                      /* tp_name */
+    sizeof(queue_iterator),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) queue_iterator_dealloc,        /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc) queue_iterator_traverse,     /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc) queue_iterator_next,         /* tp_iternext */
+    queue_iterator_methods,                     /* tp_methods */
+};
+
+static PyObject*
+queue_drain_step(queue* self, queue_drainer* it)
+{
+    if (!self->q_size) {
+        return NULL;
+    }
+
+    return queue_take(self);
+}
+
+QUEUE_DEFINE_LOCKED(queue_drain_step, PyObject*,
+                    (queue* self, queue_drainer* it),
+                    (self, it))
+
+static PyObject*
+queue_drain_next(queue_drainer* it)
+{
+    queue* self = it->qd_queue;
+    PyObject* element;
+
+    if (!self) {
+        return NULL;
+    }
+
+    if (!(element = QUEUE_LOCKED(queue_drain_step)(self, it))) {
+        it->qd_queue = NULL;
+        Py_DECREF(self);
+    }
+    return element;
+}
+
+static void
+queue_drain_dealloc(queue_drainer* it)
+{
+    PyObject_GC_UnTrack(it);
+    Py_XDECREF(it->qd_queue);
+    PyObject_GC_Del(it);
+}
+
+static int
+queue_drain_traverse(queue_drainer* it, visitproc visit, void* arg)
+{
+    Py_VISIT(it->qd_queue);
+    return 0;
+}
+
+static PyTypeObject queue_drain_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.QueueDrain",                         /* tp_name */
+    sizeof(queue_drainer),                      /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) queue_drain_dealloc,           /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc) queue_drain_traverse,        /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc) queue_drain_next,            /* tp_iternext */
+};
+
+PyDoc_STRVAR(queue_drain_doc,
+             "Return an iterator which pops elements until the queue is\n"
+             "empty.\n"
+             "\n"
+             "Each step is an O(1) non-blocking pop. Elements pushed while\n"
+             "draining are also drained. The ring's storage shrinks as the\n"
+             "queue empties and is freed once it is empty.\n");
+
+static PyObject*
+queue_drain(queue* self, PyObject* unused)
+{
+    queue_drainer* it;
+
+    if (!(it = PyObject_GC_New(queue_drainer, &queue_drain_type))) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    it->qd_queue = self;
+    PyObject_GC_Track(it);
+    return (PyObject*) it;
+}
+
+PyDoc_STRVAR(queue_sizeof_doc,
+             "Return the size of the queue in memory, in bytes.\n"
+             "\n"
+             "This counts the ring buffer's slots but not the elements,\n"
+             "which may be shared with other objects.\n");
+
+static PyObject*
+queue_sizeof(queue* self, PyObject* unused)
+{
+    Py_ssize_t size = Py_TYPE(self)->tp_basicsize +
+        Py_SIZE(self) * Py_TYPE(self)->tp_itemsize;
+
+    if (self->q_slots && self->q_slots != self->q_inline) {
+        size += self->q_capacity * (Py_ssize_t) sizeof(PyObject*);
+    }
+#ifdef QUEUE_STATS
+    if (self->q_residency) {
+        size += QUEUE_RESIDENCY_BUCKETS * (Py_ssize_t) sizeof(Py_ssize_t);
+    }
+    if (self->q_stamps) {
+        size += self->q_capacity * (Py_ssize_t) sizeof(int64_t);
+    }
+#endif
+
+    return PyLong_FromSsize_t(size);
+}
+
+#ifdef QUEUE_STATS
+/* A copy of a queue's statistics. Reading them runs no Python code, so
+   `all_stats` can copy every queue while the registry can't change. */
+typedef struct {
+    void* st_id;
+    Py_ssize_t st_size;
+    Py_ssize_t st_maxsize;
+    Py_ssize_t st_dropped;
+    Py_ssize_t st_pushes;
+    Py_ssize_t st_pops;
+    Py_ssize_t st_full;
+    Py_ssize_t st_empty;
+    Py_ssize_t st_high_water;
+    int st_has_residency;
+    Py_ssize_t st_residency[QUEUE_RESIDENCY_BUCKETS];
+} queue_stats;
+
+/* Copy the statistics of `self` into `out`, then optionally start counting
+   again from now. Always returns 0. */
+static int
+queue_stats_read(queue* self, queue_stats* out, int reset)
+{
+    out->st_id = self;
+    out->st_size = self->q_size;
+    out->st_maxsize = self->q_maxsize;
+    out->st_dropped = self->q_dropped;
+    out->st_pushes = self->q_pushes;
+    out->st_pops = self->q_pops;
+    out->st_full = self->q_full;
+    out->st_empty = self->q_empty;
+    out->st_high_water = self->q_high_water;
+    if ((out->st_has_residency = self->q_residency != NULL)) {
+        memcpy(out->st_residency,
+               self->q_residency,
+               sizeof(out->st_residency));
+    }
+
+    if (reset) {
+        self->q_pushes = 0;
+        self->q_pops = 0;
+        self->q_full = 0;
+        self->q_empty = 0;
+        self->q_high_water = self->q_size;
+        if (self->q_residency) {
+            memset(self->q_residency,
+                   0,
+                   QUEUE_RESIDENCY_BUCKETS * sizeof(Py_ssize_t));
+        }
+    }
+    return 0;
+}
+
+QUEUE_DEFINE_LOCKED(queue_stats_read, int,
+                    (queue* self, queue_stats* out, int reset),
+                    (self, out, reset))
+
+/* Build the dict returned by `stats` from a copy of the statistics. */
+static PyObject*
+queue_stats_dict(const queue_stats* st)
+{
+    PyObject* residency;
+    PyObject* count;
+    int n;
+
+    if (!st->st_has_residency) {
+        Py_INCREF(Py_None);
+        residency = Py_None;
+    }
+    else {
+        if (!(residency = PyList_New(QUEUE_RESIDENCY_BUCKETS))) {
+            return NULL;
+        }
+        for (n = 0; n < QUEUE_RESIDENCY_BUCKETS; ++n) {
+            if (!(count = PyLong_FromSsize_t(st->st_residency[n]))) {
+                Py_DECREF(residency);
+                return NULL;
+            }
+            PyList_SET_ITEM(residency, n, count);
+        }
+    }
+
+    return Py_BuildValue("{s:N,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:N}",
+                         "id", PyLong_FromVoidPtr(st->st_id),
+                         "size", st->st_size,
+                         "maxsize", st->st_maxsize,
+                         "pushes", st->st_pushes,
+                         "pops", st->st_pops,
+                         "full", st->st_full,
+                         "empty", st->st_empty,
+                         "dropped", st->st_dropped,
+                         "high_water", st->st_high_water,
+                         "residency", residency);
+}
+
+PyDoc_STRVAR(queue_stats_doc,
+             "Return the queue's statistics.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "reset : bool, optional\n"
+             "    Start counting again after reading. ``high_water`` restarts\n"
+             "    from the current size. ``dropped`` has its own setter and\n"
+             "    is left alone. Defaults to False.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "stats : dict\n"
+             "    ``id`` is ``id(queue)``. ``size``, ``maxsize`` and\n"
+             "    ``dropped`` are the current values. ``pushes`` and ``pops``\n"
+             "    count elements by any kind of push or pop, and ``full`` and\n"
+             "    ``empty`` count calls which raised ``Full`` or ``Empty``.\n"
+             "    ``high_water`` is the largest size reached. ``residency``\n"
+             "    is None unless the queue was created with\n"
+             "    ``residency=True``; then it is a list of 32 counts of\n"
+             "    popped elements by how long they were queued: under 1us,\n"
+             "    then ``[2 ** (b - 1), 2 ** b)`` microseconds in bucket\n"
+             "    ``b``, with the last bucket counting anything longer too.\n");
+
+static PyObject*
+queue_stats_method(queue* self, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"reset", NULL};
+    int reset = 0;
+    queue_stats st;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|p:stats",
+                                     keywords,
+                                     &reset)) {
+        return NULL;
+    }
+
+    QUEUE_LOCKED(queue_stats_read)(self, &st, reset);
+    return queue_stats_dict(&st);
+}
+
+PyDoc_STRVAR(queue_all_stats_doc,
+             "Return the statistics of every live ``Queue``.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "stats : list[dict]\n"
+             "    One ``Queue.stats()`` dict per queue, in no particular\n"
+             "    order. Match them to queues with their ``id``.\n");
+
+static PyObject*
+queue_all_stats(PyObject* module, PyObject* unused)
+{
+    queue_stats* stats;
+    Py_ssize_t count = 0;
+    queue* q;
+    PyObject* result;
+    PyObject* item;
+    Py_ssize_t n;
+
+    /* Copy everything out first. Building the dicts could run the cyclic gc,
+       which could destroy a queue and change the registry under us. */
+    QUEUE_REGISTRY_LOCK();
+    for (q = queue_registry; q; q = q->q_registry_next) {
+        ++count;
+    }
+    if (!(stats = PyMem_New(queue_stats, count ? count : 1))) {
+        QUEUE_REGISTRY_UNLOCK();
+        return PyErr_NoMemory();
+    }
+    for (q = queue_registry, n = 0; q; q = q->q_registry_next, ++n) {
+        QUEUE_LOCKED(queue_stats_read)(q, &stats[n], 0);
+    }
+    QUEUE_REGISTRY_UNLOCK();
+
+    if (!(result = PyList_New(count))) {
+        PyMem_Free(stats);
+        return NULL;
+    }
+    for (n = 0; n < count; ++n) {
+        if (!(item = queue_stats_dict(&stats[n]))) {
+            Py_DECREF(result);
+            PyMem_Free(stats);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, n, item);
+    }
+    PyMem_Free(stats);
+    return result;
+}
+#endif
+
+/* `asyncio.get_running_loop`, imported the first time a task has to wait */
+static PyObject* queue_get_running_loop;
+
+/* Create a future on the running event loop for an awaitable to wait on.
+   The loop is stored in `*loop` so that a waker on another thread can hand
+   the future back to it. */
+static PyObject*
+queue_create_future(PyObject** loop)
+{
+    PyObject* get_running_loop;
+    PyObject* future;
+
+    if (!(get_running_loop = queue_import("asyncio",
+                                          "get_running_loop",
+                                          &queue_get_running_loop))) {
+        return NULL;
+    }
+
+    if (!(*loop = PyObject_CallObject(get_running_loop, NULL))) {
+        return NULL;
+    }
+    if (!(future = PyObject_CallMethod(*loop, "create_future", NULL))) {
+        Py_CLEAR(*loop);
+    }
+    return future;
+}
+
+/* Run one step of `aw`, an awaitable for an operation on `self`. When the
+   operation completes this stores its result in `*result` and returns 1.
+   When it has to wait this parks `aw`, stores a future for the task to wait
+   on in `*result` and returns 0. On error it returns -1. */
+static int
+queue_awaitable_step(queue* self, queue_awaitable* aw, PyObject** result)
+{
+    queue_waitlist* list = aw->aw_push ?
+        &self->q_async_putters :
+        &self->q_async_getters;
+    int woken = 0;
+    PyObject* future;
+    PyObject* loop;
+
+    switch (aw->aw_state) {
+    case QUEUE_AWAITABLE_NEW:
+        break;
+    case QUEUE_AWAITABLE_WOKEN:
+        /* the element or space we were woken for is ours to take */
+        --list->wl_woken;
+        aw->aw_state = QUEUE_AWAITABLE_NEW;
+        woken = 1;
+        break;
+    case QUEUE_AWAITABLE_PARKED:
+        PyErr_SetString(PyExc_RuntimeError, "await wasn't used with future");
+        return -1;
+    case QUEUE_AWAITABLE_DONE:
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot reuse already awaited queue operation");
+        return -1;
+    }
+
+    if (aw->aw_push && self->q_maxsize > 0 &&
+        self->q_size >= self->q_maxsize &&
+        self->q_overflow != QUEUE_OVERFLOW_RAISE) {
+        /* the other overflow policies never wait */
+        if (!(*result = queue_push_overflow(self, aw->aw_element))) {
+            return -1;
+        }
+        Py_CLEAR(aw->aw_element);
+        aw->aw_state = QUEUE_AWAITABLE_DONE;
+        return 1;
+    }
+
+    /* This is the fast path: with nobody waiting, a push with room or a pop
+       with an element finishes right here without creating a future. A new
+       awaitable never overtakes parked ones, and leaves the elements or space
+       promised to woken ones alone. */
+    if (woken || !list->wl_first) {
+        if (aw->aw_push) {
+            if (self->q_maxsize <= 0 ||
+                self->q_size + list->wl_woken < self->q_maxsize) {
+                if (queue_put(self, aw->aw_element)) {
+                    return -1;
+                }
+                Py_CLEAR(aw->aw_element);
+                aw->aw_state = QUEUE_AWAITABLE_DONE;
+                Py_INCREF(Py_None);
+                *result = Py_None;
+                return 1;
+            }
+        }
+        else if (self->q_size > list->wl_woken) {
+            aw->aw_state = QUEUE_AWAITABLE_DONE;
+            *result = queue_take(self);
+            return 1;
+        }
+    }
+
+    /* Wait in line. An awaitable which was woken up but lost its element or
+       space to a synchronous `pop` or `push` goes back to the front. The
+       `_asyncio_future_blocking` flag tells the task that we yielded a
+       future to wait on, exactly like `await future` would. */
+    if (!(future = queue_create_future(&loop))) {
+        return -1;
+    }
+    if (PyObject_SetAttrString(future, "_asyncio_future_blocking", Py_True)) {
+        Py_DECREF(future);
+        Py_DECREF(loop);
+        return -1;
+    }
+    aw->aw_future = future;
+    aw->aw_loop = loop;
+    queue_waitlist_park(list, aw, woken);
+
+    Py_INCREF(future);
+    *result = future;
+    return 0;
+}
+
+/* Take `aw` out of the queue's bookkeeping when it dies. A woken awaitable
+   passes the element or space it was woken for to the next one in line. */
+static int
+queue_awaitable_forget(queue* self, queue_awaitable* aw)
+{
+    queue_waitlist* list = aw->aw_push ?
+        &self->q_async_putters :
+        &self->q_async_getters;
+
+    if (aw->aw_state == QUEUE_AWAITABLE_PARKED) {
+        queue_waitlist_unpark(list, aw);
+    }
+    else if (aw->aw_state == QUEUE_AWAITABLE_WOKEN) {
+        --list->wl_woken;
+        aw->aw_state = QUEUE_AWAITABLE_NEW;
+        queue_async_notify(self);
+    }
+    return 0;
+}
+
+QUEUE_DEFINE_LOCKED(queue_awaitable_step, int,
+                    (queue* self, queue_awaitable* aw, PyObject** out),
+                    (self, aw, out))
+QUEUE_DEFINE_LOCKED(queue_awaitable_forget, int,
+                    (queue* self, queue_awaitable* aw),
+                    (self, aw))
+
+static PyObject*
+queue_awaitable_await(queue_awaitable* aw)
+{
+    /* the awaitable is its own iterator */
+    Py_INCREF(aw);
+    return (PyObject*) aw;
+}
+
+#if PY_VERSION_HEX >= 0x030A0000
+/* `am_send` lets `await` get the result without raising `StopIteration`.
+   The value sent in by the task is always `None` and is ignored. */
+static PySendResult
+queue_awaitable_send(queue_awaitable* aw, PyObject* arg, PyObject** result)
+{
+    switch (QUEUE_LOCKED(queue_awaitable_step)(aw->aw_queue, aw, result)) {
+    case 1:
+        return PYGEN_RETURN;
+    case 0:
+        return PYGEN_NEXT;
+    default:
+        *result = NULL;
+        return PYGEN_ERROR;
+    }
+}
+#endif
+
+static PyObject*
+queue_awaitable_next(queue_awaitable* aw)
+{
+    PyObject* result;
+    PyObject* stop;
+    int status;
+
+    if ((status = QUEUE_LOCKED(queue_awaitable_step)(aw->aw_queue,
+                                                      aw,
+                                                      &result)) <= 0) {
+        /* the future to yield, or NULL on error */
+        return status ? NULL : result;
+    }
+
+    /* Finish with `StopIteration(result)`. Returning NULL without an
+       exception means `StopIteration(None)`. The exception is created here
+       because `PyErr_SetObject` would unpack a tuple `result`. */
+    if (result != Py_None) {
+        if ((stop = PyObject_CallFunctionObjArgs(PyExc_StopIteration,
+                                                 result,
+                                                 NULL))) {
+            PyErr_SetObject(PyExc_StopIteration, stop);
+            Py_DECREF(stop);
+        }
+    }
+    Py_DECREF(result);
+    return NULL;
+}
+
+static PyObject*
+queue_awaitable_send_method(queue_awaitable* aw, PyObject* value)
+{
+    /* the value is ignored like in `am_send` */
+    return queue_awaitable_next(aw);
+}
+
+/* Give up waiting, like a generator which doesn't catch an exception thrown
+   into it. This is how a cancelled task leaves the line right away, while its
+   traceback may keep this awaitable alive for much longer. */
+static void
+queue_awaitable_abandon(queue_awaitable* aw)
+{
+    QUEUE_LOCKED(queue_awaitable_forget)(aw->aw_queue, aw);
+    aw->aw_state = QUEUE_AWAITABLE_DONE;
+    Py_CLEAR(aw->aw_future);
+    Py_CLEAR(aw->aw_loop);
+    Py_CLEAR(aw->aw_element);
+}
+
+static PyObject*
+queue_awaitable_throw(queue_awaitable* aw,
+                      PyObject* const* args,
+                      Py_ssize_t nargs)
+{
+    PyObject* type;
+    PyObject* value = NULL;
+
+    if (nargs < 1 || nargs > 3) {
+        PyErr_Format(PyExc_TypeError,
+                     "throw expected 1 to 3 arguments, got %zd",
+                     nargs);
+        return NULL;
+    }
+    type = args[0];
+    if (nargs > 1 && args[1] != Py_None) {
+        value = args[1];
+    }
+
+    queue_awaitable_abandon(aw);
+
+    if (PyExceptionInstance_Check(type)) {
+        PyErr_SetObject((PyObject*) Py_TYPE(type), type);
+    }
+    else if (PyExceptionClass_Check(type)) {
+        PyErr_SetObject(type, value);
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError,
+                        "exceptions must be classes or instances deriving "
+                        "from BaseException");
+    }
+    return NULL;
+}
+
+static PyObject*
+queue_awaitable_close(queue_awaitable* aw, PyObject* unused)
+{
+    queue_awaitable_abandon(aw);
+    Py_RETURN_NONE;
+}
+
+/* `send`, `throw` and `close` make the awaitable behave like the iterator of
+   a coroutine when it is cancelled or closed. */
+PyMethodDef queue_awaitable_methods[] = {
+    {"send",
+     (PyCFunction) queue_awaitable_send_method,
+     METH_O,
+     NULL},
+    {"throw",
+     (PyCFunction) (void (*)(void)) queue_awaitable_throw,
+     METH_FASTCALL,
+     NULL},
+    {"close",
+     (PyCFunction) queue_awaitable_close,
+     METH_NOARGS,
+     NULL},
+    {NULL},
+};
+
+static void
+queue_awaitable_dealloc(queue_awaitable* aw)
+{
+    PyObject_GC_UnTrack(aw);
+    QUEUE_LOCKED(queue_awaitable_forget)(aw->aw_queue, aw);
+    Py_XDECREF(aw->aw_future);
+    Py_XDECREF(aw->aw_loop);
+    Py_XDECREF(aw->aw_element);
+    Py_DECREF(aw->aw_queue);
+
+#ifdef QUEUE_USE_FREELISTS
+    if (queue_awaitable_freelist_size < QUEUE_FREELIST_SIZE) {
+        queue_awaitable_freelist[queue_awaitable_freelist_size++] = aw;
+        return;
+    }
+#endif
+
+    PyObject_GC_Del(aw);
+}
+
+static int
+queue_awaitable_traverse(queue_awaitable* aw, visitproc visit, void* arg)
+{
+    Py_VISIT(aw->aw_queue);
+    Py_VISIT(aw->aw_element);
+    Py_VISIT(aw->aw_future);
+    Py_VISIT(aw->aw_loop);
+    return 0;
+}
+
+static PyAsyncMethods queue_awaitable_as_async = {
+    (unaryfunc) queue_awaitable_await,          /* am_await */
+    0,                                          /* am_aiter */
+    0,                                          /* am_anext */
+#if PY_VERSION_HEX >= 0x030A0000
+    (sendfunc) queue_awaitable_send,            /* am_send */
+#endif
+};
+
+static PyTypeObject queue_awaitable_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.QueueAwaitable",                     /* tp_name */
+    sizeof(queue_awaitable),                    /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) queue_awaitable_dealloc,       /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    &queue_awaitable_as_async,                  /* tp_as_async */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc) queue_awaitable_traverse,    /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc) queue_awaitable_next,        /* tp_iternext */
+    queue_awaitable_methods,                    /* tp_methods */
+};
+
+/* Create an awaitable for `async_push(element)`, or `async_pop()` when
+   `element` is NULL. */
+static PyObject*
+queue_awaitable_new(queue* self, PyObject* element)
+{
+    queue_awaitable* aw;
+
+#ifdef QUEUE_USE_FREELISTS
+    if (queue_awaitable_freelist_size) {
+        aw = queue_awaitable_freelist[--queue_awaitable_freelist_size];
+        PyObject_Init((PyObject*) aw, &queue_awaitable_type);
+    }
+    else
+#endif
+    if (!(aw = PyObject_GC_New(queue_awaitable, &queue_awaitable_type))) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    aw->aw_queue = self;
+    Py_XINCREF(element);
+    aw->aw_element = element;
+    aw->aw_future = NULL;
+    aw->aw_loop = NULL;
+    aw->aw_push = element != NULL;
+    aw->aw_state = QUEUE_AWAITABLE_NEW;
+    aw->aw_prev = aw->aw_next = NULL;
+    PyObject_GC_Track(aw);
+    return (PyObject*) aw;
+}
+
+PyDoc_STRVAR(queue_async_push_doc,
+             "Push an element onto the end of the queue from a coroutine.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "element : any\n"
+             "    The element to push.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "awaitable : awaitable\n"
+             "    Await this to push ``element``, waiting for space if the\n"
+             "    queue is full.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "When the queue has room this completes without suspending or\n"
+             "creating a future. Otherwise the task waits in line with the\n"
+             "other tasks in ``async_push``, in order. Cancelling the task\n"
+             "gives up its place. With an overflow policy other than\n"
+             "'raise' this never waits.\n");
+
+static PyObject*
+queue_async_push(queue* self, PyObject* element)
+{
+    return queue_awaitable_new(self, element);
+}
+
+PyDoc_STRVAR(queue_async_pop_doc,
+             "Remove and return the element at the front of the queue from\n"
+             "a coroutine.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "awaitable : awaitable\n"
+             "    Await this for the element, waiting for one if the queue\n"
+             "    is empty.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "When the queue has an element this completes without\n"
+             "suspending or creating a future. Otherwise the task waits in\n"
+             "line with the other tasks in ``async_pop``, in order.\n"
+             "Cancelling the task gives up its place.\n");
+
+static PyObject*
+queue_async_pop(queue* self, PyObject* unused)
+{
+    return queue_awaitable_new(self, NULL);
+}
+
+/* A snapshot starts with `QUEUE_SNAPSHOT_MAGIC`, a version byte and the
+   overflow policy byte, with `QUEUE_SNAPSHOT_INDEXED` set for a queue created
+   with `index=True`, followed by varints for `maxsize + 1`, `dropped` and
+   the number of elements. Each element is a tag byte and a payload:
+
+   - None, False and True have no payload.
+   - An int which fits in 64 bits is a zigzag varint.
+   - A float is its IEEE 754 bits, 8 bytes little-endian.
+   - bytes and str are a varint length and the raw or UTF-8 bytes. Lone
+     surrogates are encoded like the "surrogatepass" error handler does.
+   - Anything else, including subclasses of those types, is pickled with
+     protocol 5. A run of such elements is pickled together as one list: a
+     varint count of elements, a varint length and the pickle, then a varint
+     count of out-of-band buffers, each a varint length and the raw bytes.
+
+   Varints are unsigned LEB128, 7 bits per byte with the low bits first. */
+#define QUEUE_SNAPSHOT_MAGIC "PyQs"
+#define QUEUE_SNAPSHOT_VERSION 1
+#define QUEUE_SNAPSHOT_INDEXED 0x80
+
+typedef enum {
+    QUEUE_SNAPSHOT_NONE = 'n',
+    QUEUE_SNAPSHOT_FALSE = 'F',
+    QUEUE_SNAPSHOT_TRUE = 'T',
+    QUEUE_SNAPSHOT_INT = 'i',
+    QUEUE_SNAPSHOT_FLOAT = 'f',
+    QUEUE_SNAPSHOT_BYTES = 'b',
+    QUEUE_SNAPSHOT_STR = 's',
+    QUEUE_SNAPSHOT_PICKLE = 'p',
+} queue_snapshot_tag;
+
+/* `pickle.dumps` and `pickle.loads`, imported the first time an element
+   needs them */
+static PyObject* queue_pickle_dumps;
+static PyObject* queue_pickle_loads;
+
+/* A snapshot being written. The bytes object grows geometrically and is
+   trimmed to `sw_size` at the end, so it can be returned or written to a
+   file without another copy. */
+typedef struct {
+    PyObject* sw_bytes;
+    Py_ssize_t sw_size;
+} snapshot_writer;
+
+/* Make room for `n` more bytes and return a pointer to them. */
+static char*
+snapshot_reserve(snapshot_writer* w, Py_ssize_t n)
+{
+    Py_ssize_t capacity = PyBytes_GET_SIZE(w->sw_bytes);
+
+    if (n > PY_SSIZE_T_MAX - w->sw_size) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (w->sw_size + n > capacity) {
+        capacity = (capacity > PY_SSIZE_T_MAX / 2) ?
+            PY_SSIZE_T_MAX :
+            capacity * 2;
+        if (capacity < w->sw_size + n) {
+            capacity = w->sw_size + n;
+        }
+        if (_PyBytes_Resize(&w->sw_bytes, capacity)) {
+            return NULL;
+        }
+    }
+    return PyBytes_AS_STRING(w->sw_bytes) + w->sw_size;
+}
+
+static int
+snapshot_write(snapshot_writer* w, const void* data, Py_ssize_t n)
+{
+    char* out;
+
+    if (!(out = snapshot_reserve(w, n))) {
+        return -1;
+    }
+    memcpy(out, data, n);
+    w->sw_size += n;
+    return 0;
+}
+
+static int
+snapshot_write_varint(snapshot_writer* w, uint64_t value)
+{
+    unsigned char buf[10];
+    Py_ssize_t n = 0;
+
+    while (value >= 0x80) {
+        buf[n++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (unsigned char) value;
+    return snapshot_write(w, buf, n);
+}
+
+/* Write a tag byte followed by a varint length and `n` bytes of `data`. */
+static int
+snapshot_write_sized(snapshot_writer* w,
+                     queue_snapshot_tag tag,
+                     const char* data,
+                     Py_ssize_t n)
+{
+    unsigned char tag_byte = tag;
+
+    if (snapshot_write(w, &tag_byte, 1) ||
+        snapshot_write_varint(w, (uint64_t) n) ||
+        snapshot_write(w, data, n)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Pickle the `count` elements at `elements` together as one list with
+   protocol 5 and write them with their out-of-band buffers. */
+static int
+snapshot_write_pickle(snapshot_writer* w,
+                      PyObject* const* elements,
+                      Py_ssize_t count)
+{
+    Py_ssize_t n;
+    PyObject* dumps;
+    PyObject* run;
+    PyObject* buffers = NULL;
+    PyObject* append = NULL;
+    PyObject* args = NULL;
+    PyObject* kwargs = NULL;
+    PyObject* pickled = NULL;
+    Py_buffer view;
+    unsigned char tag = QUEUE_SNAPSHOT_PICKLE;
+    char* out;
+    int status = -1;
+
+    if (!(dumps = queue_import("pickle", "dumps", &queue_pickle_dumps)) ||
+        !(run = PyList_New(count))) {
+        return -1;
+    }
+    for (n = 0; n < count; ++n) {
+        Py_INCREF(elements[n]);
+        PyList_SET_ITEM(run, n, elements[n]);
+    }
+
+    /* `buffer_callback=buffers.append` collects the buffers the pickle
+       refers to instead of copying them into it */
+    if (!(buffers = PyList_New(0)) ||
+        !(append = PyObject_GetAttrString(buffers, "append")) ||
+        !(args = Py_BuildValue("(Oi)", run, 5)) ||
+        !(kwargs = Py_BuildValue("{s:O}", "buffer_callback", append)) ||
+        !(pickled = PyObject_Call(dumps, args, kwargs))) {
+        goto done;
+    }
+    if (!PyBytes_Check(pickled)) {
+        PyErr_SetString(PyExc_TypeError, "pickle.dumps did not return bytes");
+        goto done;
+    }
+
+    if (snapshot_write(w, &tag, 1) ||
+        snapshot_write_varint(w, (uint64_t) count) ||
+        snapshot_write_varint(w, (uint64_t) PyBytes_GET_SIZE(pickled)) ||
+        snapshot_write(w,
+                       PyBytes_AS_STRING(pickled),
+                       PyBytes_GET_SIZE(pickled)) ||
+        snapshot_write_varint(w, (uint64_t) PyList_GET_SIZE(buffers))) {
+        goto done;
+    }
+    for (n = 0; n < PyList_GET_SIZE(buffers); ++n) {
+        if (PyObject_GetBuffer(PyList_GET_ITEM(buffers, n),
+                               &view,
+                               PyBUF_FULL_RO)) {
+            goto done;
+        }
+        if (snapshot_write_varint(w, (uint64_t) view.len) ||
+            !(out = snapshot_reserve(w, view.len)) ||
+            PyBuffer_ToContiguous(out, &view, view.len, 'C')) {
+            PyBuffer_Release(&view);
+            goto done;
+        }
+        w->sw_size += view.len;
+        PyBuffer_Release(&view);
+    }
+    status = 0;
+
+done:
+    Py_XDECREF(pickled);
+    Py_XDECREF(kwargs);
+    Py_XDECREF(args);
+    Py_XDECREF(append);
+    Py_XDECREF(buffers);
+    Py_DECREF(run);
+    return status;
+}
+
+/* Return the tag `element` is written with, or `QUEUE_SNAPSHOT_PICKLE` if it
+   has to be pickled. Only the exact types are written directly; a subclass
+   may carry extra state which only pickle knows how to save. */
+static queue_snapshot_tag
+snapshot_tag(PyObject* element)
+{
+    int overflow;
+
+    if (element == Py_None) {
+        return QUEUE_SNAPSHOT_NONE;
+    }
+    if (element == Py_False) {
+        return QUEUE_SNAPSHOT_FALSE;
+    }
+    if (element == Py_True) {
+        return QUEUE_SNAPSHOT_TRUE;
+    }
+    if (PyLong_CheckExact(element)) {
+        /* this can't fail for an int; larger ints are pickled */
+        (void) PyLong_AsLongLongAndOverflow(element, &overflow);
+        return overflow ? QUEUE_SNAPSHOT_PICKLE : QUEUE_SNAPSHOT_INT;
+    }
+    if (PyFloat_CheckExact(element)) {
+        return QUEUE_SNAPSHOT_FLOAT;
+    }
+    if (PyBytes_CheckExact(element)) {
+        return QUEUE_SNAPSHOT_BYTES;
+    }
+    if (PyUnicode_CheckExact(element)) {
+        return QUEUE_SNAPSHOT_STR;
+    }
+    return QUEUE_SNAPSHOT_PICKLE;
+}
+
+/* Write `element` with `tag` from `snapshot_tag`, which must not be
+   `QUEUE_SNAPSHOT_PICKLE`. */
+static int
+snapshot_write_direct(snapshot_writer* w,
+                      queue_snapshot_tag tag,
+                      PyObject* element)
+{
+    unsigned char buf[9];
+    PyObject* encoded;
+    int status;
+    int n;
+
+    buf[0] = tag;
+    switch (tag) {
+    case QUEUE_SNAPSHOT_INT: {
+        long long value = PyLong_AsLongLong(element);
+
+        /* zigzag maps small negative numbers to small varints */
+        if (snapshot_write(w, buf, 1)) {
+            return -1;
+        }
+        return snapshot_write_varint(
+            w,
+            ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+    }
+    case QUEUE_SNAPSHOT_FLOAT: {
+        double value = PyFloat_AS_DOUBLE(element);
+        uint64_t bits;
+
+        memcpy(&bits, &value, sizeof(bits));
+        for (n = 0; n < 8; ++n) {
+            buf[n + 1] = (unsigned char) (bits >> (8 * n));
+        }
+        return snapshot_write(w, buf, 9);
+    }
+    case QUEUE_SNAPSHOT_BYTES:
+        return snapshot_write_sized(w,
+                                    tag,
+                                    PyBytes_AS_STRING(element),
+                                    PyBytes_GET_SIZE(element));
+    case QUEUE_SNAPSHOT_STR:
+        if (PyUnicode_IS_ASCII(element)) {
+            /* ASCII is already UTF-8 */
+            return snapshot_write_sized(w,
+                                        tag,
+                                        (const char*) PyUnicode_DATA(element),
+                                        PyUnicode_GET_LENGTH(element));
+        }
+        /* Encode into a temporary instead of with `PyUnicode_AsUTF8`, which
+           would keep a UTF-8 copy in every str we save. "surrogatepass"
+           lets lone surrogates through. */
+        if (!(encoded = PyUnicode_AsEncodedString(element,
+                                                  "utf-8",
+                                                  "surrogatepass"))) {
+            return -1;
+        }
+        status = snapshot_write_sized(w,
+                                      tag,
+                                      PyBytes_AS_STRING(encoded),
+                                      PyBytes_GET_SIZE(encoded));
+        Py_DECREF(encoded);
+        return status;
+    default:
+        /* None, False and True are just the tag */
+        return snapshot_write(w, buf, 1);
+    }
+}
+
+/* Write the elements of the tuple `elements`. Runs of elements which have to
+   be pickled are pickled together, which is much smaller and faster than
+   one pickle per element. */
+static int
+snapshot_write_elements(snapshot_writer* w, PyObject* elements)
+{
+    PyObject* const* items = &PyTuple_GET_ITEM(elements, 0);
+    Py_ssize_t size = PyTuple_GET_SIZE(elements);
+    Py_ssize_t run = 0;  /* the first element of the run to pickle */
+    queue_snapshot_tag tag;
+    Py_ssize_t n;
+
+    for (n = 0; n < size; ++n) {
+        if ((tag = snapshot_tag(items[n])) == QUEUE_SNAPSHOT_PICKLE) {
+            continue;
+        }
+        if ((run < n && snapshot_write_pickle(w, items + run, n - run)) ||
+            snapshot_write_direct(w, tag, items[n])) {
+            return -1;
+        }
+        run = n + 1;
+    }
+    if (run < size) {
+        return snapshot_write_pickle(w, items + run, size - run);
+    }
+    return 0;
+}
+
+/* Start a snapshot of `self`: write the header to `w` and return a tuple of
+   the elements. The elements are written from the tuple because pickling one
+   may run code which changes the queue. */
+static PyObject*
+queue_snapshot_begin(queue* self, snapshot_writer* w)
+{
+    unsigned char header[6];
+    PyObject* elements;
+    Py_ssize_t n;
+
+    memcpy(header, QUEUE_SNAPSHOT_MAGIC, 4);
+    header[4] = QUEUE_SNAPSHOT_VERSION;
+    header[5] = (unsigned char) self->q_overflow;
+    if (self->q_index) {
+        header[5] |= QUEUE_SNAPSHOT_INDEXED;
+    }
+    if (snapshot_write(w, header, sizeof(header)) ||
+        snapshot_write_varint(w, (uint64_t) (self->q_maxsize + 1)) ||
+        snapshot_write_varint(w, (uint64_t) self->q_dropped) ||
+        snapshot_write_varint(w, (uint64_t) self->q_size)) {
+        return NULL;
+    }
+
+    if (!(elements = PyTuple_New(self->q_size))) {
+        return NULL;
+    }
+    for (n = 0; n < self->q_size; ++n) {
+        Py_INCREF(QUEUE_SLOT(self, n));
+        PyTuple_SET_ITEM(elements, n, QUEUE_SLOT(self, n));
+    }
+    return elements;
+}
+
+QUEUE_DEFINE_LOCKED(queue_snapshot_begin, PyObject*,
+                    (queue* self, snapshot_writer* w),
+                    (self, w))
+
+/* Write a snapshot of `self` and return it as a bytes object. */
+static PyObject*
+queue_snapshot_bytes(queue* self)
+{
+    snapshot_writer w;
+    PyObject* elements;
+
+    w.sw_size = 0;
+    if (!(w.sw_bytes = PyBytes_FromStringAndSize(NULL, 64))) {
+        return NULL;
+    }
+    if (!(elements = QUEUE_LOCKED(queue_snapshot_begin)(self, &w))) {
+        Py_DECREF(w.sw_bytes);
+        return NULL;
+    }
+    if (snapshot_write_elements(&w, elements)) {
+        Py_DECREF(elements);
+        Py_DECREF(w.sw_bytes);
+        return NULL;
+    }
+    Py_DECREF(elements);
+
+    if (_PyBytes_Resize(&w.sw_bytes, w.sw_size)) {
+        return NULL;
+    }
+    return w.sw_bytes;
+}
+
+PyDoc_STRVAR(queue_snapshot_doc,
+             "Save the queue's elements and settings in a compact binary\n"
+             "format.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "file : file, optional\n"
+             "    A binary file to write the snapshot to. If not given the\n"
+             "    snapshot is returned instead.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "snapshot : bytes or int\n"
+             "    The snapshot, or the number of bytes written to ``file``.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "``None``, ``bool``, ``int``, ``float``, ``bytes`` and ``str``\n"
+             "elements are written directly. Anything else is pickled with\n"
+             "protocol 5, keeping large buffers out of band so ``restore``\n"
+             "doesn't have to copy them. Pickling an element may run code\n"
+             "but the snapshot has the elements the queue had when it\n"
+             "started. The queue is not changed.\n");
+
+static PyObject*
+queue_snapshot(queue* self, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"file", NULL};
+    PyObject* file = Py_None;
+    PyObject* snapshot;
+    PyObject* result;
+    Py_ssize_t size;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|O:snapshot",
+                                     keywords,
+                                     &file)) {
+        return NULL;
+    }
+
+    if (!(snapshot = queue_snapshot_bytes(self)) || file == Py_None) {
+        return snapshot;
+    }
+
+    size = PyBytes_GET_SIZE(snapshot);
+    result = PyObject_CallMethod(file, "write", "O", snapshot);
+    Py_DECREF(snapshot);
+    if (!result) {
+        return NULL;
+    }
+    Py_DECREF(result);
+    return PyLong_FromSsize_t(size);
+}
+
+/* A snapshot being read. `sr_view` is a byte memoryview of the whole
+   snapshot, created when the first out-of-band buffer is read, which
+   pickled elements keep slices of. */
+typedef struct {
+    PyObject* sr_source;
+    const unsigned char* sr_data;
+    Py_ssize_t sr_size;
+    Py_ssize_t sr_pos;
+    PyObject* sr_view;
+} snapshot_reader;
+
+/* Consume `n` bytes and return a pointer to them. */
+static const unsigned char*
+snapshot_read(snapshot_reader* r, uint64_t n)
+{
+    const unsigned char* data = r->sr_data + r->sr_pos;
+
+    if (n > (uint64_t) (r->sr_size - r->sr_pos)) {
+        PyErr_SetString(PyExc_ValueError, "truncated queue snapshot");
+        return NULL;
+    }
+    r->sr_pos += (Py_ssize_t) n;
+    return data;
+}
+
+static int
+snapshot_read_varint(snapshot_reader* r, uint64_t* value)
+{
+    const unsigned char* byte;
+    int shift;
+
+    *value = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        if (!(byte = snapshot_read(r, 1))) {
+            return -1;
+        }
+        *value |= (uint64_t) (*byte & 0x7f) << shift;
+        if (!(*byte & 0x80)) {
+            return 0;
+        }
+    }
+    PyErr_SetString(PyExc_ValueError, "corrupt queue snapshot");
+    return -1;
+}
+
+/* Consume `n` bytes and return them as a slice of `sr_view`. */
+static PyObject*
+snapshot_read_slice(snapshot_reader* r, uint64_t n)
+{
+    Py_ssize_t start = r->sr_pos;
+    PyObject* view;
+
+    if (!snapshot_read(r, n)) {
+        return NULL;
+    }
+    if (!r->sr_view) {
+        if (!(view = PyMemoryView_FromObject(r->sr_source))) {
+            return NULL;
+        }
+        r->sr_view = PyObject_CallMethod(view, "cast", "s", "B");
+        Py_DECREF(view);
+        if (!r->sr_view) {
+            return NULL;
+        }
+    }
+    return PySequence_GetSlice(r->sr_view, start, r->sr_pos);
+}
+
+/* Read a pickled run of elements and return them as a list. */
+static PyObject*
+snapshot_read_pickle(snapshot_reader* r)
+{
+    PyObject* loads;
+    PyObject* pickled = NULL;
+    PyObject* buffers = NULL;
+    PyObject* buffer;
+    PyObject* args = NULL;
+    PyObject* kwargs = NULL;
+    PyObject* run = NULL;
+    uint64_t count;
+    uint64_t size;
+    uint64_t n;
+
+    if (!(loads = queue_import("pickle", "loads", &queue_pickle_loads)) ||
+        snapshot_read_varint(r, &count) ||
+        snapshot_read_varint(r, &size) ||
+        !(pickled = snapshot_read_slice(r, size)) ||
+        snapshot_read_varint(r, &n) ||
+        !(buffers = PyList_New(0))) {
+        goto done;
+    }
+    while (n--) {
+        if (snapshot_read_varint(r, &size) ||
+            !(buffer = snapshot_read_slice(r, size))) {
+            goto done;
+        }
+        if (PyList_Append(buffers, buffer)) {
+            Py_DECREF(buffer);
+            goto done;
+        }
+        Py_DECREF(buffer);
+    }
+
+    if (!(args = PyTuple_Pack(1, pickled)) ||
+        !(kwargs = Py_BuildValue("{s:O}", "buffers", buffers)) ||
+        !(run = PyObject_Call(loads, args, kwargs))) {
+        goto done;
+    }
+    if (!PyList_CheckExact(run) ||
+        !count ||
+        (uint64_t) PyList_GET_SIZE(run) != count) {
+        PyErr_SetString(PyExc_ValueError, "corrupt queue snapshot");
+        Py_CLEAR(run);
+    }
+
+done:
+    Py_XDECREF(kwargs);
+    Py_XDECREF(args);
+    Py_XDECREF(buffers);
+    Py_XDECREF(pickled);
+    return run;
+}
+
+/* Read one record. This is an element, or a list of elements if `*is_run` is
+   set. */
+static PyObject*
+snapshot_read_element(snapshot_reader* r, int* is_run)
+{
+    const unsigned char* data;
+    uint64_t value;
+    int n;
+
+    *is_run = 0;
+    if (!(data = snapshot_read(r, 1))) {
+        return NULL;
+    }
+
+    switch ((queue_snapshot_tag) *data) {
+    case QUEUE_SNAPSHOT_NONE:
+        Py_RETURN_NONE;
+    case QUEUE_SNAPSHOT_FALSE:
+        Py_RETURN_FALSE;
+    case QUEUE_SNAPSHOT_TRUE:
+        Py_RETURN_TRUE;
+    case QUEUE_SNAPSHOT_INT:
+        if (snapshot_read_varint(r, &value)) {
+            return NULL;
+        }
+        return PyLong_FromLongLong(
+            (long long) ((value >> 1) ^ (~(value & 1) + 1)));
+    case QUEUE_SNAPSHOT_FLOAT: {
+        double result;
+
+        if (!(data = snapshot_read(r, 8))) {
+            return NULL;
+        }
+        value = 0;
+        for (n = 0; n < 8; ++n) {
+            value |= (uint64_t) data[n] << (8 * n);
+        }
+        memcpy(&result, &value, sizeof(result));
+        return PyFloat_FromDouble(result);
+    }
+    case QUEUE_SNAPSHOT_BYTES:
+        if (snapshot_read_varint(r, &value) ||
+            !(data = snapshot_read(r, value))) {
+            return NULL;
+        }
+        return PyBytes_FromStringAndSize((const char*) data,
+                                         (Py_ssize_t) value);
+    case QUEUE_SNAPSHOT_STR:
+        if (snapshot_read_varint(r, &value) ||
+            !(data = snapshot_read(r, value))) {
+            return NULL;
+        }
+        return PyUnicode_DecodeUTF8((const char*) data,
+                                    (Py_ssize_t) value,
+                                    "surrogatepass");
+    case QUEUE_SNAPSHOT_PICKLE:
+        *is_run = 1;
+        return snapshot_read_pickle(r);
+    }
+
+    PyErr_SetString(PyExc_ValueError, "corrupt queue snapshot");
+    return NULL;
+}
+
+/* Build a new queue from the snapshot in `r`. */
+static PyObject*
+queue_restore_from(PyTypeObject* cls, snapshot_reader* r)
+{
+    const unsigned char* header;
+    uint64_t maxsize;
+    uint64_t dropped;
+    uint64_t count;
+    queue* self;
+    PyObject* record;
+    Py_ssize_t n;
+    int is_run;
+
+    if (!(header = snapshot_read(r, 6)) ||
+        memcmp(header, QUEUE_SNAPSHOT_MAGIC, 4)) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_ValueError, "not a queue snapshot");
+        return NULL;
+    }
+    if (header[4] != QUEUE_SNAPSHOT_VERSION) {
+        PyErr_Format(PyExc_ValueError,
+                     "unsupported queue snapshot version %d",
+                     header[4]);
+        return NULL;
+    }
+    if ((header[5] & ~QUEUE_SNAPSHOT_INDEXED) >
+            QUEUE_OVERFLOW_OVERWRITE_OLDEST ||
+        snapshot_read_varint(r, &maxsize) ||
+        snapshot_read_varint(r, &dropped) ||
+        snapshot_read_varint(r, &count) ||
+        maxsize > PY_SSIZE_T_MAX ||
+        dropped > PY_SSIZE_T_MAX) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "corrupt queue snapshot");
+        }
+        return NULL;
+    }
+    /* every element takes at least one byte, so this also bounds the
+       allocation below by the size of the snapshot */
+    if (count > (uint64_t) (r->sr_size - r->sr_pos)) {
+        PyErr_SetString(PyExc_ValueError, "truncated queue snapshot");
+        return NULL;
+    }
+
+    if (!(self = (queue*) queue_alloc(
+              cls,
+              (Py_ssize_t) maxsize - 1,
+              (queue_overflow) (header[5] & ~QUEUE_SNAPSHOT_INDEXED),
+              header[5] & QUEUE_SNAPSHOT_INDEXED,
+              0))) {
+        return NULL;
+    }
+    self->q_dropped = (Py_ssize_t) dropped;
+    if (count && queue_resize(self, (Py_ssize_t) count)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    /* The new queue isn't visible to any other code yet, so the elements
+       can go straight into the ring. */
+    while ((uint64_t) self->q_size < count) {
+        if (!(record = snapshot_read_element(r, &is_run))) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        if (!is_run) {
+            QUEUE_SLOT(self, self->q_size) = record;
+            ++self->q_size;
+            continue;
+        }
+
+        if ((uint64_t) PyList_GET_SIZE(record) > count - self->q_size) {
+            PyErr_SetString(PyExc_ValueError, "corrupt queue snapshot");
+            Py_DECREF(record);
+            Py_DECREF(self);
+            return NULL;
+        }
+        for (n = 0; n < PyList_GET_SIZE(record); ++n) {
+            Py_INCREF(PyList_GET_ITEM(record, n));
+            QUEUE_SLOT(self, self->q_size) = PyList_GET_ITEM(record, n);
+            ++self->q_size;
+        }
+        Py_DECREF(record);
+    }
+#ifdef QUEUE_STATS
+    /* the restored queue has been this long already */
+    self->q_high_water = self->q_size;
+#endif
+
+    if (r->sr_pos != r->sr_size) {
+        PyErr_SetString(PyExc_ValueError, "trailing data in queue snapshot");
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    /* index the elements once they are all in place */
+    if (self->q_index) {
+        for (n = 0; n < self->q_size; ++n) {
+            if (queue_index_add(self, QUEUE_SLOT(self, n))) {
+                Py_DECREF(self);
+                return NULL;
+            }
+        }
+    }
+    return (PyObject*) self;
+}
+
+PyDoc_STRVAR(queue_restore_doc,
+             "Create a queue from a snapshot.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "source : bytes-like or file\n"
+             "    A snapshot from ``snapshot``: any object supporting the\n"
+             "    buffer protocol, like ``bytes`` or an ``mmap``, or a binary\n"
+             "    file to read it from.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "queue : Queue\n"
+             "    A new queue with the saved elements, ``maxsize``,\n"
+             "    ``overflow``, ``index`` and ``dropped``.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "Pickled elements get their out-of-band buffers as\n"
+             "memoryviews of ``source`` instead of copies, so they may keep\n"
+             "``source`` alive and share its memory.\n");
+
+static PyObject*
+queue_restore(PyTypeObject* cls, PyObject* source)
+{
+    snapshot_reader r;
+    Py_buffer view;
+    PyObject* data = NULL;
+    PyObject* result;
+
+    if (!PyObject_CheckBuffer(source)) {
+        /* read the whole file */
+        if (!(data = PyObject_CallMethod(source, "read", NULL))) {
+            return NULL;
+        }
+        source = data;
+    }
+    if (PyObject_GetBuffer(source, &view, PyBUF_SIMPLE)) {
+        Py_XDECREF(data);
+        return NULL;
+    }
+
+    r.sr_source = source;
+    r.sr_data = view.buf;
+    r.sr_size = view.len;
+    r.sr_pos = 0;
+    r.sr_view = NULL;
+    result = queue_restore_from(cls, &r);
+
+    Py_XDECREF(r.sr_view);
+    PyBuffer_Release(&view);
+    Py_XDECREF(data);
+    return result;
+}
+
+static PyObject*
+queue_reduce(queue* self, PyObject* unused)
+{
+    PyObject* restore;
+    PyObject* snapshot;
+
+    /* pickle a queue as `Queue.restore(queue.snapshot())` */
+    if (!(restore = PyObject_GetAttrString((PyObject*) Py_TYPE(self),
+                                           "restore"))) {
+        return NULL;
+    }
+    if (!(snapshot = queue_snapshot_bytes(self))) {
+        Py_DECREF(restore);
+        return NULL;
+    }
+    return Py_BuildValue("(N(N))", restore, snapshot);
+}
+
+QUEUE_DEFINE_LOCKED(queue_push, PyObject*,
+                    (queue* self,
+                     PyObject* const* args,
+                     Py_ssize_t nargs,
+                     PyObject* kwnames),
+                    (self, args, nargs, kwnames))
+QUEUE_DEFINE_LOCKED(queue_pop, PyObject*,
+                    (queue* self,
+                     PyObject* const* args,
+                     Py_ssize_t nargs,
+                     PyObject* kwnames),
+                    (self, args, nargs, kwnames))
+QUEUE_DEFINE_LOCKED(queue_rotate, PyObject*,
+                    (queue* self,
+                     PyObject* const* args,
+                     Py_ssize_t nargs,
+                     PyObject* kwnames),
+                    (self, args, nargs, kwnames))
+QUEUE_DEFINE_LOCKED(queue_push_many, PyObject*,
+                    (queue* self, PyObject* args, PyObject* kwargs),
+                    (self, args, kwargs))
+QUEUE_DEFINE_LOCKED(queue_pop_many, PyObject*,
+                    (queue* self, PyObject* args, PyObject* kwargs),
+                    (self, args, kwargs))
+QUEUE_DEFINE_LOCKED(queue_sizeof, PyObject*,
+                    (queue* self, PyObject* unused),
+                    (self, unused))
+
+PyMethodDef queue_methods[] = {
+    {"push",
+     (PyCFunction) (void (*)(void)) QUEUE_LOCKED(queue_push),
+     METH_FASTCALL | METH_KEYWORDS,
+     queue_push_doc},
+    {"pop",
+     (PyCFunction) (void (*)(void)) QUEUE_LOCKED(queue_pop),
+     METH_FASTCALL | METH_KEYWORDS,
+     queue_pop_doc},
+    {"push_many",
+     (PyCFunction) QUEUE_LOCKED(queue_push_many),
+     METH_VARARGS | METH_KEYWORDS,
+     queue_push_many_doc},
+    {"pop_many",
+     (PyCFunction) QUEUE_LOCKED(queue_pop_many),
+     METH_VARARGS | METH_KEYWORDS,
+     queue_pop_many_doc},
+    {"rotate",
+     (PyCFunction) (void (*)(void)) QUEUE_LOCKED(queue_rotate),
+     METH_FASTCALL | METH_KEYWORDS,
+     queue_rotate_doc},
+    {"drain",
+     (PyCFunction) queue_drain,
+     METH_NOARGS,
+     queue_drain_doc},
+    {"async_push",
+     (PyCFunction) queue_async_push,
+     METH_O,
+     queue_async_push_doc},
+    {"async_pop",
+     (PyCFunction) queue_async_pop,
+     METH_NOARGS,
+     queue_async_pop_doc},
+    {"snapshot",
+     (PyCFunction) queue_snapshot,
+     METH_VARARGS | METH_KEYWORDS,
+     queue_snapshot_doc},
+    {"restore",
+     (PyCFunction) queue_restore,
+     METH_O | METH_CLASS,
+     queue_restore_doc},
+    {"__reduce__",
+     (PyCFunction) queue_reduce,
+     METH_NOARGS,
+     NULL},
+    {"__sizeof__",
+     (PyCFunction) QUEUE_LOCKED(queue_sizeof),
+     METH_NOARGS,
+     queue_sizeof_doc},
+#ifdef QUEUE_STATS
+    {"stats",
+     (PyCFunction) queue_stats_method,
+     METH_VARARGS | METH_KEYWORDS,
+     queue_stats_doc},
+#endif
+    {NULL},
+};
+
+static Py_ssize_t
+queue_size(queue* self)
+{
+    /* return the number of elements in the ring buffer */
+    return self->q_size;
+}
+
+static PyObject*
+queue_item(queue* self, Py_ssize_t ix)
+{
+    PyObject* element;
+
+    /* lookup `ix` in the ring buffer with bounds checking */
+    if (ix < 0 || ix >= self->q_size) {
+        PyErr_SetString(PyExc_IndexError, "queue index out of range");
+        return NULL;
+    }
+
+    element = QUEUE_SLOT(self, ix);
+    /* `sq_item` needs to return a new reference */
+    Py_INCREF(element);
+    return element;
+}
+
+static int
+queue_contains(queue* self, PyObject* element)
+{
+    PyObject* item;
+    Py_ssize_t n;
+    int cmp;
+
+    if (self->q_index) {
+        /* the index has every element in the queue as a key */
+        return PyDict_Contains(self->q_index, element);
+    }
+
+    /* Compare each element in order. `q_size` is re-read on every iteration
+       because `__eq__` may run arbitrary code which could mutate the queue. */
+    for (n = 0; n < self->q_size; ++n) {
+        item = QUEUE_SLOT(self, n);
+        /* hold a reference to `item` while we compare it in case `__eq__`
+           pops it from the queue */
+        Py_INCREF(item);
+        cmp = PyObject_RichCompareBool(item, element, Py_EQ);
+        Py_DECREF(item);
+
+        if (cmp) {
+            /* either found (1) or an error occurred (-1) */
+            return cmp;
+        }
+    }
+
+    return 0;
+}
+
+QUEUE_DEFINE_LOCKED(queue_size, Py_ssize_t, (queue* self), (self))
+QUEUE_DEFINE_LOCKED(queue_item, PyObject*,
+                    (queue* self, Py_ssize_t ix),
+                    (self, ix))
+QUEUE_DEFINE_LOCKED(queue_contains, int,
+                    (queue* self, PyObject* element),
+                    (self, element))
+
+PySequenceMethods queue_as_sequence = {
+    (lenfunc) QUEUE_LOCKED(queue_size),         /* sq_length */
+    0,                                          /* sq_concat */
+    0,                                          /* sq_repeat */
+    (ssizeargfunc) QUEUE_LOCKED(queue_item),    /* sq_item */
+    0,                                          /* placeholder */
+    0,                                          /* sq_ass_item */
+    0,                                          /* placeholder */
+    (objobjproc) QUEUE_LOCKED(queue_contains),  /* sq_contains */
+    0,                                          /* sq_inplace_concat */
+    0,                                          /* sq_inplace_repeat */
+};
+
+static PyObject*
+queue_get_maxsize(queue* self, void* context)
+{
+    /* simply return the `q_maxsize` boxed as an int object */
+    return PyLong_FromSsize_t(self->q_maxsize);
+}
+
+static int
+queue_set_maxsize(queue* self, PyObject* value_ob, void* context)
+{
+    Py_ssize_t value = PyLong_AsSsize_t(value_ob);
+    if (PyErr_Occurred()) {
+        /* failed to convert the argument to a `Py_ssize_t`, reraise the
+           error */
+        return -1;
+    }
+
+    if (value >= 0 && value < self->q_size) {
+        PyErr_SetString(PyExc_ValueError,
+                        "cannot drop the maxsize below the current size");
+        return 1;
+    }
+
+    /* normalize "unlimited" to -1 */
+    self->q_maxsize = (value < 0) ? -1 : value;
+
+    /* Raising the maxsize may make room for more than one blocked `push`, wake
+       them all up and let them re-check the size. */
+    if (self->q_putters) {
+        pthread_mutex_lock(&self->q_mutex);
+        pthread_cond_broadcast(&self->q_not_full);
+        pthread_mutex_unlock(&self->q_mutex);
+    }
+    queue_async_notify(self);
+    return 0;
+}
+
+QUEUE_DEFINE_LOCKED(queue_get_maxsize, PyObject*,
+                    (queue* self, void* context),
+                    (self, context))
+QUEUE_DEFINE_LOCKED(queue_set_maxsize, int,
+                    (queue* self, PyObject* value_ob, void* context),
+                    (self, value_ob, context))
+QUEUE_DEFINE_LOCKED(queue_repr, PyObject*, (queue* self), (self))
+
+static PyObject*
+queue_get_overflow(queue* self, void* context)
+{
+    return PyUnicode_FromString(queue_overflow_names[self->q_overflow]);
+}
+
+static PyObject*
+queue_get_dropped(queue* self, void* context)
+{
+    return PyLong_FromSsize_t(self->q_dropped);
+}
+
+static int
+queue_set_dropped(queue* self, PyObject* value_ob, void* context)
+{
+    Py_ssize_t value;
+
+    if (!value_ob) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete dropped");
+        return -1;
+    }
+    if ((value = PyLong_AsSsize_t(value_ob)) == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (value < 0) {
+        PyErr_SetString(PyExc_ValueError, "dropped must be non-negative");
+        return -1;
+    }
+
+    /* let monitoring code reset the counter between samples */
+    self->q_dropped = value;
+    return 0;
+}
+
+static PyObject*
+queue_get_index(queue* self, void* context)
+{
+    return PyBool_FromLong(self->q_index != NULL);
+}
+
+QUEUE_DEFINE_LOCKED(queue_get_dropped, PyObject*,
+                    (queue* self, void* context),
+                    (self, context))
+QUEUE_DEFINE_LOCKED(queue_set_dropped, int,
+                    (queue* self, PyObject* value_ob, void* context),
+                    (self, value_ob, context))
+
+PyGetSetDef queue_getset[] = {
+    {"maxsize",
+     (getter) QUEUE_LOCKED(queue_get_maxsize),
+     (setter) QUEUE_LOCKED(queue_set_maxsize),
+     NULL,  /* doc */
+     NULL   /* closure */},
+    {"overflow",
+     (getter) queue_get_overflow,
+     NULL,  /* setter */
+     "What ``push`` does when the queue is full: 'raise',\n"
+     "'drop_newest' or 'overwrite_oldest'.",
+     NULL   /* closure */},
+    {"dropped",
+     (getter) QUEUE_LOCKED(queue_get_dropped),
+     (setter) QUEUE_LOCKED(queue_set_dropped),
+     "The number of elements discarded by the overflow policy.",
+     NULL   /* closure */},
+    {"index",
+     (getter) queue_get_index,
+     NULL,  /* setter */
+     "Whether the queue keeps a hash index of its elements.",
+     NULL   /* closure */},
+    {NULL},
+};
+
+PyDoc_STRVAR(queue_doc,
+             "A simple queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "maxsize : int, optional\n"
+             "    The most elements in the queue at once. Defaults to no\n"
+             "    limit.\n"
+             "overflow : {'raise', 'drop_newest', 'overwrite_oldest'}, optional\n"
+             "    What ``push`` does when the queue is full. 'raise' blocks\n"
+             "    and then raises ``Full``. 'drop_newest' discards the new\n"
+             "    element and 'overwrite_oldest' discards the element at the\n"
+             "    front, which keeps the newest ``maxsize`` elements. Both\n"
+             "    count the discarded elements in ``dropped``. Defaults to\n"
+             "    'raise'.\n"
+             "index : bool, optional\n"
+             "    Keep a hash index of the elements so ``in`` and\n"
+             "    ``push(unique=True)`` are O(1) instead of a scan of the\n"
+             "    queue. Every element must be hashable and pushing costs a\n"
+             "    dict update. Defaults to False.\n"
+             "residency : bool, optional\n"
+             "    Time-stamp each push and keep a histogram of how long\n"
+             "    elements are queued, reported by ``stats``. This costs a\n"
+             "    clock read per push and pop. Defaults to False.\n");
+
+static PyTypeObject queue_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.Queue",                              /* tp_name */
+    sizeof(queue),                              /* tp_basicsize */
+    sizeof(PyObject*),                          /* tp_itemsize */
+    (destructor) queue_dealloc,                 /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    (reprfunc) QUEUE_LOCKED(queue_repr),        /* tp_repr */
+    0,                                          /* tp_as_number */
+    &queue_as_sequence,                         /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,                         /* tp_flags */
+    queue_doc,                                  /* tp_doc */
+    (traverseproc) queue_traverse,              /* tp_traverse */
+    (inquiry) queue_clear,                      /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    (getiterfunc) queue_iter,                   /* tp_iter */
+    0,                                          /* tp_iternext */
+    queue_methods,                              /* tp_methods */
+    0,                                          /* tp_members */
+    queue_getset,                               /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    0,                                          /* tp_init */
+    0,                                          /* tp_alloc */
+    (newfunc) queue_new,                        /* tp_new */
+};
+
+/* Typed queues hold raw 64 bit values instead of references to objects. Each
+   element costs 8 bytes in a contiguous ring, there is nothing for the cyclic
+   gc to traverse, and the live contents can be exported with the buffer
+   protocol for zero-copy handoff to libraries like NumPy. */
+
+/* the element type of a typed queue */
+typedef enum {
+    TYPED_QUEUE_INT64,
+    TYPED_QUEUE_FLOAT64,
+} typed_queue_kind;
+
+/* One slot in a typed queue's ring buffer. Both element types are 8 bytes so
+   the ring layout is the same for every kind. */
+typedef union {
+    int64_t as_int64;
+    double as_float64;
+} typed_queue_value;
+
+typedef struct {
+    PyObject tq_base;               /* storage for our type and reference count */
+    typed_queue_kind tq_kind;       /* the type of the elements */
+    Py_ssize_t tq_maxsize;          /* the maximum number of elements */
+    typed_queue_value* tq_slots;    /* ring buffer of the raw values */
+    Py_ssize_t tq_capacity;         /* the number of slots, a power of 2 */
+    Py_ssize_t tq_head;             /* the index in `tq_slots` of the first value */
+    Py_ssize_t tq_size;             /* the number of values in the queue */
+    Py_ssize_t tq_exports;          /* the number of live buffer exports */
+} typed_queue;
+
+static PyTypeObject int64_queue_type;
+static PyTypeObject float64_queue_type;
+
+/* the buffer of an empty queue with no storage still needs a valid pointer */
+static typed_queue_value typed_queue_empty;
+
+/* the same as `QUEUE_SLOT` for a typed queue */
+#define TYPED_QUEUE_SLOT(self, ix)                                      \
+    ((self)->tq_slots[((self)->tq_head + (ix)) & ((self)->tq_capacity - 1)])
+
+/* the struct module format code of each kind's elements */
+static const char*
+typed_queue_format(typed_queue* self)
+{
+    return (self->tq_kind == TYPED_QUEUE_INT64) ? "q" : "d";
+}
+
+/* Check that `format` describes native values of this queue's kind. */
+static int
+typed_queue_format_matches(typed_queue* self, const char* format)
+{
+    if (!format) {
+        /* no format means unsigned bytes */
+        return 0;
+    }
+
+    /* native byte order and size prefixes are fine, anything else is not */
+    if (*format == '@' || *format == '=') {
+        ++format;
+    }
+    if (!format[0] || format[1]) {
+        return 0;
+    }
+
+    if (self->tq_kind == TYPED_QUEUE_FLOAT64) {
+        return *format == 'd';
+    }
+    return *format == 'q' || (*format == 'l' && sizeof(long) == 8);
+}
+
+static int
+typed_queue_resize(typed_queue* self, Py_ssize_t needed)
+{
+    Py_ssize_t new_capacity = QUEUE_MIN_CAPACITY;
+    typed_queue_value* new_slots;
+    Py_ssize_t first;
+
+    while (new_capacity < needed) {
+        if (new_capacity >
+            PY_SSIZE_T_MAX / 2 / (Py_ssize_t) sizeof(typed_queue_value)) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        new_capacity *= 2;
+    }
+
+    if (!(new_slots = PyMem_New(typed_queue_value, new_capacity))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    /* Copy the values so that the head is at index 0. Unlike `queue_resize`
+       there are no references to move so the ring can be copied in at most
+       two blocks. */
+    if (self->tq_size) {
+        first = self->tq_capacity - self->tq_head;
+        if (first > self->tq_size) {
+            first = self->tq_size;
+        }
+        memcpy(new_slots,
+               &self->tq_slots[self->tq_head],
+               first * sizeof(typed_queue_value));
+        memcpy(new_slots + first,
+               self->tq_slots,
+               (self->tq_size - first) * sizeof(typed_queue_value));
+    }
+
+    PyMem_Free(self->tq_slots);
+    self->tq_slots = new_slots;
+    self->tq_capacity = new_capacity;
+    self->tq_head = 0;
+    return 0;
+}
+
+/* Copy the first `count` values of the queue into `out` without removing
+   them. */
+static void
+typed_queue_copy_out(typed_queue* self, typed_queue_value* out, Py_ssize_t count)
+{
+    Py_ssize_t first;
+
+    if (!count) {
+        return;
+    }
+
+    first = self->tq_capacity - self->tq_head;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(out, &self->tq_slots[self->tq_head], first * sizeof(typed_queue_value));
+    memcpy(out + first, self->tq_slots, (count - first) * sizeof(typed_queue_value));
+}
+
+/* Copy `count` values from `in` into the free slots after the tail. The caller
+   must have made room and must update `tq_size`. */
+static void
+typed_queue_copy_in(typed_queue* self,
+                    const typed_queue_value* in,
+                    Py_ssize_t count)
+{
+    Py_ssize_t tail;
+    Py_ssize_t first;
+
+    if (!count) {
+        return;
+    }
+
+    tail = (self->tq_head + self->tq_size) & (self->tq_capacity - 1);
+    first = self->tq_capacity - tail;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(&self->tq_slots[tail], in, first * sizeof(typed_queue_value));
+    memcpy(self->tq_slots, in + first, (count - first) * sizeof(typed_queue_value));
+}
+
+/* Refuse to change the contents of the queue while a buffer view of it is
+   alive. The view points directly into the ring so moving or overwriting the
+   values would change or invalidate it, the same way `bytearray` refuses to
+   resize while exported. */
+static int
+typed_queue_check_exports(typed_queue* self)
+{
+    if (self->tq_exports) {
+        PyErr_SetString(PyExc_BufferError,
+                        "cannot modify a typed queue while a buffer view of it "
+                        "exists");
+        return -1;
+    }
+    return 0;
+}
+
+/* Convert `ob` to a raw value of this queue's kind. */
+static int
+typed_queue_unbox(typed_queue* self, PyObject* ob, typed_queue_value* out)
+{
+    if (self->tq_kind == TYPED_QUEUE_INT64) {
+        out->as_int64 = PyLong_AsLongLong(ob);
+        return (out->as_int64 == -1 && PyErr_Occurred()) ? -1 : 0;
+    }
+
+    out->as_float64 = PyFloat_AsDouble(ob);
+    return (out->as_float64 == -1.0 && PyErr_Occurred()) ? -1 : 0;
+}
+
+/* Box a raw value of this queue's kind as a new int or float object. */
+static PyObject*
+typed_queue_box(typed_queue* self, typed_queue_value value)
+{
+    if (self->tq_kind == TYPED_QUEUE_INT64) {
+        return PyLong_FromLongLong(value.as_int64);
+    }
+    return PyFloat_FromDouble(value.as_float64);
+}
+
+static PyObject*
+typed_queue_new(PyTypeObject* cls, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"maxsize", NULL};
+
+    typed_queue* self;
+    Py_ssize_t maxsize = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|n",
+                                     keywords,
+                                     &maxsize)) {
+        return NULL;
+    }
+
+    /* `tp_alloc` zeros the memory so we start with no slots and no
+       elements */
+    if (!(self = (typed_queue*) cls->tp_alloc(cls, 0))) {
+        return NULL;
+    }
+
+    self->tq_kind = PyType_IsSubtype(cls, &float64_queue_type) ?
+        TYPED_QUEUE_FLOAT64 :
+        TYPED_QUEUE_INT64;
+    /* normalize "unlimited" to -1 */
+    self->tq_maxsize = (maxsize < 0) ? -1 : maxsize;
+
+    return (PyObject*) self;
+}
+
+static void
+typed_queue_dealloc(typed_queue* self)
+{
+    /* there are no references to release, only the ring buffer; a buffer
+       export holds a reference to `self` so there can be none left here */
+    PyMem_Free(self->tq_slots);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject*
+typed_queue_repr(typed_queue* self)
+{
+    if (self->tq_maxsize < 0) {
+        return PyUnicode_FromFormat("<%s: %zd>",
+                                    Py_TYPE(self)->tp_name,
+                                    self->tq_size);
+    }
+
+    return PyUnicode_FromFormat("<%s: %zd/%zd>",
+                                Py_TYPE(self)->tp_name,
+                                self->tq_size,
+                                self->tq_maxsize);
+}
+
+PyDoc_STRVAR(typed_queue_push_doc,
+             "Push a value onto the end of the queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "value : int or float\n"
+             "    The value to push. It is converted to the queue's element\n"
+             "    type.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Full\n"
+             "    Raised when the queue is full. Typed queues never block.\n"
+             "BufferError\n"
+             "    Raised while a buffer view of the queue exists.\n");
+
+static PyObject*
+typed_queue_push(typed_queue* self, PyObject* value_ob)
+{
+    typed_queue_value value;
+
+    /* convert first, `__index__` or `__float__` could export a view */
+    if (typed_queue_unbox(self, value_ob, &value) ||
+        typed_queue_check_exports(self)) {
+        return NULL;
+    }
+
+    if (self->tq_maxsize > 0 && self->tq_size >= self->tq_maxsize) {
+        PyErr_SetString(queue_full_error, "full");
+        return NULL;
+    }
+
+    if (self->tq_size == self->tq_capacity &&
+        typed_queue_resize(self, self->tq_size + 1)) {
+        return NULL;
+    }
+
+    TYPED_QUEUE_SLOT(self, self->tq_size) = value;
+    ++self->tq_size;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(typed_queue_pop_doc,
+             "Remove and return the value at the front of the queue.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Empty\n"
+             "    Raised when the queue is empty. Typed queues never block.\n"
+             "BufferError\n"
+             "    Raised while a buffer view of the queue exists.\n");
+
+static PyObject*
+typed_queue_pop(typed_queue* self, PyObject* unused)
+{
+    typed_queue_value value;
+
+    if (typed_queue_check_exports(self)) {
+        return NULL;
+    }
+
+    if (!self->tq_size) {
+        PyErr_SetString(queue_empty_error, "empty");
+        return NULL;
+    }
+
+    value = TYPED_QUEUE_SLOT(self, 0);
+    self->tq_head = (self->tq_head + 1) & (self->tq_capacity - 1);
+    --self->tq_size;
+
+    return typed_queue_box(self, value);
+}
+
+PyDoc_STRVAR(typed_queue_push_many_doc,
+             "Push many values onto the end of the queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "values : buffer or iterable\n"
+             "    The values to push, in order. A contiguous buffer whose\n"
+             "    format matches the queue's element type, like a NumPy array\n"
+             "    or an ``array.array``, is copied in directly. Anything else\n"
+             "    is iterated and each value is converted.\n"
+             "partial : bool, optional\n"
+             "    If the values don't all fit, push as many as fit instead of\n"
+             "    raising. Defaults to False.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "count : int\n"
+             "    The number of values pushed.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Full\n"
+             "    Raised when ``partial`` is False and the values don't all\n"
+             "    fit. Nothing is pushed in this case.\n");
+
+static PyObject*
+typed_queue_push_many(typed_queue* self, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"values", "partial", NULL};
+    PyObject* values_ob;
+    int partial = 0;
+    Py_buffer values;
+    PyObject* elements;
+    typed_queue_value* converted = NULL;
+    const typed_queue_value* source;
+    Py_ssize_t count;
+    Py_ssize_t n;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O|p:push_many",
+                                     keywords,
+                                     &values_ob,
+                                     &partial)) {
+        return NULL;
+    }
+
+    values.obj = NULL;
+    if (PyObject_CheckBuffer(values_ob)) {
+        if (PyObject_GetBuffer(values_ob,
+                               &values,
+                               PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)) {
+            if (!PyErr_ExceptionMatches(PyExc_BufferError)) {
+                return NULL;
+            }
+            /* not contiguous, fall back to iterating */
+            PyErr_Clear();
+            values.obj = NULL;
+        }
+        else if (values.itemsize != sizeof(typed_queue_value) ||
+                 !typed_queue_format_matches(self, values.format)) {
+            /* a different element type, fall back to iterating */
+            PyBuffer_Release(&values);
+            values.obj = NULL;
+        }
+    }
+
+    if (values.obj) {
+        /* the raw values can be copied straight into the ring */
+        source = (const typed_queue_value*) values.buf;
+        count = values.len / values.itemsize;
+    }
+    else {
+        if (!(elements = PySequence_Fast(values_ob,
+                                         "push_many() argument must be "
+                                         "iterable"))) {
+            return NULL;
+        }
+        count = PySequence_Fast_GET_SIZE(elements);
+
+        /* Convert every value before touching the queue. A conversion may
+           call an `__index__` or `__float__` method which could push to this
+           queue and move its storage, so we can't convert directly into the
+           ring. This also means a bad value pushes nothing. */
+        if (!(converted = PyMem_New(typed_queue_value, count ? count : 1))) {
+            Py_DECREF(elements);
+            return PyErr_NoMemory();
+        }
+        for (n = 0; n < count; ++n) {
+            if (typed_queue_unbox(self,
+                                  PySequence_Fast_GET_ITEM(elements, n),
+                                  &converted[n])) {
+                Py_DECREF(elements);
+                goto error;
+            }
+        }
+        Py_DECREF(elements);
+        source = converted;
+    }
+
+    if (typed_queue_check_exports(self)) {
+        goto error;
+    }
+
+    /* one capacity check for the whole batch */
+    if (self->tq_maxsize > 0 && count > self->tq_maxsize - self->tq_size) {
+        if (!partial) {
+            PyErr_SetString(queue_full_error, "full");
+            goto error;
+        }
+        count = self->tq_maxsize - self->tq_size;
+    }
+
+    /* one resize for the whole batch */
+    if (self->tq_size + count > self->tq_capacity &&
+        typed_queue_resize(self, self->tq_size + count)) {
+        goto error;
+    }
+
+    typed_queue_copy_in(self, source, count);
+    self->tq_size += count;
+
+    if (values.obj) {
+        PyBuffer_Release(&values);
+    }
+    PyMem_Free(converted);
+    return PyLong_FromSsize_t(count);
+
+error:
+    if (values.obj) {
+        PyBuffer_Release(&values);
+    }
+    PyMem_Free(converted);
+    return NULL;
+}
+
+PyDoc_STRVAR(typed_queue_pop_many_doc,
+             "Remove and return up to ``n`` values from the front of the\n"
+             "queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "n : int, optional\n"
+             "    The most values to pop. Defaults to every value.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "values : memoryview\n"
+             "    A one dimensional view of the popped values in queue order\n"
+             "    with format ``'q'`` or ``'d'``. It owns a private copy so it\n"
+             "    stays valid as the queue changes.\n");
+
+static PyObject*
+typed_queue_pop_many(typed_queue* self, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"n", NULL};
+    Py_ssize_t count = -1;
+    PyObject* storage;
+    PyObject* view;
+    PyObject* out;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|n:pop_many",
+                                     keywords,
+                                     &count)) {
+        return NULL;
+    }
+
+    if (typed_queue_check_exports(self)) {
+        return NULL;
+    }
+
+    if (count < 0 || count > self->tq_size) {
+        count = self->tq_size;
+    }
+
+    /* allocate the output as a bytearray and hand back a typed view of it */
+    if (!(storage = PyByteArray_FromStringAndSize(
+              NULL,
+              count * sizeof(typed_queue_value)))) {
+        return NULL;
+    }
+    typed_queue_copy_out(self,
+                         (typed_queue_value*) PyByteArray_AS_STRING(storage),
+                         count);
+
+    view = PyMemoryView_FromObject(storage);
+    Py_DECREF(storage);
+    if (!view) {
+        return NULL;
+    }
+    out = PyObject_CallMethod(view, "cast", "s", typed_queue_format(self));
+    Py_DECREF(view);
+    if (!out) {
+        return NULL;
+    }
+
+    /* only remove the values once nothing else can fail */
+    if (count) {
+        self->tq_head = (self->tq_head + count) & (self->tq_capacity - 1);
+        self->tq_size -= count;
+    }
+
+    return out;
+}
+
+PyDoc_STRVAR(typed_queue_pop_into_doc,
+             "Remove values from the front of the queue into a buffer.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "out : buffer\n"
+             "    A writable, contiguous buffer whose format matches the\n"
+             "    queue's element type. Up to ``len(out)`` values are popped\n"
+             "    into it.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "count : int\n"
+             "    The number of values written to the start of ``out``.\n");
+
+static PyObject*
+typed_queue_pop_into(typed_queue* self, PyObject* out_ob)
+{
+    Py_buffer out;
+    Py_ssize_t count;
+
+    if (typed_queue_check_exports(self)) {
+        return NULL;
+    }
+
+    if (PyObject_GetBuffer(out_ob,
+                           &out,
+                           PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)) {
+        return NULL;
+    }
+
+    if (out.itemsize != sizeof(typed_queue_value) ||
+        !typed_queue_format_matches(self, out.format)) {
+        PyErr_Format(PyExc_TypeError,
+                     "out must be a buffer with format '%s', got format '%s'",
+                     typed_queue_format(self),
+                     out.format ? out.format : "B");
+        PyBuffer_Release(&out);
+        return NULL;
+    }
+
+    count = out.len / out.itemsize;
+    if (count > self->tq_size) {
+        count = self->tq_size;
+    }
+
+    typed_queue_copy_out(self, (typed_queue_value*) out.buf, count);
+    PyBuffer_Release(&out);
+
+    if (count) {
+        self->tq_head = (self->tq_head + count) & (self->tq_capacity - 1);
+        self->tq_size -= count;
+    }
+
+    return PyLong_FromSsize_t(count);
+}
+
+QUEUE_DEFINE_LOCKED(typed_queue_push, PyObject*,
+                    (typed_queue* self, PyObject* value_ob),
+                    (self, value_ob))
+QUEUE_DEFINE_LOCKED(typed_queue_pop, PyObject*,
+                    (typed_queue* self, PyObject* unused),
+                    (self, unused))
+QUEUE_DEFINE_LOCKED(typed_queue_push_many, PyObject*,
+                    (typed_queue* self, PyObject* args, PyObject* kwargs),
+                    (self, args, kwargs))
+QUEUE_DEFINE_LOCKED(typed_queue_pop_many, PyObject*,
+                    (typed_queue* self, PyObject* args, PyObject* kwargs),
+                    (self, args, kwargs))
+QUEUE_DEFINE_LOCKED(typed_queue_pop_into, PyObject*,
+                    (typed_queue* self, PyObject* out_ob),
+                    (self, out_ob))
+
+PyMethodDef typed_queue_methods[] = {
+    {"push",
+     (PyCFunction) QUEUE_LOCKED(typed_queue_push),
+     METH_O,
+     typed_queue_push_doc},
+    {"pop",
+     (PyCFunction) QUEUE_LOCKED(typed_queue_pop),
+     METH_NOARGS,
+     typed_queue_pop_doc},
+    {"push_many",
+     (PyCFunction) QUEUE_LOCKED(typed_queue_push_many),
+     METH_VARARGS | METH_KEYWORDS,
+     typed_queue_push_many_doc},
+    {"pop_many",
+     (PyCFunction) QUEUE_LOCKED(typed_queue_pop_many),
+     METH_VARARGS | METH_KEYWORDS,
+     typed_queue_pop_many_doc},
+    {"pop_into",
+     (PyCFunction) QUEUE_LOCKED(typed_queue_pop_into),
+     METH_O,
+     typed_queue_pop_into_doc},
+    {NULL},
+};
+
+static Py_ssize_t
+typed_queue_size(typed_queue* self)
+{
+    return self->tq_size;
+}
+
+static PyObject*
+typed_queue_item(typed_queue* self, Py_ssize_t ix)
+{
+    if (ix < 0 || ix >= self->tq_size) {
+        PyErr_SetString(PyExc_IndexError, "queue index out of range");
+        return NULL;
+    }
+
+    return typed_queue_box(self, TYPED_QUEUE_SLOT(self, ix));
+}
+
+QUEUE_DEFINE_LOCKED(typed_queue_size, Py_ssize_t, (typed_queue* self), (self))
+QUEUE_DEFINE_LOCKED(typed_queue_item, PyObject*,
+                    (typed_queue* self, Py_ssize_t ix),
+                    (self, ix))
+
+PySequenceMethods typed_queue_as_sequence = {
+    (lenfunc) QUEUE_LOCKED(typed_queue_size),   /* sq_length */
+    0,                                          /* sq_concat */
+    0,                                          /* sq_repeat */
+    (ssizeargfunc) QUEUE_LOCKED(typed_queue_item), /* sq_item */
+    0,                                          /* placeholder */
+    0,                                          /* sq_ass_item */
+    0,                                          /* placeholder */
+    0,                                          /* sq_contains */
+    0,                                          /* sq_inplace_concat */
+    0,                                          /* sq_inplace_repeat */
+};
+
+static int
+typed_queue_getbuffer(typed_queue* self, Py_buffer* view, int flags)
+{
+    /* The view must be one contiguous block. If the live values wrap around
+       the end of the ring, copy them into a new ring with the head at 0. This
+       is the only time exporting costs more than O(1), and it can't happen
+       again until the queue is modified, which has to wait until every view
+       is released. */
+    if (self->tq_head + self->tq_size > self->tq_capacity &&
+        typed_queue_resize(self, self->tq_capacity)) {
+        view->obj = NULL;
+        return -1;
+    }
+
+    view->obj = (PyObject*) self;
+    Py_INCREF(self);
+    view->buf = self->tq_size ?
+        (void*) &TYPED_QUEUE_SLOT(self, 0) :
+        (void*) &typed_queue_empty;
+    view->len = self->tq_size * sizeof(typed_queue_value);
+    /* the values may be written through the view, only the layout is
+       fixed */
+    view->readonly = 0;
+    view->itemsize = sizeof(typed_queue_value);
+    view->format = (flags & PyBUF_FORMAT) ?
+        (char*) typed_queue_format(self) :
+        NULL;
+    view->ndim = 1;
+    /* `tq_size` can't change while the view exists so it can be the shape */
+    view->shape = (flags & PyBUF_ND) ? &self->tq_size : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ?
+        &view->itemsize :
+        NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    ++self->tq_exports;
+    return 0;
+}
+
+static void
+typed_queue_releasebuffer(typed_queue* self, Py_buffer* view)
+{
+#ifdef Py_GIL_DISABLED
+    Py_BEGIN_CRITICAL_SECTION(self);
+    --self->tq_exports;
+    Py_END_CRITICAL_SECTION();
+#else
+    --self->tq_exports;
+#endif
+}
+
+QUEUE_DEFINE_LOCKED(typed_queue_getbuffer, int,
+                    (typed_queue* self, Py_buffer* view, int flags),
+                    (self, view, flags))
+
+PyBufferProcs typed_queue_as_buffer = {
+    (getbufferproc) QUEUE_LOCKED(typed_queue_getbuffer), /* bf_getbuffer */
+    (releasebufferproc) typed_queue_releasebuffer,  /* bf_releasebuffer */
+};
+
+static PyObject*
+typed_queue_get_maxsize(typed_queue* self, void* context)
+{
+    return PyLong_FromSsize_t(self->tq_maxsize);
+}
+
+static int
+typed_queue_set_maxsize(typed_queue* self, PyObject* value_ob, void* context)
+{
+    Py_ssize_t value = PyLong_AsSsize_t(value_ob);
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+
+    if (value >= 0 && value < self->tq_size) {
+        PyErr_SetString(PyExc_ValueError,
+                        "cannot drop the maxsize below the current size");
+        return -1;
+    }
+
+    self->tq_maxsize = (value < 0) ? -1 : value;
+    return 0;
+}
+
+QUEUE_DEFINE_LOCKED(typed_queue_get_maxsize, PyObject*,
+                    (typed_queue* self, void* context),
+                    (self, context))
+QUEUE_DEFINE_LOCKED(typed_queue_set_maxsize, int,
+                    (typed_queue* self, PyObject* value_ob, void* context),
+                    (self, value_ob, context))
+QUEUE_DEFINE_LOCKED(typed_queue_repr, PyObject*, (typed_queue* self), (self))
+
+PyGetSetDef typed_queue_getset[] = {
+    {"maxsize",
+     (getter) QUEUE_LOCKED(typed_queue_get_maxsize),
+     (setter) QUEUE_LOCKED(typed_queue_set_maxsize),
+     NULL,  /* doc */
+     NULL   /* closure */},
+    {NULL},
+};
+
+PyDoc_STRVAR(int64_queue_doc,
+             "A queue of 64 bit signed integers.\n"
+             "\n"
+             "The values are stored unboxed in a contiguous ring buffer. The\n"
+             "queue supports the buffer protocol with format ``'q'``; while a\n"
+             "view exists the values may be written through it but the queue\n"
+             "can't be pushed to or popped from.\n");
+
+static PyTypeObject int64_queue_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.Int64Queue",                         /* tp_name */
+    sizeof(typed_queue),                        /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) typed_queue_dealloc,           /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    (reprfunc) QUEUE_LOCKED(typed_queue_repr),  /* tp_repr */
+    0,                                          /* tp_as_number */
+    &typed_queue_as_sequence,                   /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    &typed_queue_as_buffer,                     /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    int64_queue_doc,                            /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    typed_queue_methods,                        /* tp_methods */
+    0,                                          /* tp_members */
+    typed_queue_getset,                         /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    0,                                          /* tp_init */
+    0,                                          /* tp_alloc */
+    (newfunc) typed_queue_new,                  /* tp_new */
+};
+
+PyDoc_STRVAR(float64_queue_doc,
+             "A queue of 64 bit floats.\n"
+             "\n"
+             "The values are stored unboxed in a contiguous ring buffer. The\n"
+             "queue supports the buffer protocol with format ``'d'``; while a\n"
+             "view exists the values may be written through it but the queue\n"
+             "can't be pushed to or popped from.\n");
+
+static PyTypeObject float64_queue_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.Float64Queue",                       /* tp_name */
+    sizeof(typed_queue),                        /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) typed_queue_dealloc,           /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    (reprfunc) QUEUE_LOCKED(typed_queue_repr),  /* tp_repr */
+    0,                                          /* tp_as_number */
+    &typed_queue_as_sequence,                   /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    &typed_queue_as_buffer,                     /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    float64_queue_doc,                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    typed_queue_methods,                        /* tp_methods */
+    0,                                          /* tp_members */
+    typed_queue_getset,                         /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    0,                                          /* tp_init */
+    0,                                          /* tp_alloc */
+    (newfunc) typed_queue_new,                  /* tp_new */
+};
+
+/* Lock-free queues are fixed-capacity rings that are safe to use without the
+   GIL. On the free-threaded build a `Queue` method takes a per-object lock;
+   these only use atomic loads and stores of the head and tail counters, so a
+   producer and a consumer running in parallel never wait for each other.
+
+   `SPSCQueue` is for exactly one producing thread and one consuming thread.
+   Each counter has a single writer so no read-modify-write operations are
+   needed. `MPMCQueue` allows any number of each at the cost of a
+   compare-and-swap per operation; it is Dmitry Vyukov's bounded MPMC queue,
+   where each cell carries a sequence number that says whose turn it is.
+
+   With the GIL the pushes and pops are serialized anyway, so both are safe to
+   share between any number of threads there. */
+
+/* Keep the counters written by the producer and consumer on different cache
+   lines so they don't invalidate each other on every operation. */
+#define LOCKFREE_CACHE_LINE 64
+
+typedef struct {
+    atomic_size_t c_sequence;   /* MPMC only: the turn this cell is ready for */
+    PyObject* c_element;        /* an owned reference, if the cell is full */
+} lockfree_cell;
+
+typedef struct {
+    PyObject lf_base;           /* storage for our type and reference count */
+    int lf_multi;               /* use the MPMC protocol */
+    size_t lf_capacity;         /* the number of cells, a power of 2 */
+    lockfree_cell* lf_cells;    /* the ring buffer */
+
+    char lf_pad0[LOCKFREE_CACHE_LINE];
+    atomic_size_t lf_tail;      /* the total number of pushes */
+    size_t lf_cached_head;      /* SPSC only: the producer's view of `lf_head` */
+
+    char lf_pad1[LOCKFREE_CACHE_LINE];
+    atomic_size_t lf_head;      /* the total number of pops */
+    size_t lf_cached_tail;      /* SPSC only: the consumer's view of `lf_tail` */
+
+    char lf_pad2[LOCKFREE_CACHE_LINE];
+} lockfree_queue;
+
+static PyTypeObject spsc_queue_type;
+static PyTypeObject mpmc_queue_type;
+
+static PyObject*
+lockfree_queue_new(PyTypeObject* cls, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"maxsize", NULL};
+
+    lockfree_queue* self;
+    Py_ssize_t maxsize;
+    int multi = PyType_IsSubtype(cls, &mpmc_queue_type);
+    size_t capacity;
+    size_t n;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "n",
+                                     keywords,
+                                     &maxsize)) {
+        return NULL;
+    }
+
+    if (maxsize <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "a lock-free queue needs a positive maxsize");
+        return NULL;
+    }
+
+    /* The counters are mapped to cells with a mask. The MPMC protocol needs
+       at least 2 cells: with one, a full cell's sequence `pos + 1` would also
+       say it is empty for the next push. */
+    capacity = multi ? 2 : 1;
+    while (capacity < (size_t) maxsize) {
+        if (capacity > (size_t) PY_SSIZE_T_MAX / 2 / sizeof(lockfree_cell)) {
+            return PyErr_NoMemory();
+        }
+        capacity *= 2;
+    }
+
+    if (!(self = (lockfree_queue*) cls->tp_alloc(cls, 0))) {
+        return NULL;
+    }
+
+    if (!(self->lf_cells = PyMem_New(lockfree_cell, capacity))) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    for (n = 0; n < capacity; ++n) {
+        /* cell `n` is ready for the `n`th push */
+        atomic_init(&self->lf_cells[n].c_sequence, n);
+        self->lf_cells[n].c_element = NULL;
+    }
+
+    self->lf_multi = multi;
+    self->lf_capacity = capacity;
+    atomic_init(&self->lf_tail, 0);
+    atomic_init(&self->lf_head, 0);
+
+    return (PyObject*) self;
+}
+
+/* Put `element` in the ring, taking a new reference. Returns 0 if the queue is
+   full. */
+static int
+lockfree_queue_try_push(lockfree_queue* self, PyObject* element)
+{
+    size_t mask = self->lf_capacity - 1;
+    lockfree_cell* cell;
+    size_t tail;
+    size_t sequence;
+    ptrdiff_t turn;
+
+    if (!self->lf_multi) {
+        /* We are the only writer of `lf_tail`. Only look at the consumer's
+           `lf_head` when our cached copy says the ring is full. */
+        tail = atomic_load_explicit(&self->lf_tail, memory_order_relaxed);
+        if (tail - self->lf_cached_head == self->lf_capacity) {
+            self->lf_cached_head =
+                atomic_load_explicit(&self->lf_head, memory_order_acquire);
+            if (tail - self->lf_cached_head == self->lf_capacity) {
+                return 0;
+            }
+        }
+
+        Py_INCREF(element);
+        self->lf_cells[tail & mask].c_element = element;
+        /* publish the element to the consumer */
+        atomic_store_explicit(&self->lf_tail, tail + 1, memory_order_release);
+        return 1;
+    }
+
+    tail = atomic_load_explicit(&self->lf_tail, memory_order_relaxed);
+    for (;;) {
+        cell = &self->lf_cells[tail & mask];
+        sequence = atomic_load_explicit(&cell->c_sequence, memory_order_acquire);
+        turn = (ptrdiff_t) (sequence - tail);
+
+        if (turn == 0) {
+            /* the cell is empty and it is our turn, try to claim it */
+            if (atomic_compare_exchange_weak_explicit(&self->lf_tail,
+                                                      &tail,
+                                                      tail + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+            /* another producer won, `tail` now holds the new value */
+        }
+        else if (turn < 0) {
+            /* the cell still holds the element from the last lap */
+            return 0;
+        }
+        else {
+            /* another producer claimed this cell, try the next one */
+            tail = atomic_load_explicit(&self->lf_tail, memory_order_relaxed);
+        }
+    }
+
+    Py_INCREF(element);
+    cell->c_element = element;
+    /* hand the cell to the consumer of this lap */
+    atomic_store_explicit(&cell->c_sequence, tail + 1, memory_order_release);
+    return 1;
+}
+
+/* Take the element at the front of the ring, or return NULL if the queue is
+   empty. The caller owns the reference. */
+static PyObject*
+lockfree_queue_try_pop(lockfree_queue* self)
+{
+    size_t mask = self->lf_capacity - 1;
+    lockfree_cell* cell;
+    PyObject* element;
+    size_t head;
+    size_t sequence;
+    ptrdiff_t turn;
+
+    if (!self->lf_multi) {
+        /* We are the only writer of `lf_head`. Only look at the producer's
+           `lf_tail` when our cached copy says the ring is empty. */
+        head = atomic_load_explicit(&self->lf_head, memory_order_relaxed);
+        if (head == self->lf_cached_tail) {
+            self->lf_cached_tail =
+                atomic_load_explicit(&self->lf_tail, memory_order_acquire);
+            if (head == self->lf_cached_tail) {
+                return NULL;
+            }
+        }
+
+        element = self->lf_cells[head & mask].c_element;
+        self->lf_cells[head & mask].c_element = NULL;
+        /* give the cell back to the producer */
+        atomic_store_explicit(&self->lf_head, head + 1, memory_order_release);
+        return element;
+    }
+
+    head = atomic_load_explicit(&self->lf_head, memory_order_relaxed);
+    for (;;) {
+        cell = &self->lf_cells[head & mask];
+        sequence = atomic_load_explicit(&cell->c_sequence, memory_order_acquire);
+        turn = (ptrdiff_t) (sequence - (head + 1));
+
+        if (turn == 0) {
+            /* the cell is full and it is our turn, try to claim it */
+            if (atomic_compare_exchange_weak_explicit(&self->lf_head,
+                                                      &head,
+                                                      head + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (turn < 0) {
+            /* nothing has been pushed into this cell yet */
+            return NULL;
+        }
+        else {
+            /* another consumer claimed this cell, try the next one */
+            head = atomic_load_explicit(&self->lf_head, memory_order_relaxed);
+        }
+    }
+
+    element = cell->c_element;
+    cell->c_element = NULL;
+    /* the cell is ready for the push one lap from now */
+    atomic_store_explicit(&cell->c_sequence,
+                          head + self->lf_capacity,
+                          memory_order_release);
+    return element;
+}
+
+static int
+lockfree_queue_clear(lockfree_queue* self)
+{
+    PyObject* element;
+
+    /* `tp_clear` and `tp_dealloc` only run when no other thread can be
+       using the queue */
+    if (self->lf_cells) {
+        while ((element = lockfree_queue_try_pop(self))) {
+            Py_DECREF(element);
+        }
+    }
+    return 0;
+}
+
+static void
+lockfree_queue_dealloc(lockfree_queue* self)
+{
+    PyObject_GC_UnTrack(self);
+    lockfree_queue_clear(self);
+    PyMem_Free(self->lf_cells);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static int
+lockfree_queue_traverse(lockfree_queue* self, visitproc visit, void* arg)
+{
+    size_t n;
+
+    /* The gc runs with the GIL held, or with the world stopped on the
+       free-threaded build, so no push or pop is half done. Every element is
+       in a cell between the head and the tail. */
+    if (self->lf_cells) {
+        for (n = atomic_load(&self->lf_head); n != atomic_load(&self->lf_tail); ++n) {
+            Py_VISIT(self->lf_cells[n & (self->lf_capacity - 1)].c_element);
+        }
+    }
+    return 0;
+}
+
+static Py_ssize_t
+lockfree_queue_size(lockfree_queue* self)
+{
+    /* Read the head first. The tail can only move forward after that, so the
+       difference is never negative. With other threads running this is only
+       a snapshot. */
+    size_t head = atomic_load_explicit(&self->lf_head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&self->lf_tail, memory_order_acquire);
+
+    if (tail - head > self->lf_capacity) {
+        return (Py_ssize_t) self->lf_capacity;
+    }
+    return (Py_ssize_t) (tail - head);
+}
+
+static PyObject*
+lockfree_queue_repr(lockfree_queue* self)
+{
+    return PyUnicode_FromFormat("<%s: %zd/%zd>",
+                                Py_TYPE(self)->tp_name,
+                                lockfree_queue_size(self),
+                                (Py_ssize_t) self->lf_capacity);
+}
+
+PyDoc_STRVAR(lockfree_queue_push_doc,
+             "Push an element onto the end of the queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "element : any\n"
+             "    The element to push.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Full\n"
+             "    Raised when the queue is full. Lock-free queues never\n"
+             "    block.\n");
+
+static PyObject*
+lockfree_queue_push(lockfree_queue* self, PyObject* element)
+{
+    if (!lockfree_queue_try_push(self, element)) {
+        PyErr_SetString(queue_full_error, "full");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(lockfree_queue_pop_doc,
+             "Remove and return the element at the front of the queue.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Empty\n"
+             "    Raised when the queue is empty. Lock-free queues never\n"
+             "    block.\n");
+
+static PyObject*
+lockfree_queue_pop(lockfree_queue* self, PyObject* unused)
+{
+    PyObject* element = lockfree_queue_try_pop(self);
+
+    if (!element) {
+        PyErr_SetString(queue_empty_error, "empty");
+    }
+    return element;
+}
+
+PyMethodDef lockfree_queue_methods[] = {
+    {"push",
+     (PyCFunction) lockfree_queue_push,
+     METH_O,
+     lockfree_queue_push_doc},
+    {"pop",
+     (PyCFunction) lockfree_queue_pop,
+     METH_NOARGS,
+     lockfree_queue_pop_doc},
+    {NULL},
+};
+
+PySequenceMethods lockfree_queue_as_sequence = {
+    (lenfunc) lockfree_queue_size,              /* sq_length */
+};
+
+static PyObject*
+lockfree_queue_get_maxsize(lockfree_queue* self, void* context)
+{
+    return PyLong_FromSize_t(self->lf_capacity);
+}
+
+PyGetSetDef lockfree_queue_getset[] = {
+    {"maxsize",
+     (getter) lockfree_queue_get_maxsize,
+     NULL,  /* setter */
+     "The capacity of the ring. This is the requested maxsize rounded up\n"
+     "to a power of 2.",
+     NULL   /* closure */},
+    {NULL},
+};
+
+PyDoc_STRVAR(spsc_queue_doc,
+             "A lock-free queue for one producer thread and one consumer\n"
+             "thread.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "maxsize : int\n"
+             "    The number of elements the queue can hold, rounded up to a\n"
+             "    power of 2.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "On the free-threaded build at most one thread may call\n"
+             "``push`` and at most one thread may call ``pop`` at a time. Use\n"
+             "``MPMCQueue`` when there are more.\n");
+
+static PyTypeObject spsc_queue_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.SPSCQueue",                          /* tp_name */
+    sizeof(lockfree_queue),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) lockfree_queue_dealloc,        /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    (reprfunc) lockfree_queue_repr,             /* tp_repr */
+    0,                                          /* tp_as_number */
+    &lockfree_queue_as_sequence,                /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,                         /* tp_flags */
+    spsc_queue_doc,                             /* tp_doc */
+    (traverseproc) lockfree_queue_traverse,     /* tp_traverse */
+    (inquiry) lockfree_queue_clear,             /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    lockfree_queue_methods,                     /* tp_methods */
+    0,                                          /* tp_members */
+    lockfree_queue_getset,                      /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    0,                                          /* tp_init */
+    0,                                          /* tp_alloc */
+    (newfunc) lockfree_queue_new,               /* tp_new */
+};
+
+PyDoc_STRVAR(mpmc_queue_doc,
+             "A lock-free queue for any number of producer and consumer\n"
+             "threads.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "maxsize : int\n"
+             "    The number of elements the queue can hold, rounded up to a\n"
+             "    power of 2 of at least 2.\n");
+
+static PyTypeObject mpmc_queue_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.MPMCQueue",                          /* tp_name */
+    sizeof(lockfree_queue),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) lockfree_queue_dealloc,        /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    (reprfunc) lockfree_queue_repr,             /* tp_repr */
+    0,                                          /* tp_as_number */
+    &lockfree_queue_as_sequence,                /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,                         /* tp_flags */
+    mpmc_queue_doc,                             /* tp_doc */
+    (traverseproc) lockfree_queue_traverse,     /* tp_traverse */
+    (inquiry) lockfree_queue_clear,             /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    lockfree_queue_methods,                     /* tp_methods */
+    0,                                          /* tp_members */
+    lockfree_queue_getset,                      /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    0,                                          /* tp_init */
+    0,                                          /* tp_alloc */
+    (newfunc) lockfree_queue_new,               /* tp_new */
+};
+
+#ifdef QUEUE_HAVE_SHARED
+/* A shared queue keeps its ring of byte records in a memfd mapping so forked
+   or cooperating processes can pass bytes to each other without pickling or
+   pipes. All of the queue's state lives in the mapping: a header with the
+   cursors and a futex based lock, followed by the record area.
+
+   Each record is an 8 byte `shared_record_header` followed by its payload,
+   padded to a multiple of 8. A record never wraps around the end of the
+   area; if it doesn't fit, a padding record fills the rest of the area and
+   the record starts again at offset 0. This keeps every payload contiguous
+   so `pop` can return a memoryview straight into the mapping.
+
+   Popping a record doesn't free its space. The memoryview keeps pointing
+   into the mapping until it is released, at which point the record is marked
+   released. The space between `sh_head` and `sh_read` is popped records, and
+   `sh_head` advances over them once they are all released in order. */
+
+#define SHARED_QUEUE_MAGIC 0x657565755173ULL   /* "sQueue" */
+#define SHARED_QUEUE_MIN_CAPACITY 64
+
+/* `r_flags` bits */
+#define SHARED_RECORD_RELEASED 0x1  /* the space can be reused */
+#define SHARED_RECORD_PADDING 0x2   /* filler at the end of the area */
+
+typedef struct {
+    uint32_t r_length;          /* the payload size in bytes */
+    uint32_t r_flags;           /* `SHARED_RECORD_*` bits */
+} shared_record_header;
+
+typedef struct {
+    uint64_t sh_magic;          /* `SHARED_QUEUE_MAGIC` */
+    uint64_t sh_capacity;       /* the size of the record area, a power of 2 */
+
+    /* The futex words must be 32 bits. `sh_lock` is 0 when unlocked, 1 when
+       locked, and 2 when locked with waiters. The other two are event
+       counters which are bumped to wake up blocked `pop` and `push` calls. */
+    atomic_uint sh_lock;
+    atomic_uint sh_pushed;      /* bumped when a record is pushed */
+    atomic_uint sh_freed;       /* bumped when a record is popped or released */
+
+    /* everything below is only touched while holding `sh_lock` */
+    uint32_t sh_getters;        /* the number of processes waiting in `pop` */
+    uint32_t sh_putters;        /* the number of processes waiting in `push` */
+    int64_t sh_maxsize;         /* the maximum number of records, -1 for none */
+    uint64_t sh_head;           /* the start of the oldest unreleased record */
+    uint64_t sh_read;           /* the start of the next record to pop */
+    uint64_t sh_tail;           /* the end of the newest record */
+    uint64_t sh_count;          /* the number of records pushed and not popped */
+} shared_header;
+
+/* the record area starts on its own cache line after the header */
+#define SHARED_QUEUE_HEADER_SIZE                                        \
+    ((sizeof(shared_header) + LOCKFREE_CACHE_LINE - 1) &                \
+     ~(size_t) (LOCKFREE_CACHE_LINE - 1))
+
+typedef struct {
+    PyObject sq_base;           /* storage for our type and reference count */
+    int sq_fd;                  /* the memfd backing the mapping */
+    size_t sq_map_size;         /* the size of the mapping */
+    shared_header* sq_header;   /* the start of the mapping */
+    char* sq_records;           /* the record area */
+} shared_queue;
+
+/* A `SharedRecord` owns one popped record. It exports the payload with the
+   buffer protocol and marks the record released when it is deallocated. */
+typedef struct {
+    PyObject sr_base;           /* storage for our type and reference count */
+    shared_queue* sr_queue;     /* keeps the mapping alive */
+    uint64_t sr_offset;         /* the offset of the record's header */
+} shared_record;
+
+static PyTypeObject shared_queue_type;
+static PyTypeObject shared_record_type;
+
+/* the header of the record at cursor `pos` */
+#define SHARED_RECORD(self, pos)                                        \
+    ((shared_record_header*) ((self)->sq_records +                      \
+                              ((pos) & ((self)->sq_header->sh_capacity - 1))))
+
+/* the number of bytes a record with a `length` byte payload takes */
+#define SHARED_RECORD_SIZE(length)                                      \
+    (sizeof(shared_record_header) + (((uint64_t) (length) + 7) & ~(uint64_t) 7))
+
+static long
+shared_futex(atomic_uint* word, int op, unsigned int value,
+             const struct timespec* timeout)
+{
+    /* not `FUTEX_PRIVATE_FLAG`, the word is shared between processes */
+    return syscall(SYS_futex, (uint32_t*) word, op, value, timeout, NULL, 0);
+}
+
+/* Take the lock in the shared header. This is Ulrich Drepper's three state
+   futex mutex: an uncontended lock and unlock are one atomic operation each
+   and only contended ones make a system call. The lock is never held while
+   running Python code or while the GIL is released so the hold times are
+   short. */
+static void
+shared_queue_lock(shared_queue* self)
+{
+    atomic_uint* lock = &self->sq_header->sh_lock;
+    unsigned int state = 0;
+
+    if (atomic_compare_exchange_strong(lock, &state, 1)) {
+        return;
+    }
+
+    if (state != 2) {
+        state = atomic_exchange(lock, 2);
+    }
+    while (state) {
+        shared_futex(lock, FUTEX_WAIT, 2, NULL);
+        state = atomic_exchange(lock, 2);
+    }
+}
+
+static void
+shared_queue_unlock(shared_queue* self)
+{
+    atomic_uint* lock = &self->sq_header->sh_lock;
+
+    if (atomic_fetch_sub(lock, 1) != 1) {
+        /* somebody is waiting */
+        atomic_store(lock, 0);
+        shared_futex(lock, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+/* Bump the event counter `word` and return whether anyone needs waking. This
+   must be called while holding the lock; the wake up itself is done after
+   unlocking with `shared_queue_notify`. */
+static int
+shared_queue_bump(atomic_uint* word, uint32_t waiters)
+{
+    atomic_fetch_add(word, 1);
+    return waiters != 0;
+}
+
+static void
+shared_queue_notify(atomic_uint* word)
+{
+    shared_futex(word, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/* Wait with the GIL released until the event counter `word` moves past
+   `seen`, `deadline` passes, or it is time to check for signals. The caller
+   must hold the lock, must have registered itself as a waiter, and must
+   re-check the queue when this returns 0. The lock is released while waiting
+   and held again on return.
+
+   Returns 1 if the deadline has passed, 0 if the caller should check again,
+   and -1 with an exception set if a signal handler raised. */
+static int
+shared_queue_wait(shared_queue* self,
+                  atomic_uint* word,
+                  const struct timespec* deadline)
+{
+    struct timespec now;
+    struct timespec wait;
+    unsigned int seen = atomic_load(word);
+    int status = 0;
+
+    shared_queue_unlock(self);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (deadline &&
+        (now.tv_sec > deadline->tv_sec ||
+         (now.tv_sec == deadline->tv_sec &&
+          now.tv_nsec >= deadline->tv_nsec))) {
+        status = 1;
+    }
+    else {
+        /* `FUTEX_WAIT` takes a relative timeout; never sleep past the next
+           signal check */
+        wait.tv_sec = 0;
+        wait.tv_nsec = QUEUE_SIGNAL_CHECK_INTERVAL;
+        if (deadline) {
+            struct timespec left;
+
+            left.tv_sec = deadline->tv_sec - now.tv_sec;
+            left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0) {
+                left.tv_sec -= 1;
+                left.tv_nsec += 1000000000L;
+            }
+            if (left.tv_sec == 0 && left.tv_nsec < wait.tv_nsec) {
+                wait = left;
+            }
+        }
+
+        /* If another process bumps `word` after we read `seen`, the kernel
+           sees the new value and returns straight away, so no wake up is
+           lost. */
+        Py_BEGIN_ALLOW_THREADS
+        shared_futex(word, FUTEX_WAIT, seen, &wait);
+        Py_END_ALLOW_THREADS
+
+        if (PyErr_CheckSignals()) {
+            status = -1;
+        }
+    }
+
+    shared_queue_lock(self);
+    return status;
+}
+
+/* Map the queue in `fd` and wrap it in a new `SharedQueue`. Takes ownership
+   of `fd`. */
+static PyObject*
+shared_queue_map(PyTypeObject* cls, int fd, size_t map_size)
+{
+    shared_queue* self;
+    void* map;
+
+    if (!(self = (shared_queue*) cls->tp_alloc(cls, 0))) {
+        close(fd);
+        return NULL;
+    }
+    self->sq_fd = fd;
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(self);
+        return NULL;
+    }
+    self->sq_map_size = map_size;
+    self->sq_header = (shared_header*) map;
+    self->sq_records = (char*) map + SHARED_QUEUE_HEADER_SIZE;
+
+    return (PyObject*) self;
+}
+
+static PyObject*
+shared_queue_new(PyTypeObject* cls, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"capacity", "maxsize", NULL};
+
+    shared_queue* self;
+    Py_ssize_t requested = 1 << 20;
+    Py_ssize_t maxsize = -1;
+    uint64_t capacity = SHARED_QUEUE_MIN_CAPACITY;
+    size_t map_size;
+    int fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|nn:SharedQueue",
+                                     keywords,
+                                     &requested,
+                                     &maxsize)) {
+        return NULL;
+    }
+
+    /* a negative capacity would turn into a huge unsigned one below */
+    if (requested <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "a SharedQueue needs a positive capacity");
+        return NULL;
+    }
+
+    /* cursors are mapped into the record area with a mask */
+    while (capacity < (uint64_t) requested) {
+        if (capacity > (uint64_t) PY_SSIZE_T_MAX / 4) {
+            return PyErr_NoMemory();
+        }
+        capacity *= 2;
+    }
+    map_size = SHARED_QUEUE_HEADER_SIZE + capacity;
+
+    if ((fd = memfd_create("queue.SharedQueue", MFD_CLOEXEC)) < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    /* a new memfd is zero filled so every counter starts at 0 */
+    if (ftruncate(fd, (off_t) map_size)) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        close(fd);
+        return NULL;
+    }
+
+    if (!(self = (shared_queue*) shared_queue_map(cls, fd, map_size))) {
+        return NULL;
+    }
+    self->sq_header->sh_capacity = capacity;
+    self->sq_header->sh_maxsize = (maxsize <= 0) ? -1 : maxsize;
+    self->sq_header->sh_magic = SHARED_QUEUE_MAGIC;
+
+    return (PyObject*) self;
+}
+
+PyDoc_STRVAR(shared_queue_attach_doc,
+             "Open the shared queue in another process's file descriptor.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "fd : int\n"
+             "    A file descriptor for the queue's memory, as returned by\n"
+             "    ``fileno()`` and passed to this process, for example with\n"
+             "    ``socket.send_fds`` or ``subprocess.Popen(pass_fds=...)``.\n"
+             "    The descriptor is duplicated; the caller still owns ``fd``.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "queue : SharedQueue\n"
+             "    A queue sharing its contents with every other process\n"
+             "    attached to it.\n");
+
+static PyObject*
+shared_queue_attach(PyTypeObject* cls, PyObject* fd_ob)
+{
+    shared_header header;
+    struct stat st;
+    int fd;
+
+    if ((fd = PyObject_AsFileDescriptor(fd_ob)) < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st)) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if ((size_t) st.st_size < SHARED_QUEUE_HEADER_SIZE ||
+        pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        header.sh_magic != SHARED_QUEUE_MAGIC ||
+        (header.sh_capacity & (header.sh_capacity - 1)) ||
+        (uint64_t) st.st_size != SHARED_QUEUE_HEADER_SIZE + header.sh_capacity) {
+        PyErr_SetString(PyExc_ValueError,
+                        "file descriptor does not hold a SharedQueue");
+        return NULL;
+    }
+
+    if ((fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return shared_queue_map(cls, fd, (size_t) st.st_size);
+}
+
+static void
+shared_queue_dealloc(shared_queue* self)
+{
+    /* every popped record holds a reference to us, so no memoryview can
+       still point into the mapping */
+    if (self->sq_header) {
+        munmap(self->sq_header, self->sq_map_size);
+    }
+    if (self->sq_fd >= 0) {
+        close(self->sq_fd);
+    }
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject*
+shared_queue_repr(shared_queue* self)
+{
+    shared_header* header = self->sq_header;
+    Py_ssize_t count;
+    Py_ssize_t maxsize;
+
+    shared_queue_lock(self);
+    count = (Py_ssize_t) header->sh_count;
+    maxsize = (Py_ssize_t) header->sh_maxsize;
+    shared_queue_unlock(self);
+
+    if (maxsize < 0) {
+        return PyUnicode_FromFormat("<%s: %zd>", Py_TYPE(self)->tp_name, count);
+    }
+    return PyUnicode_FromFormat("<%s: %zd/%zd>",
+                                Py_TYPE(self)->tp_name,
+                                count,
+                                maxsize);
+}
+
+/* Check whether a record of `size` bytes fits at the tail right now. Sets
+   `*padding` to the bytes that must be skipped to keep it contiguous. */
+static int
+shared_queue_has_room(shared_queue* self, uint64_t size, uint64_t* padding)
+{
+    shared_header* header = self->sq_header;
+    uint64_t free_bytes;
+    uint64_t until_end;
+
+    if (header->sh_maxsize > 0 &&
+        header->sh_count >= (uint64_t) header->sh_maxsize) {
+        return 0;
+    }
+
+    /* With every record popped and released nothing points into the area,
+       so start over at offset 0. Otherwise a record larger than half the
+       area could never fit after the padding it needs to stay
+       contiguous. */
+    if (header->sh_head == header->sh_tail) {
+        header->sh_tail = (header->sh_tail + header->sh_capacity - 1) &
+                          ~(header->sh_capacity - 1);
+        header->sh_read = header->sh_head = header->sh_tail;
+    }
+
+    free_bytes = header->sh_capacity - (header->sh_tail - header->sh_head);
+    until_end =
+        header->sh_capacity - (header->sh_tail & (header->sh_capacity - 1));
+
+    *padding = (size > until_end) ? until_end : 0;
+    return free_bytes >= *padding + size;
+}
+
+PyDoc_STRVAR(shared_queue_push_doc,
+             "Copy a bytes-like object onto the end of the queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "data : bytes-like\n"
+             "    The payload to push.\n"
+             "block : bool, optional\n"
+             "    Wait for space if the queue is full. Defaults to True.\n"
+             "timeout : float, optional\n"
+             "    The most seconds to wait for space. ``None`` waits forever.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Full\n"
+             "    Raised when the queue is still full after waiting.\n"
+             "ValueError\n"
+             "    Raised when ``data`` is too large to ever fit.\n");
+
+static PyObject*
+shared_queue_push(shared_queue* self,
+                  PyObject* const* args,
+                  Py_ssize_t nargs,
+                  PyObject* kwnames)
+{
+    static const char* const keywords[] = {"data", "block", "timeout", NULL};
+    shared_header* header = self->sq_header;
+    PyObject* argv[3];
+    int block = 1;
+    PyObject* timeout = NULL;
+    struct timespec deadline;
+    int has_deadline = 0;
+    Py_buffer data;
+    uint64_t size;
+    uint64_t padding;
+    shared_record_header* record;
+    int timed_out = 0;
+    int status;
+    int wake;
+
+    if (queue_unpack_args("push", args, nargs, kwnames, keywords, 1, argv)) {
+        return NULL;
+    }
+    if (argv[1] && (block = PyObject_IsTrue(argv[1])) < 0) {
+        return NULL;
+    }
+    timeout = argv[2];
+
+    if (block && queue_deadline(timeout, &deadline, &has_deadline)) {
+        return NULL;
+    }
+
+    if (PyObject_GetBuffer(argv[0], &data, PyBUF_SIMPLE)) {
+        return NULL;
+    }
+
+    size = SHARED_RECORD_SIZE(data.len);
+    if ((uint64_t) data.len > UINT32_MAX || size > header->sh_capacity) {
+        PyErr_Format(PyExc_ValueError,
+                     "a record of %zd bytes does not fit in a queue of %llu "
+                     "bytes",
+                     data.len,
+                     (unsigned long long) header->sh_capacity);
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+
+    shared_queue_lock(self);
+    while (!shared_queue_has_room(self, size, &padding)) {
+        if (!block || timed_out) {
+            shared_queue_unlock(self);
+            PyBuffer_Release(&data);
+            PyErr_SetString(queue_full_error, "full");
+            return NULL;
+        }
+
+        ++header->sh_putters;
+        status = shared_queue_wait(self,
+                                   &header->sh_freed,
+                                   has_deadline ? &deadline : NULL);
+        --header->sh_putters;
+        if (status < 0) {
+            shared_queue_unlock(self);
+            PyBuffer_Release(&data);
+            return NULL;
+        }
+        /* check one last time after the deadline passes */
+        timed_out = status;
+    }
+
+    if (padding) {
+        /* fill the rest of the area so the record starts at offset 0 */
+        record = SHARED_RECORD(self, header->sh_tail);
+        record->r_length = (uint32_t) (padding - sizeof(shared_record_header));
+        record->r_flags = SHARED_RECORD_PADDING | SHARED_RECORD_RELEASED;
+        header->sh_tail += padding;
+    }
+
+    record = SHARED_RECORD(self, header->sh_tail);
+    record->r_length = (uint32_t) data.len;
+    record->r_flags = 0;
+    memcpy(record + 1, data.buf, data.len);
+    header->sh_tail += size;
+    ++header->sh_count;
+
+    wake = shared_queue_bump(&header->sh_pushed, header->sh_getters);
+    shared_queue_unlock(self);
+    PyBuffer_Release(&data);
+
+    if (wake) {
+        shared_queue_notify(&header->sh_pushed);
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(shared_queue_pop_doc,
+             "Remove the record at the front of the queue.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "block : bool, optional\n"
+             "    Wait for a record if the queue is empty. Defaults to True.\n"
+             "timeout : float, optional\n"
+             "    The most seconds to wait for a record. ``None`` waits\n"
+             "    forever.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "data : memoryview\n"
+             "    A read-only view of the payload in the shared mapping. No\n"
+             "    copy is made. The record's space is reused once the view is\n"
+             "    released, so release it, or copy it with ``bytes(data)``,\n"
+             "    when done to keep the queue from filling up.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Empty\n"
+             "    Raised when the queue is still empty after waiting.\n");
+
+static PyObject*
+shared_queue_pop(shared_queue* self,
+                 PyObject* const* args,
+                 Py_ssize_t nargs,
+                 PyObject* kwnames)
+{
+    static const char* const keywords[] = {"block", "timeout", NULL};
+    shared_header* header = self->sq_header;
+    PyObject* argv[2];
+    int block = 1;
+    PyObject* timeout = NULL;
+    struct timespec deadline;
+    int has_deadline = 0;
+    shared_record* owner;
+    shared_record_header* record;
+    PyObject* view;
+    int timed_out = 0;
+    int status;
+    int wake;
+
+    if (nargs || kwnames) {
+        if (queue_unpack_args("pop", args, nargs, kwnames, keywords, 0, argv)) {
+            return NULL;
+        }
+        if (argv[0] && (block = PyObject_IsTrue(argv[0])) < 0) {
+            return NULL;
+        }
+        timeout = argv[1];
+    }
+
+    if (block && queue_deadline(timeout, &deadline, &has_deadline)) {
+        return NULL;
+    }
+
+    /* allocate the owner first so nothing can fail after the record is
+       taken */
+    if (!(owner = PyObject_New(shared_record, &shared_record_type))) {
+        return NULL;
+    }
+    owner->sr_queue = NULL;
+
+    shared_queue_lock(self);
+    while (!header->sh_count) {
+        if (!block || timed_out) {
+            shared_queue_unlock(self);
+            Py_DECREF(owner);
+            PyErr_SetString(queue_empty_error, "empty");
+            return NULL;
+        }
+
+        ++header->sh_getters;
+        status = shared_queue_wait(self,
+                                   &header->sh_pushed,
+                                   has_deadline ? &deadline : NULL);
+        --header->sh_getters;
+        if (status < 0) {
+            shared_queue_unlock(self);
+            Py_DECREF(owner);
+            return NULL;
+        }
+        timed_out = status;
+    }
+
+    /* skip the padding at the end of the area */
+    record = SHARED_RECORD(self, header->sh_read);
+    if (record->r_flags & SHARED_RECORD_PADDING) {
+        header->sh_read += SHARED_RECORD_SIZE(record->r_length);
+        record = SHARED_RECORD(self, header->sh_read);
+    }
+
+    owner->sr_offset = header->sh_read;
+    header->sh_read += SHARED_RECORD_SIZE(record->r_length);
+    --header->sh_count;
+
+    /* the space isn't free until the record is released, but there may be
+       room under `maxsize` now */
+    wake = shared_queue_bump(&header->sh_freed, header->sh_putters);
+    shared_queue_unlock(self);
+
+    if (wake) {
+        shared_queue_notify(&header->sh_freed);
+    }
+
+    Py_INCREF(self);
+    owner->sr_queue = self;
+
+    /* the memoryview holds the only reference to `owner`, which releases the
+       record when the view is released */
+    view = PyMemoryView_FromObject((PyObject*) owner);
+    Py_DECREF(owner);
+    return view;
+}
+
+/* Mark the record at `offset` released and give back the space of every
+   released record at the head of the area. */
+static void
+shared_queue_release(shared_queue* self, uint64_t offset)
+{
+    shared_header* header = self->sq_header;
+    shared_record_header* record;
+    uint64_t head;
+    int wake = 0;
+
+    shared_queue_lock(self);
+    SHARED_RECORD(self, offset)->r_flags |= SHARED_RECORD_RELEASED;
+
+    head = header->sh_head;
+    while (head != header->sh_read) {
+        record = SHARED_RECORD(self, head);
+        if (!(record->r_flags & SHARED_RECORD_RELEASED)) {
+            /* an older record is still in use */
+            break;
+        }
+        head += SHARED_RECORD_SIZE(record->r_length);
+    }
+    if (head != header->sh_head) {
+        header->sh_head = head;
+        wake = shared_queue_bump(&header->sh_freed, header->sh_putters);
+    }
+    shared_queue_unlock(self);
+
+    if (wake) {
+        shared_queue_notify(&header->sh_freed);
+    }
+}
+
+PyDoc_STRVAR(shared_queue_fileno_doc,
+             "Return the file descriptor of the queue's shared memory.\n"
+             "\n"
+             "Pass it to another process and call ``SharedQueue.attach`` to\n"
+             "open the same queue there. Forked children share the queue\n"
+             "without this.\n");
+
+static PyObject*
+shared_queue_fileno(shared_queue* self, PyObject* unused)
+{
+    return PyLong_FromLong(self->sq_fd);
+}
+
+PyMethodDef shared_queue_methods[] = {
+    {"push",
+     (PyCFunction) (void (*)(void)) shared_queue_push,
+     METH_FASTCALL | METH_KEYWORDS,
+     shared_queue_push_doc},
+    {"pop",
+     (PyCFunction) (void (*)(void)) shared_queue_pop,
+     METH_FASTCALL | METH_KEYWORDS,
+     shared_queue_pop_doc},
+    {"fileno",
+     (PyCFunction) shared_queue_fileno,
+     METH_NOARGS,
+     shared_queue_fileno_doc},
+    {"attach",
+     (PyCFunction) shared_queue_attach,
+     METH_O | METH_CLASS,
+     shared_queue_attach_doc},
+    {NULL},
+};
+
+static Py_ssize_t
+shared_queue_size(shared_queue* self)
+{
+    Py_ssize_t count;
+
+    shared_queue_lock(self);
+    count = (Py_ssize_t) self->sq_header->sh_count;
+    shared_queue_unlock(self);
+    return count;
+}
+
+PySequenceMethods shared_queue_as_sequence = {
+    (lenfunc) shared_queue_size,                /* sq_length */
+};
+
+static PyObject*
+shared_queue_get_maxsize(shared_queue* self, void* context)
+{
+    Py_ssize_t maxsize;
+
+    shared_queue_lock(self);
+    maxsize = (Py_ssize_t) self->sq_header->sh_maxsize;
+    shared_queue_unlock(self);
+    return PyLong_FromSsize_t(maxsize);
+}
+
+static int
+shared_queue_set_maxsize(shared_queue* self, PyObject* value_ob, void* context)
+{
+    shared_header* header = self->sq_header;
+    Py_ssize_t value = PyLong_AsSsize_t(value_ob);
+    int wake;
+
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+
+    shared_queue_lock(self);
+    if (value > 0 && (uint64_t) value < header->sh_count) {
+        shared_queue_unlock(self);
+        PyErr_SetString(PyExc_ValueError,
+                        "cannot drop the maxsize below the current size");
+        return -1;
+    }
+    header->sh_maxsize = (value <= 0) ? -1 : value;
+    wake = shared_queue_bump(&header->sh_freed, header->sh_putters);
+    shared_queue_unlock(self);
+
+    if (wake) {
+        shared_queue_notify(&header->sh_freed);
+    }
+    return 0;
+}
+
+static PyObject*
+shared_queue_get_capacity(shared_queue* self, void* context)
+{
+    return PyLong_FromUnsignedLongLong(self->sq_header->sh_capacity);
+}
+
+PyGetSetDef shared_queue_getset[] = {
+    {"maxsize",
+     (getter) shared_queue_get_maxsize,
+     (setter) shared_queue_set_maxsize,
+     NULL,  /* doc */
+     NULL   /* closure */},
+    {"capacity",
+     (getter) shared_queue_get_capacity,
+     NULL,  /* setter */
+     "The size in bytes of the record area.",
+     NULL   /* closure */},
+    {NULL},
+};
+
+PyDoc_STRVAR(shared_queue_doc,
+             "A queue of byte records in shared memory.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "capacity : int, optional\n"
+             "    The positive number of bytes of shared memory for records,\n"
+             "    rounded up to a power of 2. Each record takes 8 bytes plus\n"
+             "    its payload rounded up to a multiple of 8. Defaults to\n"
+             "    1 MiB.\n"
+             "maxsize : int, optional\n"
+             "    The most records in the queue at once. Defaults to no limit\n"
+             "    besides ``capacity``.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "The queue lives in a memfd mapping which is inherited by forked\n"
+             "children, or can be opened elsewhere with ``attach``. Blocked\n"
+             "calls sleep on futexes in the mapping so processes wake each\n"
+             "other up directly. A process which exits while holding a view\n"
+             "from ``pop`` never releases that record's space.\n");
+
+static PyTypeObject shared_queue_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.SharedQueue",                        /* tp_name */
+    sizeof(shared_queue),                       /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) shared_queue_dealloc,          /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    (reprfunc) shared_queue_repr,               /* tp_repr */
+    0,                                          /* tp_as_number */
+    &shared_queue_as_sequence,                  /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    shared_queue_doc,                           /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    shared_queue_methods,                       /* tp_methods */
+    0,                                          /* tp_members */
+    shared_queue_getset,                        /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    0,                                          /* tp_init */
+    0,                                          /* tp_alloc */
+    (newfunc) shared_queue_new,                 /* tp_new */
+};
+
+static void
+shared_record_dealloc(shared_record* self)
+{
+    if (self->sr_queue) {
+        shared_queue_release(self->sr_queue, self->sr_offset);
+        Py_DECREF(self->sr_queue);
+    }
+    PyObject_Free(self);
+}
+
+static int
+shared_record_getbuffer(shared_record* self, Py_buffer* view, int flags)
+{
+    shared_record_header* record =
+        SHARED_RECORD(self->sr_queue, self->sr_offset);
+
+    /* other processes may reuse the space once it is released so the view
+       must not outlive us; `view->obj` holds a reference until then */
+    return PyBuffer_FillInfo(view,
+                             (PyObject*) self,
+                             record + 1,
+                             record->r_length,
+                             1,  /* readonly */
+                             flags);
+}
+
+PyBufferProcs shared_record_as_buffer = {
+    (getbufferproc) shared_record_getbuffer,    /* bf_getbuffer */
+    0,                                          /* bf_releasebuffer */
+};
+
+static PyTypeObject shared_record_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "queue.SharedRecord",                       /* tp_name */
+    sizeof(shared_record),                      /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor) shared_record_dealloc,         /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    &shared_record_as_buffer,                   /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "A record popped from a SharedQueue.",      /* tp_doc */
+};
+#endif  /* QUEUE_HAVE_SHARED */
+
+/* A priority queue is a binary min-heap of entries in a plain C array. Each
+   entry remembers its priority three ways: the object itself, for `peek` and
+   `pop` to return, and, when the priority is an exact int that fits in 64
+   bits or an exact float, the unboxed C value. Two entries with unboxed keys
+   of the same kind are compared with one C comparison instead of a
+   `PyObject_RichCompare` call. The sequence number breaks ties so entries
+   with equal priorities come out in the order they were pushed. */
+
+/* how an entry's priority is compared */
+typedef enum {
+    PQ_KEY_OBJECT,              /* `PyObject_RichCompareBool` */
+    PQ_KEY_INT,                 /* `e_key.as_int64` */
+    PQ_KEY_FLOAT,               /* `e_key.as_float64` */
+} pq_key_kind;
+
 typedef struct {
-    PyObject q_base;       /* storage for our type and reference count */
-    Py_ssize_t q_maxsize;  /* the maximum number of elements in q_elements */
-    PyObject* q_elements;  /* the elements in the queue as a Python list */
-} queue;
+    pq_key_kind e_kind;         /* which member of `e_key` is valid, if any */
+    typed_queue_value e_key;    /* the unboxed priority */
+    uint64_t e_seq;             /* the push order, for stable ties */
+    PyObject* e_priority;       /* an owned reference to the priority */
+    PyObject* e_item;           /* an owned reference to the item */
+} pq_entry;
+
+typedef struct {
+    PyObject pq_base;           /* storage for our type and reference count */
+    Py_ssize_t pq_maxsize;      /* the maximum number of entries */
+    pq_entry* pq_entries;       /* the heap, `pq_entries[0]` is the smallest */
+    Py_ssize_t pq_capacity;     /* the number of allocated entries */
+    Py_ssize_t pq_size;         /* the number of entries in the heap */
+    uint64_t pq_seq;            /* the sequence number of the next push */
+    uint64_t pq_version;        /* bumped whenever the heap changes shape */
+} priority_queue;
 
 static PyObject*
-queue_new(PyTypeObject* cls, PyObject* args, PyObject* kwargs)
+priority_queue_new(PyTypeObject* cls, PyObject* args, PyObject* kwargs)
 {
     static char* keywords[] = {"maxsize", NULL};
 
-    queue* self;
+    priority_queue* self;
     Py_ssize_t maxsize = -1;
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "|n:Queue",
+                                     "|n:PriorityQueue",
                                      keywords,
                                      &maxsize)) {
-        /* argument parsing failed */
         return NULL;
     }
 
-    /* Allocate memory for the instance with `tp_alloc`. We are not a varobject
-       so `tp_itemsize` is 0 and we can pass 0 for `nitems`. */
-    if (!(self = (queue*) cls->tp_alloc(cls, 0))) {
-        /* allocation of the instance failed */
+    /* `tp_alloc` zeros the memory so we start with an empty heap */
+    if (!(self = (priority_queue*) cls->tp_alloc(cls, 0))) {
         return NULL;
     }
+    self->pq_maxsize = (maxsize < 0) ? -1 : maxsize;
+    return (PyObject*) self;
+}
 
-    /* Allocate a new empty list to hold the elements. This gives ownership of
-       the list to `self`. */
-    if (!(self->q_elements = PyList_New(0))) {
-        /* allocation of the list failed */
-        Py_DECREF(self);
-        return NULL;
+static int
+priority_queue_clear(priority_queue* self)
+{
+    pq_entry* entries = self->pq_entries;
+    Py_ssize_t size = self->pq_size;
+    Py_ssize_t n;
+
+    /* detach the storage first, like `queue_clear` */
+    self->pq_entries = NULL;
+    self->pq_capacity = 0;
+    self->pq_size = 0;
+    ++self->pq_version;
+
+    for (n = 0; n < size; ++n) {
+        Py_DECREF(entries[n].e_priority);
+        Py_DECREF(entries[n].e_item);
     }
+    PyMem_Free(entries);
+    return 0;
+}
 
-    /* normalize "unlimited" to -1 */
-    if (maxsize < 0) {
-        maxsize = -1;
+static void
+priority_queue_dealloc(priority_queue* self)
+{
+    PyObject_GC_UnTrack(self);
+    priority_queue_clear(self);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static int
+priority_queue_traverse(priority_queue* self, visitproc visit, void* arg)
+{
+    Py_ssize_t n;
+
+    for (n = 0; n < self->pq_size; ++n) {
+        Py_VISIT(self->pq_entries[n].e_priority);
+        Py_VISIT(self->pq_entries[n].e_item);
     }
+    return 0;
+}
 
-    /* store the maxsize on the instance */
-    self->q_maxsize = maxsize;
+static PyObject*
+priority_queue_repr(priority_queue* self)
+{
+    if (self->pq_maxsize < 0) {
+        return PyUnicode_FromFormat("<%s: %zd>",
+                                    Py_TYPE(self)->tp_name,
+                                    self->pq_size);
+    }
 
-    /* erase the type queue c level type information and return to Python as a
-       generic object */
-    return (PyObject*) self;
+    return PyUnicode_FromFormat("<%s: %zd/%zd>",
+                                Py_TYPE(self)->tp_name,
+                                self->pq_size,
+                                self->pq_maxsize);
+}
+
+/* Make room for `needed` entries. */
+static int
+priority_queue_reserve(priority_queue* self, Py_ssize_t needed)
+{
+    Py_ssize_t new_capacity = self->pq_capacity ?
+        self->pq_capacity :
+        QUEUE_MIN_CAPACITY;
+    pq_entry* new_entries;
 
+    if (needed <= self->pq_capacity) {
+        return 0;
+    }
+
+    while (new_capacity < needed) {
+        if (new_capacity > PY_SSIZE_T_MAX / 2 / (Py_ssize_t) sizeof(pq_entry)) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        new_capacity *= 2;
+    }
+
+    if (!(new_entries = PyMem_Resize(self->pq_entries, pq_entry, new_capacity))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->pq_entries = new_entries;
+    self->pq_capacity = new_capacity;
+    return 0;
 }
 
+/* Fill in a new entry for `priority` and `item`, taking new references to
+   both. */
 static void
-queue_dealloc(queue* self)
+priority_queue_entry(priority_queue* self,
+                     pq_entry* entry,
+                     PyObject* priority,
+                     PyObject* item)
 {
-    /* tell the cyclic gc to stop watching our object */
-    PyObject_GC_UnTrack(self);
+    int overflow;
 
-    /* deallocate our elements list */
-    Py_CLEAR(self->q_elements);
+    entry->e_kind = PQ_KEY_OBJECT;
+    if (PyLong_CheckExact(priority)) {
+        entry->e_key.as_int64 = PyLong_AsLongLongAndOverflow(priority,
+                                                             &overflow);
+        /* an int that doesn't fit in 64 bits is compared as an object */
+        if (!overflow) {
+            entry->e_kind = PQ_KEY_INT;
+        }
+    }
+    else if (PyFloat_CheckExact(priority)) {
+        entry->e_key.as_float64 = PyFloat_AS_DOUBLE(priority);
+        entry->e_kind = PQ_KEY_FLOAT;
+    }
 
-    /* deallocate our self */
-    Py_TYPE(self)->tp_free(self);
+    entry->e_seq = self->pq_seq++;
+    Py_INCREF(priority);
+    entry->e_priority = priority;
+    Py_INCREF(item);
+    entry->e_item = item;
 }
 
+/* Check if entry `a` should come out before entry `b`. Returns 1 or 0, or -1
+   with an exception set if comparing the priorities failed.
+
+   Entries are passed by index because comparing objects runs arbitrary code
+   which may push or pop and move the heap. In that case we raise instead of
+   continuing with a heap that is no longer the one we were sorting. */
 static int
-queue_traverse(queue* self, visitproc visit, void* arg)
+priority_queue_less(priority_queue* self, Py_ssize_t a, Py_ssize_t b)
 {
-    /* Visit our elements list. The list's visit function will visit all of
-       the members. */
-    Py_VISIT(self->q_elements);
+    pq_entry* x = &self->pq_entries[a];
+    pq_entry* y = &self->pq_entries[b];
+    PyObject* x_priority;
+    PyObject* y_priority;
+    uint64_t version;
+    int cmp;
 
-    /* 0 means success */
-    return 0;
+    if (x->e_kind == y->e_kind) {
+        /* the fast paths: no objects, no function calls */
+        if (x->e_kind == PQ_KEY_INT) {
+            if (x->e_key.as_int64 != y->e_key.as_int64) {
+                return x->e_key.as_int64 < y->e_key.as_int64;
+            }
+            return x->e_seq < y->e_seq;
+        }
+        if (x->e_kind == PQ_KEY_FLOAT) {
+            if (x->e_key.as_float64 < y->e_key.as_float64) {
+                return 1;
+            }
+            if (y->e_key.as_float64 < x->e_key.as_float64) {
+                return 0;
+            }
+            /* equal, or unordered because of a NaN */
+            return x->e_seq < y->e_seq;
+        }
+    }
+
+    x_priority = x->e_priority;
+    y_priority = y->e_priority;
+    version = self->pq_version;
+
+    /* hold references in case a comparison pops the entries */
+    Py_INCREF(x_priority);
+    Py_INCREF(y_priority);
+    cmp = PyObject_RichCompareBool(x_priority, y_priority, Py_LT);
+    if (!cmp) {
+        /* `x` is not less than `y`: if `y` is less than `x` then `x` comes
+           second, otherwise they are tied */
+        cmp = PyObject_RichCompareBool(y_priority, x_priority, Py_LT);
+        if (cmp >= 0) {
+            cmp = cmp ? 0 : 2;
+        }
+    }
+    Py_DECREF(x_priority);
+    Py_DECREF(y_priority);
+
+    if (cmp < 0) {
+        return -1;
+    }
+    if (version != self->pq_version) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "PriorityQueue changed during a priority comparison");
+        return -1;
+    }
+    if (cmp == 2) {
+        return self->pq_entries[a].e_seq < self->pq_entries[b].e_seq;
+    }
+    return cmp;
+}
+
+static void
+priority_queue_swap(priority_queue* self, Py_ssize_t a, Py_ssize_t b)
+{
+    pq_entry tmp = self->pq_entries[a];
+
+    self->pq_entries[a] = self->pq_entries[b];
+    self->pq_entries[b] = tmp;
 }
 
+/* Move the entry at `pos` towards the root until its parent is smaller. */
 static int
-queue_clear(queue* self)
+priority_queue_sift_up(priority_queue* self, Py_ssize_t pos)
 {
-    /* call the equivalent of `del self->q_elements[:]` in Python to remove all
-       the members of our list which would clear any cycles */
-    if (PyList_SetSlice(self->q_elements,
-                        0,  /* start */
-                        PyList_GET_SIZE(self->q_elements), /* stop */
-                        NULL  /* sequence (NULL means delete */)) {
-        /* nonzero means failure */
-        return 1;
-    }
+    Py_ssize_t parent;
+    int cmp;
 
-    /* 0 means success */
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if ((cmp = priority_queue_less(self, pos, parent)) < 0) {
+            return -1;
+        }
+        if (!cmp) {
+            break;
+        }
+        priority_queue_swap(self, pos, parent);
+        pos = parent;
+    }
     return 0;
 }
 
-static PyObject*
-queue_repr(queue* self)
+/* Move the entry at `pos` towards the leaves until both children are
+   larger. */
+static int
+priority_queue_sift_down(priority_queue* self, Py_ssize_t pos)
 {
-    if (self->q_maxsize < 0) {
-        /* repr which looks like '<queue.Queue: 4>' with 4 elements in the
-           queue */
-        return PyUnicode_FromFormat("<%s: %zd>",
-                                    Py_TYPE(self)->tp_name,
-                                    PyList_GET_SIZE(self->q_elements));
-    }
+    Py_ssize_t child;
+    int cmp;
 
-    return PyUnicode_FromFormat("<%s: %zd/%zd>",
-                                Py_TYPE(self)->tp_name,
-                                PyList_GET_SIZE(self->q_elements),
-                                self->q_maxsize);
+    while ((child = 2 * pos + 1) < self->pq_size) {
+        /* pick the smaller child */
+        if (child + 1 < self->pq_size) {
+            if ((cmp = priority_queue_less(self, child + 1, child)) < 0) {
+                return -1;
+            }
+            child += cmp;
+        }
+
+        if ((cmp = priority_queue_less(self, child, pos)) < 0) {
+            return -1;
+        }
+        if (!cmp) {
+            break;
+        }
+        priority_queue_swap(self, pos, child);
+        pos = child;
+    }
+    return 0;
 }
 
+PyDoc_STRVAR(priority_queue_push_doc,
+             "Push an item with a priority.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "priority : any\n"
+             "    The item's priority. Smaller priorities are popped first.\n"
+             "    Items with equal priorities are popped in push order. Ints\n"
+             "    that fit in 64 bits and floats are compared without calling\n"
+             "    ``__lt__``.\n"
+             "item : any\n"
+             "    The item to push.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Full\n"
+             "    Raised when the queue is full. Priority queues never block.\n");
+
 static PyObject*
-queue_push(queue* self, PyObject* args, PyObject* kwargs)
+priority_queue_push(priority_queue* self,
+                    PyObject* const* args,
+                    Py_ssize_t nargs,
+                    PyObject* kwnames)
 {
-    static char* keywords[] = {"element", NULL};
-    PyObject* element;
+    static const char* const keywords[] = {"priority", "item", NULL};
+    PyObject* argv[2];
 
-    if (self->q_maxsize > 0 &&
-        PyList_GET_SIZE(self->q_elements) == self->q_maxsize) {
-        PyErr_SetString(PyExc_ValueError, "full");
+    if (nargs == 2 && !kwnames) {
+        /* fast path for the common `q.push(priority, item)` */
+        argv[0] = args[0];
+        argv[1] = args[1];
+    }
+    else if (queue_unpack_args("push", args, nargs, kwnames, keywords, 2, argv)) {
         return NULL;
     }
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "O:push",
-                                     keywords,
-                                     &element)) {
+    if (self->pq_maxsize > 0 && self->pq_size >= self->pq_maxsize) {
+        PyErr_SetString(queue_full_error, "full");
         return NULL;
     }
 
-    if (PyList_Append(self->q_elements, element)) {
+    if (priority_queue_reserve(self, self->pq_size + 1)) {
         return NULL;
     }
 
+    priority_queue_entry(self, &self->pq_entries[self->pq_size], argv[0], argv[1]);
+    ++self->pq_size;
+    ++self->pq_version;
+
+    if (priority_queue_sift_up(self, self->pq_size - 1)) {
+        /* the entry stays in the queue, like `heapq.heappush` */
+        return NULL;
+    }
     Py_RETURN_NONE;
 }
 
+/* Build the `(priority, item)` pair returned by `peek` and `pop`, stealing
+   the entry's references if `steal` is set. */
 static PyObject*
-queue_pop(queue* self)
+priority_queue_pair(pq_entry* entry, int steal)
 {
-    PyObject* element;
+    PyObject* pair;
 
-    if (!PyList_GET_SIZE(self->q_elements)) {
-        PyErr_SetString(PyExc_ValueError, "empty");
+    if (!(pair = PyTuple_New(2))) {
         return NULL;
     }
+    if (!steal) {
+        Py_INCREF(entry->e_priority);
+        Py_INCREF(entry->e_item);
+    }
+    PyTuple_SET_ITEM(pair, 0, entry->e_priority);
+    PyTuple_SET_ITEM(pair, 1, entry->e_item);
+    return pair;
+}
 
-    element = PyList_GET_ITEM(self->q_elements, 0);
-    Py_INCREF(element);
+PyDoc_STRVAR(priority_queue_pop_doc,
+             "Remove and return the entry with the smallest priority.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "entry : tuple\n"
+             "    The ``(priority, item)`` pair.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Empty\n"
+             "    Raised when the queue is empty. Priority queues never block.\n");
+
+static PyObject*
+priority_queue_pop(priority_queue* self, PyObject* unused)
+{
+    pq_entry root;
+    PyObject* pair;
 
-    if (PyList_SetSlice(self->q_elements, 0, 1, NULL)) {
-        Py_DECREF(element);
+    if (!self->pq_size) {
+        PyErr_SetString(queue_empty_error, "empty");
         return NULL;
     }
 
-    return element;
+    /* allocate the result first so nothing can fail after the entry is
+       removed, except for a comparison in the sift */
+    if (!(pair = PyTuple_New(2))) {
+        return NULL;
+    }
+
+    root = self->pq_entries[0];
+    --self->pq_size;
+    ++self->pq_version;
+    PyTuple_SET_ITEM(pair, 0, root.e_priority);
+    PyTuple_SET_ITEM(pair, 1, root.e_item);
+
+    if (self->pq_size) {
+        /* move the last leaf to the root and let it sink */
+        self->pq_entries[0] = self->pq_entries[self->pq_size];
+        if (priority_queue_sift_down(self, 0)) {
+            /* the entry is lost, like `heapq.heappop` */
+            Py_DECREF(pair);
+            return NULL;
+        }
+    }
+    return pair;
 }
 
-PyDoc_STRVAR(queue_rotate_doc,
-             "Rotate the members of the queue ``steps`` steps to the right.\n"
+PyDoc_STRVAR(priority_queue_peek_doc,
+             "Return the entry with the smallest priority without removing\n"
+             "it.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "entry : tuple\n"
+             "    The ``(priority, item)`` pair.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "Empty\n"
+             "    Raised when the queue is empty.\n");
+
+static PyObject*
+priority_queue_peek(priority_queue* self, PyObject* unused)
+{
+    if (!self->pq_size) {
+        PyErr_SetString(queue_empty_error, "empty");
+        return NULL;
+    }
+    return priority_queue_pair(&self->pq_entries[0], 0);
+}
+
+PyDoc_STRVAR(priority_queue_push_many_doc,
+             "Push every ``(priority, item)`` pair of an iterable.\n"
              "\n"
              "Parameters\n"
              "----------\n"
-             "steps : int\n"
-             "    The number of steps to rotate the queue.\n");
+             "entries : iterable of tuple\n"
+             "    The ``(priority, item)`` pairs to push. Pairs with equal\n"
+             "    priorities keep their order.\n"
+             "partial : bool, optional\n"
+             "    If the entries don't all fit, push as many as fit instead\n"
+             "    of raising. Defaults to False.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "count : int\n"
+             "    The number of entries pushed.\n"
+             "\n"
+             "Notes\n"
+             "-----\n"
+             "A batch at least as large as the queue is added by rebuilding\n"
+             "the heap in O(n) instead of pushing the entries one at a time.\n");
 
 static PyObject*
-queue_rotate(queue* self, PyObject* args, PyObject* kwargs)
+priority_queue_push_many(priority_queue* self, PyObject* args, PyObject* kwargs)
 {
-    static char* keywords[] = {"steps", NULL};
-
-    Py_ssize_t steps;
+    static char* keywords[] = {"entries", "partial", NULL};
+    PyObject* entries_ob;
+    int partial = 0;
+    PyObject* entries;
+    PyObject* pair;
+    Py_ssize_t count;
+    Py_ssize_t start;
     Py_ssize_t n;
-    Py_ssize_t current_size;
-    PyObject* tmp;
-    PyObject* rotated_elements;
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "n:rotate",
+                                     "O|p:push_many",
                                      keywords,
-                                     &steps)) {
-        /* argument parsing failed */
+                                     &entries_ob,
+                                     &partial)) {
         return NULL;
     }
 
-    current_size = PyList_GET_SIZE(self->q_elements);
-
-    if (!(current_size || steps)) {
-        /* the queue is empty or we are rotating by 0 (identity) */
-        Py_RETURN_NONE;
+    if (!(entries = PySequence_Fast(entries_ob,
+                                    "push_many() argument must be "
+                                    "iterable"))) {
+        return NULL;
     }
+    count = PySequence_Fast_GET_SIZE(entries);
 
-    /* allocate a list with the same size as our queue to hold the newly
-       rotated elements */
-    if (!(rotated_elements = PyList_New(current_size))) {
-        /* allocation failed */
-        return NULL;
+    /* check the shape of every pair before changing anything */
+    for (n = 0; n < count; ++n) {
+        pair = PySequence_Fast_GET_ITEM(entries, n);
+        if (!PyTuple_Check(pair) || PyTuple_GET_SIZE(pair) != 2) {
+            PyErr_Format(PyExc_TypeError,
+                         "push_many() expects (priority, item) pairs, got %R",
+                         pair);
+            Py_DECREF(entries);
+            return NULL;
+        }
     }
 
-    if (steps < 0) {
-        /* c module of -1 % n == -1 for n > 1. rotating left by n is the same as
-           rotating right by size - n so we add the current size to our negative
-           size */
-        steps += current_size;
+    /* one capacity check for the whole batch */
+    if (self->pq_maxsize > 0 && count > self->pq_maxsize - self->pq_size) {
+        if (!partial) {
+            Py_DECREF(entries);
+            PyErr_SetString(queue_full_error, "full");
+            return NULL;
+        }
+        count = self->pq_maxsize - self->pq_size;
     }
 
-    for (n = 0; n < current_size; ++n) {
-        /* map elements in `self->q_elements` at index `n` to elements a index
-           `(n + steps) % current_size` in `rotated_elements`. */
-        tmp = PyList_GET_ITEM(self->q_elements, n);
-        /* `PyList_GET_ITEM` returns a borrowed reference, increment the ref
-           count of `tmp` because `PyList_SET_ITEM` steals the reference */
-        Py_INCREF(tmp);
-        PyList_SET_ITEM(rotated_elements, (n + steps) % current_size, tmp);
+    /* one allocation for the whole batch */
+    if (priority_queue_reserve(self, self->pq_size + count)) {
+        Py_DECREF(entries);
+        return NULL;
     }
 
-    /* release our reference to `q_elements`; we no longer need it */
-    Py_DECREF(self->q_elements);
+    start = self->pq_size;
+    for (n = 0; n < count; ++n) {
+        pair = PySequence_Fast_GET_ITEM(entries, n);
+        priority_queue_entry(self,
+                             &self->pq_entries[start + n],
+                             PyTuple_GET_ITEM(pair, 0),
+                             PyTuple_GET_ITEM(pair, 1));
+    }
+    self->pq_size += count;
+    ++self->pq_version;
+    Py_DECREF(entries);
 
-    /* replace `q_elements` with `rotated_elements`, this gives away our
-       reference to `rotated_elements` */
-    self->q_elements = rotated_elements;
+    if (count >= start) {
+        /* Floyd's heap construction: sift down every internal node from the
+           last one up. This is O(n) for the whole heap, where pushing one
+           at a time is O(k log n) for k new entries. */
+        for (n = self->pq_size / 2 - 1; n >= 0; --n) {
+            if (priority_queue_sift_down(self, n)) {
+                return NULL;
+            }
+        }
+    }
+    else {
+        for (n = start; n < self->pq_size; ++n) {
+            if (priority_queue_sift_up(self, n)) {
+                return NULL;
+            }
+        }
+    }
 
-    Py_RETURN_NONE;
+    return PyLong_FromSsize_t(count);
 }
 
-PyMethodDef queue_methods[] = {
-    {"push", (PyCFunction) queue_push, METH_VARARGS | METH_KEYWORDS, NULL},
-    {"pop", (PyCFunction) queue_pop, METH_NOARGS, NULL},
-    {"rotate",
-     (PyCFunction) queue_rotate,
+QUEUE_DEFINE_LOCKED(priority_queue_push, PyObject*,
+                    (priority_queue* self,
+                     PyObject* const* args,
+                     Py_ssize_t nargs,
+                     PyObject* kwnames),
+                    (self, args, nargs, kwnames))
+QUEUE_DEFINE_LOCKED(priority_queue_pop, PyObject*,
+                    (priority_queue* self, PyObject* unused),
+                    (self, unused))
+QUEUE_DEFINE_LOCKED(priority_queue_peek, PyObject*,
+                    (priority_queue* self, PyObject* unused),
+                    (self, unused))
+QUEUE_DEFINE_LOCKED(priority_queue_push_many, PyObject*,
+                    (priority_queue* self, PyObject* args, PyObject* kwargs),
+                    (self, args, kwargs))
+
+PyMethodDef priority_queue_methods[] = {
+    {"push",
+     (PyCFunction) (void (*)(void)) QUEUE_LOCKED(priority_queue_push),
+     METH_FASTCALL | METH_KEYWORDS,
+     priority_queue_push_doc},
+    {"pop",
+     (PyCFunction) QUEUE_LOCKED(priority_queue_pop),
+     METH_NOARGS,
+     priority_queue_pop_doc},
+    {"peek",
+     (PyCFunction) QUEUE_LOCKED(priority_queue_peek),
+     METH_NOARGS,
+     priority_queue_peek_doc},
+    {"push_many",
+     (PyCFunction) QUEUE_LOCKED(priority_queue_push_many),
      METH_VARARGS | METH_KEYWORDS,
-     queue_rotate_doc},
+     priority_queue_push_many_doc},
     {NULL},
 };
 
 static Py_ssize_t
-queue_size(queue* self)
-{
-    /* return the size of the `q_elements` list */
-    return PyList_GET_SIZE(self->q_elements);
-}
-
-static PyObject*
-queue_item(queue* self, Py_ssize_t ix)
+priority_queue_size(priority_queue* self)
 {
-    /* lookup `ix` in the `q_elements` list with bounds checking */
-    PyObject* element = PyList_GetItem(self->q_elements, ix);
-    /* `PyList_GetItem` returns a borrowed reference. Increment the reference
-       count because `sq_item` needs to return a new reference. If an error
-       occurred, `element` will be NULL. `Py_XINCREF` does a NULL check before
-       incrementing the element. This allows us to safely propagate an error
-       if it is set. */
-    Py_XINCREF(element);
-    return element;
+    return self->pq_size;
 }
 
-static int
-queue_contains(queue* self, PyObject* element)
-{
-    /* defer to `PyListObject`'s sequence protocol implementation for
-       contains */
-    return PySequence_Contains(self->q_elements, element);
-}
+QUEUE_DEFINE_LOCKED(priority_queue_size, Py_ssize_t,
+                    (priority_queue* self),
+                    (self))
 
-PySequenceMethods queue_as_sequence = {
-    (lenfunc) queue_size,                       /* sq_length */
-    0,                                          /* sq_concat */
-    0,                                          /* sq_repeat */
-    (ssizeargfunc) queue_item,                  /* sq_item */
-    0,                                          /* placeholder */
-    0,                                          /* sq_ass_item */
-    0,                                          /* placeholder */
-    (objobjproc) queue_contains,                /* sq_contains */
-    0,                                          /* sq_inplace_concat */
-    0,                                          /* sq_inplace_repeat */
+PySequenceMethods priority_queue_as_sequence = {
+    (lenfunc) QUEUE_LOCKED(priority_queue_size), /* sq_length */
 };
 
 static PyObject*
-queue_get_maxsize(queue* self, void* context)
+priority_queue_get_maxsize(priority_queue* self, void* context)
 {
-    /* simply return the `q_maxsize` boxed as an int object */
-    return PyLong_FromSsize_t(self->q_maxsize);
+    return PyLong_FromSsize_t(self->pq_maxsize);
 }
 
 static int
-queue_set_maxsize(queue* self, PyObject* value_ob, void* context)
+priority_queue_set_maxsize(priority_queue* self,
+                           PyObject* value_ob,
+                           void* context)
 {
     Py_ssize_t value = PyLong_AsSsize_t(value_ob);
     if (PyErr_Occurred()) {
-        /* failed to convert the argument to a `Py_ssize_t`, reraise the
-           error */
         return -1;
     }
 
-    /* normalize "unlimited" to -1 */
-    if (value < 0) {
-        self->q_maxsize = -1;
-        return 0;
-    }
-
-    if (value < PyList_GET_SIZE(self->q_elements)) {
+    if (value >= 0 && value < self->pq_size) {
         PyErr_SetString(PyExc_ValueError,
                         "cannot drop the maxsize below the current size");
-        return 1;
+        return -1;
     }
 
-    self->q_maxsize = value;
+    self->pq_maxsize = (value < 0) ? -1 : value;
     return 0;
 }
 
-PyGetSetDef queue_getset[] = {
+QUEUE_DEFINE_LOCKED(priority_queue_get_maxsize, PyObject*,
+                    (priority_queue* self, void* context),
+                    (self, context))
+QUEUE_DEFINE_LOCKED(priority_queue_set_maxsize, int,
+                    (priority_queue* self, PyObject* value_ob, void* context),
+                    (self, value_ob, context))
+QUEUE_DEFINE_LOCKED(priority_queue_repr, PyObject*,
+                    (priority_queue* self),
+                    (self))
+
+PyGetSetDef priority_queue_getset[] = {
     {"maxsize",
-     (getter) queue_get_maxsize,
-     (setter) queue_set_maxsize,
+     (getter) QUEUE_LOCKED(priority_queue_get_maxsize),
+     (setter) QUEUE_LOCKED(priority_queue_set_maxsize),
      NULL,  /* doc */
      NULL   /* closure */},
     {NULL},
 };
 
-PyDoc_STRVAR(queue_doc, "A simple queue.");
+PyDoc_STRVAR(priority_queue_doc,
+             "A queue which pops the item with the smallest priority first.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "maxsize : int, optional\n"
+             "    The most entries in the queue at once. Defaults to no\n"
+             "    limit.\n");
 
-static PyTypeObject queue_type = {
+static PyTypeObject priority_queue_type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "queue.Queue",                              /* tp_name */
-    sizeof(queue),                              /* tp_basicsize */
+    "queue.PriorityQueue",                      /* tp_name */
+    sizeof(priority_queue),                     /* tp_basicsize */
     0,                                          /* tp_itemsize */
-    (destructor) queue_dealloc,                 /* tp_dealloc */
+    (destructor) priority_queue_dealloc,        /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
     0,                                          /* tp_reserved */
-    (reprfunc) queue_repr,                      /* tp_repr */
+    (reprfunc) QUEUE_LOCKED(priority_queue_repr), /* tp_repr */
     0,                                          /* tp_as_number */
-    &queue_as_sequence,                         /* tp_as_sequence */
+    &priority_queue_as_sequence,                /* tp_as_sequence */
     0,                                          /* tp_as_mapping */
     0,                                          /* tp_hash */
     0,                                          /* tp_call */
@@ -345,16 +7087,16 @@ static PyTypeObject queue_type = {
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT |
     Py_TPFLAGS_HAVE_GC,                         /* tp_flags */
-    queue_doc,                                  /* tp_doc */
-    (traverseproc) queue_traverse,              /* tp_traverse */
-    (inquiry) queue_clear,                      /* tp_clear */
+    priority_queue_doc,                         /* tp_doc */
+    (traverseproc) priority_queue_traverse,     /* tp_traverse */
+    (inquiry) priority_queue_clear,             /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
-    queue_methods,                              /* tp_methods */
+    priority_queue_methods,                     /* tp_methods */
     0,                                          /* tp_members */
-    queue_getset,                               /* tp_getset */
+    priority_queue_getset,                      /* tp_getset */
     0,                                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
@@ -362,7 +7104,17 @@ static PyTypeObject queue_type = {
     0,                                          /* tp_dictoffset */
     0,                                          /* tp_init */
     0,                                          /* tp_alloc */
-    (newfunc) queue_new,                        /* tp_new */
+    (newfunc) priority_queue_new,               /* tp_new */
+};
+
+PyMethodDef queue_module_methods[] = {
+#ifdef QUEUE_STATS
+    {"all_stats",
+     (PyCFunction) queue_all_stats,
+     METH_NOARGS,
+     queue_all_stats_doc},
+#endif
+    {NULL},
 };
 
 PyModuleDef queue_module = {
@@ -370,7 +7122,7 @@ PyModuleDef queue_module = {
     "queue.queue",
     NULL,
     -1,
-    NULL,
+    queue_module_methods,
     NULL,
     NULL,
     NULL,
@@ -382,6 +7134,13 @@ PyMODINIT_FUNC
 PyInit_queue(void) {
     PyObject* m;
 
+#if PY_VERSION_HEX >= 0x03090000
+    /* Let `Queue(...)` skip `tp_new`'s tuple and dict arguments. This slot is
+       far down the `PyTypeObject` struct so we fill it in here instead of in
+       the static initializer. */
+    queue_type.tp_vectorcall = queue_vectorcall;
+#endif
+
     /* 'Ready' the type. This copies functions and data down from our subclass
        so that `queue_type` is in a valid state. */
     if (PyType_Ready(&queue_type)) {
@@ -389,16 +7148,96 @@ PyInit_queue(void) {
         return NULL;
     }
 
+    if (PyType_Ready(&queue_iterator_type) ||
+        PyType_Ready(&queue_drain_type) ||
+        PyType_Ready(&queue_awaitable_type) ||
+        PyType_Ready(&int64_queue_type) ||
+        PyType_Ready(&float64_queue_type) ||
+        PyType_Ready(&spsc_queue_type) ||
+        PyType_Ready(&mpmc_queue_type) ||
+        PyType_Ready(&priority_queue_type)) {
+        return NULL;
+    }
+#ifdef QUEUE_HAVE_SHARED
+    if (PyType_Ready(&shared_queue_type) ||
+        PyType_Ready(&shared_record_type)) {
+        return NULL;
+    }
+#endif
+
     if (!(m = PyModule_Create(&queue_module))) {
         /* failed to allocate the module object */
         return NULL;
     }
 
+#ifdef Py_GIL_DISABLED
+    /* Every type in this module is safe to use without the GIL: `Queue` and
+       the typed queues lock themselves and the lock-free queues only use
+       atomics. Without this the interpreter turns the GIL back on when the
+       module is imported. */
+    if (PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED)) {
+        Py_DECREF(m);
+        return NULL;
+    }
+#endif
+
     if (PyObject_SetAttrString(m, "Queue", (PyObject*) &queue_type)) {
         /* failed to store Queue on the module */
         Py_DECREF(m);
         return NULL;
     }
 
+    if (PyObject_SetAttrString(m, "Int64Queue", (PyObject*) &int64_queue_type) ||
+        PyObject_SetAttrString(m,
+                               "Float64Queue",
+                               (PyObject*) &float64_queue_type) ||
+        PyObject_SetAttrString(m, "SPSCQueue", (PyObject*) &spsc_queue_type) ||
+        PyObject_SetAttrString(m, "MPMCQueue", (PyObject*) &mpmc_queue_type) ||
+        PyObject_SetAttrString(m,
+                               "PriorityQueue",
+                               (PyObject*) &priority_queue_type)) {
+        Py_DECREF(m);
+        return NULL;
+    }
+#ifdef QUEUE_HAVE_SHARED
+    if (PyObject_SetAttrString(m,
+                               "SharedQueue",
+                               (PyObject*) &shared_queue_type)) {
+        Py_DECREF(m);
+        return NULL;
+    }
+#endif
+
+    /* Create the exceptions raised by non-blocking and timed operations. They
+       subclass `ValueError`, which is what `push` and `pop` used to raise, so
+       existing handlers keep working. */
+    if (!queue_empty_error &&
+        !(queue_empty_error = PyErr_NewException("queue.Empty",
+                                                 PyExc_ValueError,
+                                                 NULL))) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (!queue_full_error &&
+        !(queue_full_error = PyErr_NewException("queue.Full",
+                                                PyExc_ValueError,
+                                                NULL))) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (PyObject_SetAttrString(m, "Empty", queue_empty_error) ||
+        PyObject_SetAttrString(m, "Full", queue_full_error)) {
+        /* failed to store the exceptions on the module */
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    if (!queue_resolve_future_callback &&
+        !(queue_resolve_future_callback =
+          PyCFunction_New(&queue_resolve_future_def, NULL))) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
     return m;
 }